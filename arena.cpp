@@ -0,0 +1,154 @@
+/*
+Per-worker scratch arena for the converters
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cryxmlb.h"
+
+// Every allocation starts with this header, so scratch_free can tell arena
+// memory from heap memory whichever thread frees it
+struct scratch_header_t {
+	arena_t* arena; // Null for heap memory
+	size_t size;
+};
+
+static const size_t SCRATCH_ALIGN = 16;
+static const size_t SCRATCH_HEADER_SIZE = (sizeof(scratch_header_t) + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+static const size_t ARENA_MIN_BLOCK_SIZE = 1024 * 1024;
+
+struct arena_block_t {
+	arena_block_t* next;
+	size_t size;
+	size_t used;
+};
+
+static const size_t ARENA_BLOCK_HEADER_SIZE = (sizeof(arena_block_t) + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+
+thread_local arena_t* thread_arena = 0;
+
+static char* block_data(arena_block_t* block) {
+	return (char*)block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+arena_t::arena_t(size_t retain) : blocks(0), current(0), retain_bytes(retain) {
+}
+
+arena_t::~arena_t() {
+	while (blocks) {
+		arena_block_t* next = blocks->next;
+		free(blocks);
+		blocks = next;
+	}
+}
+
+// Takes size bytes from the current block or a later one, adding a block
+// at the end when none has room. current is only null while there are no
+// blocks.
+static void* arena_alloc(arena_t* arena, size_t size) {
+	size = (size + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+	arena_block_t* last = 0;
+	for (arena_block_t* block = arena->current; block; block = block->next) {
+		if (block->size - block->used >= size) {
+			arena->current = block;
+			void* mem = block_data(block) + block->used;
+			block->used += size;
+			return mem;
+		}
+		last = block;
+	}
+	size_t block_size = size > ARENA_MIN_BLOCK_SIZE ? size : ARENA_MIN_BLOCK_SIZE;
+	arena_block_t* block = (arena_block_t*)malloc(ARENA_BLOCK_HEADER_SIZE + block_size);
+	if (!block) {
+		return 0;
+	}
+	block->next = 0;
+	block->size = block_size;
+	block->used = size;
+	if (last) {
+		last->next = block;
+	}
+	else {
+		arena->blocks = block;
+	}
+	arena->current = block;
+	return block_data(block);
+}
+
+// Makes all memory available again. Blocks are kept in order until the
+// retention cap is reached; the rest go back to the system.
+void arena_reset(arena_t* arena) {
+	size_t kept = 0;
+	arena_block_t** link = &arena->blocks;
+	while (*link) {
+		arena_block_t* block = *link;
+		if (kept + block->size <= arena->retain_bytes) {
+			kept += block->size;
+			block->used = 0;
+			link = &block->next;
+		}
+		else {
+			*link = block->next;
+			free(block);
+		}
+	}
+	arena->current = arena->blocks;
+}
+
+// Allocates from the calling thread's arena, or the heap when it has none.
+// Returns null on failure.
+void* scratch_alloc(size_t size) {
+	arena_t* arena = thread_arena;
+	scratch_header_t* header = (scratch_header_t*)(arena ? arena_alloc(arena, SCRATCH_HEADER_SIZE + size) : malloc(SCRATCH_HEADER_SIZE + size));
+	if (!header) {
+		return 0;
+	}
+	header->arena = arena;
+	header->size = size;
+	return (char*)header + SCRATCH_HEADER_SIZE;
+}
+
+// Heap memory is freed. Arena memory stays until the arena is reset, except
+// that the newest allocation of the thread's own arena is given back, which
+// lets a growing vector reuse its space.
+void scratch_free(void* mem) {
+	if (!mem) {
+		return;
+	}
+	scratch_header_t* header = (scratch_header_t*)((char*)mem - SCRATCH_HEADER_SIZE);
+	if (!header->arena) {
+		free(header);
+		return;
+	}
+	arena_t* arena = header->arena;
+	arena_block_t* block = arena->current;
+	if (arena == thread_arena && block) {
+		size_t size = (SCRATCH_HEADER_SIZE + header->size + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+		if ((char*)header + size == block_data(block) + block->used) {
+			block->used -= size;
+		}
+	}
+}
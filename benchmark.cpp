@@ -0,0 +1,592 @@
+/*
+CryXmlB converter benchmark
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "cryxmlb.h"
+
+// Small deterministic generator (splitmix64), so a seed gives the same
+// corpus on every platform and standard library.
+struct bench_random_t {
+	uint64_t state;
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+	uint32_t below(uint32_t n) {
+		return (uint32_t)(next() % n);
+	}
+};
+
+// Shape of one synthetic corpus
+struct bench_shape_t {
+	const char* name;
+	int file_count;
+	int top_level;      // Children of each root
+	int depth;          // Levels below the root
+	int fanout;         // Children per node below the top level
+	int attributes;     // Attributes per node
+	int text_length;    // Characters of text per node, 0 for none
+};
+
+struct bench_corpus_t {
+	const char* name;
+	std::vector<std::string> files;
+	uint64_t xml_bytes;
+	uint64_t nodes;
+};
+
+static const char* const bench_names[] = {
+	"Entity", "Layer", "Prop", "Item", "Param", "Brush", "Light", "Area", "Object", "Vehicle"
+};
+static const char* const bench_attr_names[] = {
+	"Name", "Pos", "Rotate", "Scale", "Class", "Id", "Layer", "Flags", "Material", "Model"
+};
+
+static void bench_append_value(std::string& out, bench_random_t& rng) {
+	switch (rng.below(8)) {
+	case 0:
+		out += "Objects/";
+		out += bench_names[rng.below(10)];
+		out += ".cgf";
+		break;
+	case 1:
+		// Needs escaping on the way out
+		out += "a &amp; b &lt; c";
+		break;
+	default: {
+		char buf[64];
+		sprintf(buf, "%u,%u,%u", rng.below(4096), rng.below(4096), rng.below(512));
+		out += buf;
+		break;
+	}
+	}
+}
+
+static void bench_append_node(std::string& out, bench_random_t& rng, const bench_shape_t& shape, int level, int children, uint64_t* nodes) {
+	const char* name = bench_names[rng.below(10)];
+	for (int i = 0; i < level; i++) {
+		out += "  ";
+	}
+	out += '<';
+	out += name;
+	for (int i = 0; i < shape.attributes; i++) {
+		out += ' ';
+		out += bench_attr_names[i % 10];
+		if (i >= 10) {
+			char buf[16];
+			sprintf(buf, "%d", i / 10);
+			out += buf;
+		}
+		out += "=\"";
+		bench_append_value(out, rng);
+		out += '"';
+	}
+	(*nodes)++;
+	if (children == 0 && shape.text_length == 0) {
+		out += "/>\n";
+		return;
+	}
+	out += '>';
+	for (int i = 0; i < shape.text_length; i++) {
+		out += (char)('a' + rng.below(26));
+		if (rng.below(8) == 0) {
+			out += ' ';
+		}
+	}
+	if (children) {
+		out += '\n';
+		for (int i = 0; i < children; i++) {
+			bench_append_node(out, rng, shape, level + 1, level + 1 < shape.depth ? shape.fanout : 0, nodes);
+		}
+		for (int i = 0; i < level; i++) {
+			out += "  ";
+		}
+	}
+	out += "</";
+	out += name;
+	out += ">\n";
+}
+
+static bench_corpus_t bench_generate(const bench_shape_t& shape, uint64_t seed) {
+	bench_corpus_t corpus;
+	corpus.name = shape.name;
+	corpus.xml_bytes = 0;
+	corpus.nodes = 0;
+	bench_random_t rng = { seed };
+	for (int f = 0; f < shape.file_count; f++) {
+		std::string xml = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+		bench_append_node(xml, rng, shape, 0, shape.top_level, &corpus.nodes);
+		corpus.xml_bytes += xml.size();
+		corpus.files.push_back(xml);
+	}
+	return corpus;
+}
+
+enum bench_phase_t {
+	PHASE_READ,
+	PHASE_PARSE,
+	PHASE_ENCODE,
+	PHASE_SERIALIZE,
+	PHASE_DECODE,
+	PHASE_REBUILD,
+	PHASE_SAVE,
+	PHASE_STREAM,
+	PHASE_CONVERT,
+	PHASE_COUNT
+};
+
+// decode, dom_rebuild and save_file time the DOM path; stream_xml and
+// convert_file time what --to-xml runs
+static const char* const bench_phase_names[PHASE_COUNT] = {
+	"read_file", "parse", "encode", "serialize", "decode", "dom_rebuild", "save_file", "stream_xml", "convert_file"
+};
+
+struct bench_stats_t {
+	double median;
+	double mean;
+	double stddev;
+};
+
+static double bench_median(std::vector<double> samples) {
+	if (samples.empty()) {
+		return 0;
+	}
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	return (n % 2) ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+// Median absolute deviation, a spread estimate that ignores outliers
+static double bench_mad(const std::vector<double>& samples, double median) {
+	std::vector<double> deviations;
+	for (double s : samples) {
+		deviations.push_back(fabs(s - median));
+	}
+	return bench_median(deviations);
+}
+
+static bench_stats_t bench_summarize(const std::vector<double>& samples) {
+	bench_stats_t stats = {};
+	if (samples.empty()) {
+		return stats;
+	}
+	size_t n = samples.size();
+	stats.median = bench_median(samples);
+	for (double s : samples) {
+		stats.mean += s;
+	}
+	stats.mean /= n;
+	for (double s : samples) {
+		stats.stddev += (s - stats.mean) * (s - stats.mean);
+	}
+	stats.stddev = n > 1 ? sqrt(stats.stddev / (n - 1)) : 0;
+	return stats;
+}
+
+// Same clock as the converters' phase timers
+static double bench_seconds_since(double start) {
+	return stats_now() - start;
+}
+
+// Runs every phase once over all files of a corpus and adds the time spent
+// in each phase to times. Returns false if any step fails.
+static bool bench_run_corpus(const bench_corpus_t& corpus, const char* dir, double* times, uint64_t* cryxmlb_bytes, uint64_t* xml_out_bytes) {
+	std::string xml_path = std::string(dir) + "/input.xml";
+	std::string out_path = std::string(dir) + "/output.xml";
+	std::string stream_path = std::string(dir) + "/stream.xml";
+	std::string convert_path = std::string(dir) + "/convert.bin";
+
+	// convert_file with the threads --parallel gives it, so large files take
+	// the parallel printer
+	convert_options_t convert_options = {};
+	convert_options.threads = std::thread::hardware_concurrency();
+	convert_options.layout = LAYOUT_PREORDER;
+	convert_options.messages = stdout;
+	*cryxmlb_bytes = 0;
+	*xml_out_bytes = 0;
+	for (const std::string& text : corpus.files) {
+		if (!write_file(xml_path.c_str(), (const unsigned char*)text.data(), text.size())) {
+			return false;
+		}
+
+		double start = stats_now();
+		read_file_result_t xml_file = read_file(xml_path.c_str());
+		times[PHASE_READ] += bench_seconds_since(start);
+		if (!xml_file.data) {
+			return false;
+		}
+
+		cryxmlb_tables_t tables;
+		{
+			tinyxml2::XMLDocument doc;
+			start = stats_now();
+			tinyxml2::XMLError error = doc.Parse((const char*)xml_file.data, xml_file.size);
+			times[PHASE_PARSE] += bench_seconds_since(start);
+			free(xml_file.data);
+			if (error != tinyxml2::XML_SUCCESS || !doc.RootElement()) {
+				fprintf(stderr, "Benchmark corpus %s does not parse: %s\n", corpus.name, doc.ErrorStr());
+				return false;
+			}
+
+			start = stats_now();
+			const char* encode_error = 0;
+			if (!encode_xml_tables(doc.RootElement(), tables, &encode_error)) {
+				fprintf(stderr, "Benchmark corpus %s does not encode: %s\n", corpus.name, encode_error);
+				return false;
+			}
+			times[PHASE_ENCODE] += bench_seconds_since(start);
+		}
+
+		output_buffer_t output_buffer;
+		start = stats_now();
+		serialize_cryxmlb(tables, output_buffer);
+		times[PHASE_SERIALIZE] += bench_seconds_since(start);
+		*cryxmlb_bytes += output_buffer.size();
+
+		cryxmlb_file_t cry_file;
+		start = stats_now();
+		bool decoded = decode_cryxmlb("(benchmark)", output_buffer.data(), output_buffer.size(), &cry_file);
+		times[PHASE_DECODE] += bench_seconds_since(start);
+		if (!decoded) {
+			return false;
+		}
+
+		tinyxml2::XMLDocument doc;
+		start = stats_now();
+		bool built = build_xml_document(&cry_file, &doc);
+		times[PHASE_REBUILD] += bench_seconds_since(start);
+		free_cryxmlb(&cry_file);
+		if (!built) {
+			return false;
+		}
+
+		start = stats_now();
+		bool saved = save_xml_document(&doc, out_path.c_str());
+		times[PHASE_SAVE] += bench_seconds_since(start);
+		if (!saved) {
+			return false;
+		}
+		FILE* f = fopen(out_path.c_str(), "rb");
+		if (f) {
+			fseek(f, 0L, SEEK_END);
+			*xml_out_bytes += ftell(f);
+			fclose(f);
+		}
+
+		// Printed straight from the tables, as --to-xml does by default
+		mapped_file_t input = { output_buffer.data(), output_buffer.size(), false };
+		binary_stream_t stream = { output_buffer.data(), 0, output_buffer.size() };
+		cryxmlb_header_t header;
+		start = stats_now();
+		bool streamed = read_cryxmlb_header("(benchmark)", &stream, &header)
+			&& write_xml_streaming(stream_path.c_str(), &input, &header, 0);
+		times[PHASE_STREAM] += bench_seconds_since(start);
+		if (!streamed) {
+			return false;
+		}
+
+		// The whole of convert_file on a copy, backup included
+		if (!write_file(convert_path.c_str(), output_buffer.data(), output_buffer.size())) {
+			return false;
+		}
+		start = stats_now();
+		convert_file(convert_path.c_str(), &convert_options, 0);
+		times[PHASE_CONVERT] += bench_seconds_since(start);
+		f = fopen(convert_path.c_str(), "rb");
+		bool converted = f && fgetc(f) == '<';
+		if (f) {
+			fclose(f);
+		}
+		if (!converted) {
+			return false;
+		}
+	}
+	remove(xml_path.c_str());
+	remove(out_path.c_str());
+	remove(stream_path.c_str());
+	remove(convert_path.c_str());
+	remove((convert_path + ".bak").c_str());
+	return true;
+}
+
+// Timings of one phase on one corpus
+struct bench_result_t {
+	std::string corpus;
+	std::string phase;
+	std::vector<double> samples;
+};
+
+// A baseline is plain text: a header line, then one line per corpus and
+// phase with the number of samples and the samples in seconds.
+static bool bench_save_baseline(const char* filename, const std::vector<bench_result_t>& results, double scale, uint64_t seed) {
+	FILE* out = fopen(filename, "w");
+	if (!out) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return false;
+	}
+	fprintf(out, "cryxmlb-baseline 1 scale %.17g seed %llu\n", scale, (unsigned long long)seed);
+	for (const bench_result_t& result : results) {
+		fprintf(out, "%s %s %u", result.corpus.c_str(), result.phase.c_str(), (unsigned)result.samples.size());
+		for (double s : result.samples) {
+			fprintf(out, " %.9g", s);
+		}
+		fputc('\n', out);
+	}
+	fclose(out);
+	return true;
+}
+
+static bool bench_load_baseline(const char* filename, std::vector<bench_result_t>* results, double* scale, uint64_t* seed) {
+	FILE* in = fopen(filename, "r");
+	if (!in) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return false;
+	}
+	int version = 0;
+	unsigned long long seed_value = 0;
+	bool ok = fscanf(in, "cryxmlb-baseline %d scale %lf seed %llu", &version, scale, &seed_value) == 3 && version == 1;
+	*seed = seed_value;
+	char corpus[64];
+	char phase[64];
+	unsigned count;
+	while (ok && fscanf(in, "%63s %63s %u", corpus, phase, &count) == 3) {
+		bench_result_t result;
+		result.corpus = corpus;
+		result.phase = phase;
+		result.samples.resize(count);
+		for (unsigned i = 0; i < count && ok; i++) {
+			ok = fscanf(in, "%lf", &result.samples[i]) == 1;
+		}
+		results->push_back(result);
+	}
+	ok = ok && feof(in) && !results->empty();
+	fclose(in);
+	if (!ok) {
+		fprintf(stderr, "File %s is not a benchmark baseline\n", filename);
+	}
+	return ok;
+}
+
+// A phase regresses when its median grew by more than the relative
+// threshold and by more than three times the combined noise (MAD scaled
+// to a standard deviation) of both runs. Very short phases also need to
+// lose 50 microseconds, below which timer noise dominates. Returns the
+// number of regressions.
+static int bench_compare(const std::vector<bench_result_t>& baseline, const std::vector<bench_result_t>& results, double threshold) {
+	int regressions = 0;
+	fprintf(stdout, "Comparison against baseline (threshold %.1f%%)\n\n", threshold * 100);
+	fprintf(stdout, "%-12s %-12s %12s %12s %8s %10s  %s\n", "corpus", "phase", "baseline ms", "current ms", "change", "noise ms", "verdict");
+	for (const bench_result_t& result : results) {
+		const bench_result_t* base = 0;
+		for (const bench_result_t& b : baseline) {
+			if (b.corpus == result.corpus && b.phase == result.phase) {
+				base = &b;
+				break;
+			}
+		}
+		if (!base || base->samples.empty()) {
+			fprintf(stdout, "%-12s %-12s %12s\n", result.corpus.c_str(), result.phase.c_str(), "(missing)");
+			continue;
+		}
+		double base_median = bench_median(base->samples);
+		double median = bench_median(result.samples);
+		double base_mad = bench_mad(base->samples, base_median);
+		double mad = bench_mad(result.samples, median);
+		double noise = 3 * 1.4826 * sqrt(base_mad * base_mad + mad * mad);
+		double delta = median - base_median;
+		const char* verdict = "ok";
+		if (delta > threshold * base_median && delta > noise && delta > 50e-6) {
+			verdict = "REGRESSION";
+			regressions++;
+		}
+		else if (-delta > threshold * base_median && -delta > noise && -delta > 50e-6) {
+			verdict = "faster";
+		}
+		fprintf(stdout, "%-12s %-12s %12.3f %12.3f %+7.1f%% %10.3f  %s\n", result.corpus.c_str(), result.phase.c_str(),
+			base_median * 1000, median * 1000, base_median > 0 ? 100 * delta / base_median : 0.0, noise * 1000, verdict);
+	}
+	fprintf(stdout, "\n%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+	return regressions;
+}
+
+static void bench_make_dir(const char* dir) {
+#if defined(_WIN32)
+	_mkdir(dir);
+#else
+	mkdir(dir, 0777);
+#endif
+}
+
+int run_benchmark(int argc, char* argv[]) {
+	int iterations = 5;
+	double scale = 1.0;
+	uint64_t seed = 1;
+	const char* dir = "cryxmlb_bench";
+	const char* save_path = 0;
+	const char* compare_path = 0;
+	double threshold = 0.10;
+	bool scale_given = false;
+	bool seed_given = false;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		if (strcmp(arg, "--benchmark") == 0) {
+			continue;
+		}
+		else if (strncmp(arg, "--iterations=", 13) == 0) {
+			iterations = atoi(arg + 13);
+		}
+		else if (strncmp(arg, "--scale=", 8) == 0) {
+			scale = atof(arg + 8);
+			scale_given = true;
+		}
+		else if (strncmp(arg, "--seed=", 7) == 0) {
+			seed = strtoull(arg + 7, 0, 10);
+			seed_given = true;
+		}
+		else if (strncmp(arg, "--dir=", 6) == 0) {
+			dir = arg + 6;
+		}
+		else if (strncmp(arg, "--save-baseline=", 16) == 0) {
+			save_path = arg + 16;
+		}
+		else if (strncmp(arg, "--compare=", 10) == 0) {
+			compare_path = arg + 10;
+		}
+		else if (strncmp(arg, "--threshold=", 12) == 0) {
+			threshold = atof(arg + 12) / 100;
+		}
+		else {
+			fprintf(stderr, "Unknown benchmark option %s\n", arg);
+			return 1;
+		}
+	}
+	// A comparison runs the corpus the baseline was made from
+	std::vector<bench_result_t> baseline;
+	if (compare_path) {
+		double base_scale;
+		uint64_t base_seed;
+		if (!bench_load_baseline(compare_path, &baseline, &base_scale, &base_seed)) {
+			return 1;
+		}
+		if ((scale_given && scale != base_scale) || (seed_given && seed != base_seed)) {
+			fprintf(stderr, "Baseline %s was made with scale %g and seed %llu\n", compare_path, base_scale, (unsigned long long)base_seed);
+			return 1;
+		}
+		scale = base_scale;
+		seed = base_seed;
+	}
+	if (iterations < 1 || scale <= 0 || threshold < 0) {
+		fprintf(stderr, "Invalid benchmark options\n");
+		return 1;
+	}
+
+	// Sizes are for scale 1; most corpora come out at a few megabytes and
+	// "huge" at about 40 MB.
+	bench_shape_t shapes[] = {
+		{ "deep",        (int)(2 * scale) + 1, 400,                     80, 1, 2,  0 },
+		{ "wide",        1,                    (int)(60000 * scale) + 1, 1,  0, 2,  0 },
+		{ "attr_heavy",  1,                    (int)(2500 * scale) + 1,  2,  2, 24, 0 },
+		{ "text_heavy",  1,                    (int)(4000 * scale) + 1,  2,  2, 1,  400 },
+		{ "tiny_files",  (int)(2000 * scale) + 1, 3,                     2,  2, 3,  8 },
+		{ "huge",        1,                    (int)(40000 * scale) + 1, 4,  2, 4,  16 },
+	};
+
+	bench_make_dir(dir);
+	fprintf(stdout, "Benchmark: %d iterations, scale %g, seed %llu\n\n", iterations, scale, (unsigned long long)seed);
+	fprintf(stdout, "%-12s %-12s %10s %10s %8s %10s %12s\n", "corpus", "phase", "median ms", "mean ms", "stddev%", "MB/s", "nodes/s");
+
+	std::vector<bench_result_t> results;
+	for (const bench_shape_t& shape : shapes) {
+		bench_corpus_t corpus = bench_generate(shape, seed);
+		std::vector<double> samples[PHASE_COUNT];
+		uint64_t cryxmlb_bytes = 0;
+		uint64_t xml_out_bytes = 0;
+
+		// One warm-up pass, then the timed ones
+		for (int it = 0; it <= iterations; it++) {
+			double times[PHASE_COUNT] = {};
+			if (!bench_run_corpus(corpus, dir, times, &cryxmlb_bytes, &xml_out_bytes)) {
+				fprintf(stderr, "Benchmark failed on corpus %s\n", corpus.name);
+				return 1;
+			}
+			if (it > 0) {
+				for (int p = 0; p < PHASE_COUNT; p++) {
+					samples[p].push_back(times[p]);
+				}
+			}
+		}
+
+		// Throughput is measured against what each phase consumes
+		uint64_t phase_bytes[PHASE_COUNT] = {
+			corpus.xml_bytes, corpus.xml_bytes, corpus.xml_bytes, cryxmlb_bytes, cryxmlb_bytes, cryxmlb_bytes, xml_out_bytes,
+			cryxmlb_bytes, cryxmlb_bytes
+		};
+		for (int p = 0; p < PHASE_COUNT; p++) {
+			bench_stats_t stats = bench_summarize(samples[p]);
+			double median = stats.median > 0 ? stats.median : 1e-9;
+			fprintf(stdout, "%-12s %-12s %10.3f %10.3f %7.1f%% %10.1f %12.0f\n",
+				corpus.name, bench_phase_names[p], stats.median * 1000, stats.mean * 1000,
+				stats.mean > 0 ? 100 * stats.stddev / stats.mean : 0.0,
+				phase_bytes[p] / median / (1024 * 1024), corpus.nodes / median);
+			bench_result_t result;
+			result.corpus = corpus.name;
+			result.phase = bench_phase_names[p];
+			result.samples = samples[p];
+			results.push_back(result);
+		}
+		fprintf(stdout, "%-12s %u files, %.1f MB XML, %.1f MB CryXmlB, %llu nodes\n\n", corpus.name,
+			(unsigned)corpus.files.size(), corpus.xml_bytes / (1024.0 * 1024), cryxmlb_bytes / (1024.0 * 1024),
+			(unsigned long long)corpus.nodes);
+	}
+
+	if (save_path) {
+		if (!bench_save_baseline(save_path, results, scale, seed)) {
+			return 1;
+		}
+		fprintf(stdout, "Baseline saved to %s\n", save_path);
+	}
+	if (compare_path && bench_compare(baseline, results, threshold) > 0) {
+		return 2;
+	}
+	return 0;
+}
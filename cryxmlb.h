@@ -0,0 +1,523 @@
+/*
+CryXmlB converter - shared declarations
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CRYXMLB_H
+#define CRYXMLB_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <new>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "tinyxml2.h"
+
+// On-disk layout of a node table entry
+struct cry_xml_node_t {
+	int32_t name_offset;
+	int32_t content_offset;
+	int16_t attribute_count;
+	int16_t child_count;
+	int32_t parent_id;
+	int32_t first_attr_idx;
+	int32_t first_child_idx;
+	int32_t reserved;
+};
+
+// On-disk layout of an attribute table entry
+struct cry_xml_ref_t {
+	int32_t name_offset;
+	int32_t value_offset;
+};
+
+struct read_file_result_t {
+	unsigned char* data;
+	uint64_t size;
+};
+
+// Allocations counted by --alloc-stats
+enum alloc_kind_t {
+	ALLOC_ELEMENT_POOL,
+	ALLOC_ATTRIBUTE_POOL,
+	ALLOC_TEXT_POOL,
+	ALLOC_COMMENT_POOL,
+	ALLOC_DYNARRAY,
+	ALLOC_TABLES,
+	ALLOC_OUTPUT,
+	ALLOC_KIND_COUNT
+};
+
+// Live allocation counters for one file, shared by the threads working on it
+struct alloc_tracker_t {
+	std::atomic<uint64_t> allocations[ALLOC_KIND_COUNT];
+	std::atomic<uint64_t> bytes[ALLOC_KIND_COUNT];
+	std::atomic<int64_t> current[ALLOC_KIND_COUNT];
+	std::atomic<int64_t> peak[ALLOC_KIND_COUNT];
+};
+
+// Tracker of the file the calling thread works on, or null
+extern thread_local alloc_tracker_t* alloc_tracker;
+
+void alloc_count_slow(alloc_tracker_t* tracker, alloc_kind_t kind, size_t old_bytes, size_t new_bytes);
+
+// Records that a block of old_bytes was replaced by one of new_bytes; either may be 0
+inline void alloc_count(alloc_kind_t kind, size_t old_bytes, size_t new_bytes) {
+	alloc_tracker_t* tracker = alloc_tracker;
+	if (tracker) {
+		alloc_count_slow(tracker, kind, old_bytes, new_bytes);
+	}
+}
+
+// Sets the calling thread's tracker for the lifetime of the scope
+struct alloc_scope_t {
+	alloc_tracker_t* previous;
+	explicit alloc_scope_t(alloc_tracker_t* tracker) : previous(alloc_tracker) {
+		alloc_tracker = tracker;
+	}
+	~alloc_scope_t() {
+		alloc_tracker = previous;
+	}
+};
+
+// Bump allocator for a worker's per-file scratch memory. Everything is
+// released at once by arena_reset, which keeps up to retain_bytes of blocks
+// for the next file.
+struct arena_block_t;
+struct arena_t {
+	arena_block_t* blocks;
+	arena_block_t* current;
+	size_t retain_bytes;
+
+	explicit arena_t(size_t retain);
+	~arena_t();
+};
+
+// Arena of the worker the calling thread belongs to, or null
+extern thread_local arena_t* thread_arena;
+
+// arena.cpp
+void arena_reset(arena_t* arena);
+void* scratch_alloc(size_t size);
+void scratch_free(void* mem);
+
+// std::vector allocator that reports to the thread's tracker and takes its
+// memory from the thread's arena
+template <class T, alloc_kind_t KIND>
+struct counted_allocator_t {
+	typedef T value_type;
+	template <class U> struct rebind {
+		typedef counted_allocator_t<U, KIND> other;
+	};
+	counted_allocator_t() {}
+	template <class U> counted_allocator_t(const counted_allocator_t<U, KIND>&) {}
+	T* allocate(size_t count) {
+		T* mem = static_cast<T*>(scratch_alloc(count * sizeof(T)));
+		if (!mem) {
+			throw std::bad_alloc();
+		}
+		alloc_count(KIND, 0, count * sizeof(T));
+		return mem;
+	}
+	void deallocate(T* mem, size_t count) {
+		alloc_count(KIND, count * sizeof(T), 0);
+		scratch_free(mem);
+	}
+	template <class U> bool operator==(const counted_allocator_t<U, KIND>&) const { return true; }
+	template <class U> bool operator!=(const counted_allocator_t<U, KIND>&) const { return false; }
+};
+
+template <class T> using table_vector_t = std::vector<T, counted_allocator_t<T, ALLOC_TABLES> >;
+typedef std::vector<unsigned char, counted_allocator_t<unsigned char, ALLOC_OUTPUT> > output_buffer_t;
+
+// A file mapped into memory by map_file, or read when it cannot be mapped
+struct mapped_file_t {
+	unsigned char* data;
+	uint64_t size;
+	bool mapped;
+};
+
+// Bounds-checked little-endian reads over a file in memory
+struct binary_stream_t {
+	unsigned char* data;
+	uint64_t ptr;
+	uint64_t size;
+};
+
+// Offsets and sizes from the header of a CryXmlB file
+struct cryxmlb_header_t {
+	uint32_t file_size;
+	uint32_t node_table_offset;
+	uint32_t node_table_count;
+	uint32_t attr_table_offset;
+	uint32_t attr_table_count;
+	uint32_t child_table_offset;
+	uint32_t child_table_count;
+	uint32_t data_table_offset;
+	uint32_t data_table_size;
+};
+
+// The four tables of a CryXmlB file, in the order they are written
+struct cryxmlb_tables_t {
+	table_vector_t<cry_xml_node_t> node_table;
+	table_vector_t<cry_xml_ref_t> attr_table;
+	table_vector_t<uint32_t> child_table;
+	table_vector_t<char> data_table;
+};
+
+// Entry counts of the four tables, for reserving them up front
+struct cryxmlb_table_sizes_t {
+	size_t nodes;
+	size_t attributes;
+	size_t children;
+	size_t data_bytes;
+};
+
+// Builds the tables of one tree from calls in document order, without any
+// XML text in between. begin_element adds the node; attribute and text
+// apply to the element begun last, until its first child is begun. Child
+// table entries are filled in by finish, which must be called once the root
+// is ended and before the tables are serialized.
+//
+//	cryxmlb_writer_t writer;
+//	writer.begin_element("Settings");
+//	writer.attribute("Quality", "High");
+//	writer.text("...");
+//	writer.end_element();
+//	if (writer.finish()) {
+//		writer.save("Settings.xml");
+//	}
+//
+// The tables come out exactly as the converter encodes the same XML when
+// text is given before the attributes and strings are not interned.
+// Interning stores each distinct string once.
+struct cryxmlb_writer_t {
+	// Into tables of its own
+	explicit cryxmlb_writer_t(bool intern_strings = true);
+	// Appending one tree to tables, which must outlive the writer
+	cryxmlb_writer_t(cryxmlb_tables_t* tables, bool intern_strings);
+
+	void begin_element(const char* name);
+	void attribute(const char* name, const char* value);
+	void text(const char* text); // Null is the same as empty
+	void end_element();
+
+	// The same with strings already in the data table, given by offset:
+	// strings added with add_string, or a block of them such as another
+	// file's data table added with add_strings. Strings in a block keep
+	// their offsets in it, moved by the offset returned, and are not
+	// interned.
+	int32_t add_string(const char* str);
+	int32_t add_strings(const char* block, size_t size); // Must end with a null
+	void begin_element_at(int32_t name_offset);
+	void attribute_at(int32_t name_offset, int32_t value_offset);
+	void text_at(int32_t offset);
+
+	// Returns false, with error set, if the calls did not make one tree
+	bool finish();
+	const char* error() const { return error_message; }
+
+	cryxmlb_tables_t& tables() { return *target; }
+
+	// Only a finished tree can be written out
+	void serialize(output_buffer_t& output_buffer) const;
+	bool save(const char* filename);
+
+private:
+	// An interned string: its offset in the data table and its hash
+	struct intern_slot_t {
+		int32_t offset; // -1 for a free slot
+		uint32_t hash;
+	};
+
+	cryxmlb_tables_t own_tables;
+	cryxmlb_tables_t* target;
+	size_t node_base;
+	size_t child_base;
+	std::vector<int32_t> open_elements; // Node indices from the root down
+	bool head_open;    // The last element begun takes attributes and text
+	bool text_written; // ... and its content string is in the data table
+	bool finished;
+	bool intern;
+	std::vector<intern_slot_t> intern_slots;
+	size_t interned;
+	const char* error_message;
+
+	cryxmlb_writer_t(const cryxmlb_writer_t&);
+	cryxmlb_writer_t& operator=(const cryxmlb_writer_t&);
+	void init(bool intern_strings);
+	bool fail(const char* message);
+	bool begin_node();
+	bool begin_attribute();
+	bool valid_offset(int32_t offset);
+	void write_empty_text();
+};
+
+// Tables decoded from a CryXmlB file. data_table points into the file data.
+struct cryxmlb_file_t {
+	cry_xml_node_t* node_table;
+	uint32_t node_table_count;
+	cry_xml_ref_t* attr_table;
+	uint32_t attr_table_count;
+	uint32_t* child_table;
+	uint32_t child_table_count;
+	char* data_table;
+	uint32_t data_table_size;
+};
+
+// Node order written by the XML to CryXmlB converter
+enum node_layout_t {
+	LAYOUT_PREORDER, // Depth first, as the engine's own tools write
+	LAYOUT_BFS       // Breadth first; the children of a node are contiguous
+};
+
+// Conversion settings shared by both directions
+struct convert_options_t {
+	unsigned threads; // More than one enables the parallel paths for large files
+	bool track_allocations;
+	node_layout_t layout;
+	uint64_t memory_budget; // Bytes; non-zero spills the writer's tables to disk beyond it
+	FILE* messages; // Progress messages; stderr when stdout carries a report
+};
+
+// Phases timed by --stats
+enum stats_phase_t {
+	STATS_READ,
+	STATS_PARSE,
+	STATS_ENCODE,
+	STATS_SERIALIZE,
+	STATS_WRITE,
+	STATS_PHASE_COUNT
+};
+
+// Allocation totals of one kind. For the node pools, allocations counts
+// items, bytes the pool blocks and peak_bytes the most items in use at once.
+struct alloc_usage_t {
+	uint64_t allocations;
+	uint64_t bytes;
+	uint64_t peak_bytes;
+};
+
+// What --stats reports for one file
+struct conversion_stats_t {
+	const char* filename;
+	bool to_cryxmlb;
+	bool converted;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	double seconds[STATS_PHASE_COUNT];
+	uint64_t nodes;
+	uint64_t attributes;
+	uint64_t children;
+	uint64_t data_table_size;
+	uint64_t string_bytes; // Bytes of all strings the tables refer to, counted once per reference
+	uint64_t peak_memory;  // Peak resident memory of the process so far
+	bool allocations_tracked;
+	alloc_usage_t allocations[ALLOC_KIND_COUNT];
+};
+
+struct cryxmlb_reader_t;
+struct cryxmlb_element_t;
+
+// Query paths, compiled from text by compile_query:
+//
+//	/Root/Child        elements by name from the root; a path without the
+//	                   leading / is read the same way
+//	//Entity           at any depth; // also works between steps
+//	*                  any name
+//	[@Class]           that have the attribute
+//	[@Class='Door']    whose attribute equals, starts with (^=) or matches
+//	[@Name^='Door']    a regular expression (=~, ECMAScript, anywhere in the
+//	[@Name=~'^D.*r$']  value); quotes are optional
+//	.../@Name          the attribute's values instead of the elements
+//
+// Strings the query compares against are string tests; a test's result is
+// cached by data table offset, so files that store each string once (such
+// as cryxmlb_writer_t writes) compare every distinct string once and
+// everything after is an integer comparison.
+enum query_op_t {
+	QUERY_EQUALS,
+	QUERY_PREFIX,
+	QUERY_REGEX
+};
+
+struct query_string_test_t {
+	query_op_t op;
+	std::string literal;
+	std::regex regex; // For QUERY_REGEX
+};
+
+// [@name] with value_test -1, or [@name op value]
+struct query_predicate_t {
+	int name_test;
+	int value_test;
+};
+
+struct query_step_t {
+	bool descendant; // Any depth below the context, not only children
+	int name_test;   // -1 for *
+	std::vector<query_predicate_t> predicates;
+};
+
+struct cryxmlb_query_t {
+	std::vector<query_step_t> steps;
+	std::string attribute; // Name after a final /@, or empty
+	int attribute_test;    // Its test, or -1
+	std::vector<query_string_test_t> tests;
+};
+
+// Per-thread evaluation state, reused from one file to the next
+struct query_cache_entry_t {
+	uint32_t offset; // UINT32_MAX when empty
+	bool result;
+};
+
+struct query_state_t {
+	std::vector<query_cache_entry_t> cache; // A direct-mapped block per test
+	std::vector<uint32_t> visited;          // Stamp of the step that reached each node
+	uint32_t stamp;
+	std::vector<uint32_t> next;
+	std::vector<uint32_t> stack;
+};
+
+// A parsed --set: the elements the path selects get its attribute, or
+// their text when it does not end in one, set to value
+struct cryxmlb_assignment_t {
+	std::string spec; // As given, for messages
+	cryxmlb_query_t path;
+	std::string value;
+};
+
+// A 32-bit field of the file to overwrite
+struct cryxmlb_patch_edit_t {
+	uint64_t offset;
+	uint32_t value;
+};
+
+// What applying assignments to a file changes
+struct cryxmlb_patch_t {
+	std::vector<cryxmlb_patch_edit_t> edits;
+	std::vector<char> strings; // Appended to the data table
+	uint64_t file_size;        // Header fields after the patch
+	uint64_t data_size;
+	size_t elements;           // Selected, including those already set
+};
+
+// Elements rebuilt from CryXmlB only get an XMLText node when their content
+// is non-empty. The output format still treats every element as having text
+// first (that is what the tables describe), so print an empty text run for
+// the elements that have none to keep the layout unchanged.
+class cry_xml_printer_t : public tinyxml2::XMLPrinter {
+public:
+	cry_xml_printer_t(FILE* file = 0) : tinyxml2::XMLPrinter(file, false) {}
+
+	using tinyxml2::XMLPrinter::VisitEnter;
+	virtual bool VisitEnter(const tinyxml2::XMLElement& element, const tinyxml2::XMLAttribute* attribute) {
+		tinyxml2::XMLPrinter::VisitEnter(element, attribute);
+		const tinyxml2::XMLNode* first = element.FirstChild();
+		if (!first || !first->ToText()) {
+			PushText("");
+		}
+		return true;
+	}
+};
+
+// cryxmlb_to_xml.cpp
+read_file_result_t read_file(const char* filename);
+bool write_file(const char* filename, const unsigned char* data, size_t size);
+mapped_file_t map_file(const char* filename, bool sequential);
+void unmap_file(mapped_file_t* file);
+bool copy_file(const char* filename, const mapped_file_t* source, const char* source_name);
+bool read_cryxmlb_header(const char* filename, binary_stream_t* stream, cryxmlb_header_t* header);
+bool decode_cryxmlb(const char* filename, unsigned char* data, uint64_t size, cryxmlb_file_t* file);
+void free_cryxmlb(cryxmlb_file_t* file);
+bool check_cryxmlb_references(const cryxmlb_file_t* file, uint64_t data_size, char* message, size_t message_size);
+bool build_xml_document(const cryxmlb_file_t* file, tinyxml2::XMLDocument* doc);
+bool save_xml_document(const tinyxml2::XMLDocument* doc, const char* filename);
+bool print_xml_streaming(tinyxml2::XMLPrinter* printer, const mapped_file_t* input, const cryxmlb_header_t* header, uint64_t* string_bytes);
+bool write_xml_streaming(const char* filename, const mapped_file_t* input, const cryxmlb_header_t* header, uint64_t* string_bytes);
+void convert_file(const char* filename, const convert_options_t* options, conversion_stats_t* stats);
+
+// xml_to_cryxmlb.cpp
+void count_xml_tables(const tinyxml2::XMLElement* element, cryxmlb_table_sizes_t* sizes);
+void reserve_tables(cryxmlb_tables_t& tables, const cryxmlb_table_sizes_t& sizes);
+int seek_file(FILE* file, uint64_t offset);
+bool encode_xml_tables(tinyxml2::XMLElement* root, cryxmlb_tables_t& tables, const char** error);
+bool encode_xml_parallel(const char* xml, size_t size, unsigned thread_count, cryxmlb_tables_t& tables);
+bool layout_cryxmlb_bfs(cryxmlb_tables_t& tables);
+void serialize_cryxmlb(const cryxmlb_tables_t& tables, output_buffer_t& output_buffer);
+void convert_xml_to_cryxmlb(const char* filename, const convert_options_t* options, conversion_stats_t* stats);
+
+// patch.cpp
+bool parse_assignment(const char* spec, cryxmlb_assignment_t* assignment);
+bool plan_cryxmlb_patch(const unsigned char* data, uint64_t size, const cryxmlb_assignment_t* assignments, size_t count,
+	cryxmlb_patch_t* patch, char* message, size_t message_size);
+void apply_cryxmlb_patch(unsigned char* data, const cryxmlb_patch_t* patch);
+bool patch_cryxmlb_file(const char* filename, const cryxmlb_assignment_t* assignments, size_t count);
+
+// query.cpp
+bool compile_query(const char* text, cryxmlb_query_t* query, std::string* error);
+void query_begin_file(const cryxmlb_query_t* query, const cryxmlb_reader_t* reader, query_state_t* state);
+void run_query(const cryxmlb_query_t* query, const cryxmlb_reader_t* reader, query_state_t* state, std::vector<uint32_t>* nodes);
+void append_element_line(std::string* output, const char* filename, const cryxmlb_element_t& element);
+bool query_file(const char* filename, const cryxmlb_query_t* query, query_state_t* state, std::string* output, size_t* matches);
+void list_files(const char* path, std::vector<std::string>* files);
+
+// index.cpp
+bool build_cryxmlb_index(const char* filename, const std::vector<std::string>& key_attributes);
+bool lookup_file(const char* filename, const char* key, std::string* output, size_t* matches);
+
+// diff.cpp
+bool diff_cryxmlb_files(const char* old_name, const char* new_name, const char* delta_name, const std::vector<std::string>& key_attributes);
+bool apply_cryxmlb_delta(const char* delta_name, const char* old_name, const char* new_name);
+
+// merge.cpp
+bool merge_cryxmlb_file(const char* base_name, const char* const* overlay_names, size_t overlay_count,
+	const char* output_name, const std::vector<std::string>& key_attributes);
+
+// stats.cpp
+double stats_now();
+double stats_phase_end(conversion_stats_t* stats, stats_phase_t phase, double start);
+uint64_t peak_memory_bytes();
+uint64_t count_string_bytes(const cry_xml_node_t* node_table, uint64_t node_count,
+	const cry_xml_ref_t* attr_table, uint64_t attr_count, const char* data_table, uint64_t data_table_size);
+void alloc_tracking_start();
+void alloc_count_document(const tinyxml2::XMLDocument* doc);
+void alloc_report(const alloc_tracker_t* tracker, conversion_stats_t* stats);
+void print_stats(FILE* out, const conversion_stats_t* stats);
+void print_stats_summary(FILE* out, const conversion_stats_t* stats, size_t count);
+void print_stats_json(FILE* out, const conversion_stats_t* stats, size_t count);
+void trace_start();
+bool trace_enabled();
+void trace_event(const char* category, const char* name, const char* file, double start, double end);
+bool trace_write(const char* filename);
+
+// verify.cpp
+bool verify_file(const char* filename);
+
+// benchmark.cpp
+int run_benchmark(int argc, char* argv[]);
+
+#endif // CRYXMLB_H
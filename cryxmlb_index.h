@@ -0,0 +1,254 @@
+/*
+CryXmlB sidecar index
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CRYXMLB_INDEX_H
+#define CRYXMLB_INDEX_H
+
+#include "cryxmlb_reader.h"
+
+// Constant-time lookup of elements in a CryXmlB file through a sidecar
+// written by --build-index (file.xml.cxi next to file.xml). The sidecar is an
+// open-addressing hash table from keys to node indices, read in place like
+// the file itself:
+//
+//	/World/Layers/Layer      every element by the names on its path from the
+//	                         root, in that form (no trailing /)
+//	(Entity, Name, Player)   elements by name and the value of a key
+//	                         attribute given when the sidecar was built
+//
+// Each distinct key has one slot, which leads to a chain of the elements
+// with that key in document order. A lookup hashes the key, probes the
+// slots and checks each candidate against the file, so finding the first
+// element touches a slot, an entry, a node and its strings, and never
+// returns a wrong one. Nothing is allocated, and opening checks that the
+// sidecar was built for this file by comparing the CryXmlB header.
+//
+//	cryxmlb_index_t index;
+//	if (index.open(file_data, file_size, index_data, index_size)) {
+//		cryxmlb_element_t player = index.find("Entity", "Name", "Player");
+//	}
+//
+// Elements refer to the index's reader, so the index must stay where it is
+// while they are used.
+//
+// Sidecar layout, little-endian:
+//	char[8]   "CXIndex"
+//	uint32    version (1)
+//	uint32    slot count, a power of two
+//	uint32    entry count
+//	uint32    size of the key attribute names at the end
+//	uint32[9] the CryXmlB header after its signature
+//	slots     per slot: uint32 check (high half of the key's hash), uint32
+//	          first entry + 1 (0 for an empty slot)
+//	entries   per entry: uint32 node, uint32 next entry with the key + 1
+//	          (0 at the end of the chain)
+//	names     the key attribute names, each null-terminated
+
+static const uint32_t CRYXMLB_INDEX_VERSION = 1;
+static const size_t CRYXMLB_INDEX_HEADER_SIZE = 8 + 4 * 4 + 9 * 4;
+
+// FNV-1a over bytes, continued from hash
+inline uint64_t cryxmlb_index_feed(uint64_t hash, const char* data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+inline uint64_t cryxmlb_index_feed(uint64_t hash, std::string_view text) {
+	return cryxmlb_index_feed(hash, text.data(), text.size());
+}
+
+static const uint64_t CRYXMLB_INDEX_SEED = 14695981039346656037ull;
+
+// Spreads the bits of a hash before it picks a slot
+inline uint64_t cryxmlb_index_mix(uint64_t hash) {
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Hash of a key attribute; paths start with '/', so keys start with a byte
+// no path can
+inline uint64_t cryxmlb_index_key_hash(std::string_view element, std::string_view attribute, std::string_view value) {
+	uint64_t hash = cryxmlb_index_feed(CRYXMLB_INDEX_SEED, "\x01", 1);
+	hash = cryxmlb_index_feed(hash, element);
+	hash = cryxmlb_index_feed(hash, "", 1);
+	hash = cryxmlb_index_feed(hash, attribute);
+	hash = cryxmlb_index_feed(hash, "", 1);
+	return cryxmlb_index_mix(cryxmlb_index_feed(hash, value));
+}
+
+struct cryxmlb_index_t {
+	cryxmlb_reader_t reader;
+	const unsigned char* slots;
+	uint32_t mask; // Slot count - 1
+	const unsigned char* entries;
+	uint32_t entry_count;
+	const char* key_names;
+	uint32_t key_names_size;
+
+	cryxmlb_index_t() : slots(0), mask(0), entries(0), entry_count(0), key_names(0), key_names_size(0) {}
+
+	// Opens the file and its sidecar. Returns false if either is damaged or
+	// the sidecar is for another version of the file.
+	bool open(const void* file_data, size_t file_size, const void* index_data, size_t index_size) {
+		const unsigned char* bytes = (const unsigned char*)index_data;
+		slots = 0;
+		if (!reader.open(file_data, file_size) || !bytes || index_size < CRYXMLB_INDEX_HEADER_SIZE
+			|| memcmp(bytes, "CXIndex", 8) != 0 || cryxmlb_load32(bytes + 8) != CRYXMLB_INDEX_VERSION
+			|| memcmp(bytes + 24, (const unsigned char*)file_data + 8, 9 * 4) != 0) {
+			return false;
+		}
+		uint64_t slot_count = cryxmlb_load32(bytes + 12);
+		uint64_t entries_count = cryxmlb_load32(bytes + 16);
+		uint64_t names_size = cryxmlb_load32(bytes + 20);
+		if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0
+			|| CRYXMLB_INDEX_HEADER_SIZE + (slot_count + entries_count) * 8 + names_size != index_size) {
+			return false;
+		}
+		slots = bytes + CRYXMLB_INDEX_HEADER_SIZE;
+		mask = (uint32_t)slot_count - 1;
+		entries = slots + slot_count * 8;
+		entry_count = (uint32_t)entries_count;
+		key_names = (const char*)entries + entries_count * 8;
+		key_names_size = (uint32_t)names_size;
+		return true;
+	}
+
+	// Whether find can look up elements by this attribute
+	bool indexed(std::string_view attribute) const {
+		for (uint32_t i = 0; i < key_names_size;) {
+			std::string_view name(key_names + i, strnlen(key_names + i, key_names_size - i));
+			if (name == attribute) {
+				return true;
+			}
+			i += (uint32_t)name.size() + 1;
+		}
+		return false;
+	}
+
+	// The first element with the name whose attribute has the value, or a
+	// null element
+	cryxmlb_element_t find(std::string_view element, std::string_view attribute, std::string_view value) const {
+		cryxmlb_element_t found = { 0, 0 };
+		find_all(element, attribute, value, &found, 1);
+		return found;
+	}
+
+	// The first element on the path, or a null element
+	cryxmlb_element_t find_path(std::string_view path) const {
+		cryxmlb_element_t found = { 0, 0 };
+		find_all_paths(path, &found, 1);
+		return found;
+	}
+
+	// Stores up to max of the matching elements, in document order, and
+	// returns how many it stored
+	size_t find_all(std::string_view element, std::string_view attribute, std::string_view value,
+		cryxmlb_element_t* found, size_t max) const {
+		key_match_t match = { element, attribute, value };
+		return probe(cryxmlb_index_key_hash(element, attribute, value), match, found, max);
+	}
+
+	size_t find_all_paths(std::string_view path, cryxmlb_element_t* found, size_t max) const {
+		path_match_t match = { path };
+		return probe(cryxmlb_index_mix(cryxmlb_index_feed(CRYXMLB_INDEX_SEED, path)), match, found, max);
+	}
+
+private:
+	struct key_match_t {
+		std::string_view element;
+		std::string_view attribute;
+		std::string_view value;
+
+		bool operator()(cryxmlb_element_t candidate) const {
+			if (candidate.name() != element) {
+				return false;
+			}
+			for (cryxmlb_attribute_t attr : candidate.attributes()) {
+				if (attr.name() == attribute && attr.value() == value) {
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+
+	// Compares the names from the end of the path up to the root
+	struct path_match_t {
+		std::string_view path;
+
+		bool operator()(cryxmlb_element_t candidate) const {
+			std::string_view rest = path;
+			while (!rest.empty()) {
+				size_t slash = rest.rfind('/');
+				if (slash == std::string_view::npos || !candidate || candidate.name() != rest.substr(slash + 1)) {
+					return false;
+				}
+				rest = rest.substr(0, slash);
+				candidate = candidate.parent();
+			}
+			return !candidate;
+		}
+	};
+
+	template <class M>
+	size_t probe(uint64_t hash, const M& match, cryxmlb_element_t* found, size_t max) const {
+		size_t count = 0;
+		if (!slots) {
+			return 0;
+		}
+		// The builder leaves half the slots empty; the bounds are for damaged
+		// sidecars
+		uint32_t check = (uint32_t)(hash >> 32);
+		uint32_t slot = (uint32_t)hash & mask;
+		for (uint32_t probes = 0; probes <= mask && count < max; probes++, slot = (slot + 1) & mask) {
+			const unsigned char* entry = slots + (size_t)slot * 8;
+			uint32_t next = cryxmlb_load32(entry + 4);
+			if (next == 0) {
+				break;
+			}
+			if (cryxmlb_load32(entry) != check) {
+				continue;
+			}
+			for (uint32_t steps = 0; next != 0 && next <= entry_count && steps < entry_count && count < max; steps++) {
+				const unsigned char* link = entries + (size_t)(next - 1) * 8;
+				cryxmlb_element_t candidate = reader.element(cryxmlb_load32(link));
+				if (candidate && match(candidate)) {
+					found[count++] = candidate;
+				}
+				else if (steps == 0) {
+					break; // Another key with the same check
+				}
+				next = cryxmlb_load32(link + 4);
+			}
+		}
+		return count;
+	}
+};
+
+#endif // CRYXMLB_INDEX_H
@@ -0,0 +1,300 @@
+/*
+CryXmlB reader
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CRYXMLB_READER_H
+#define CRYXMLB_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+
+// Read-only access to a CryXmlB file in memory (read or mapped), the way the
+// engine reads it: attributes from first_attr_idx, children through the
+// child table. Opening only checks the header, so looking up a value does
+// not depend on the size of the file. Nothing is allocated or copied:
+// elements are an index into the node table, strings are views into the
+// data table, and the bytes must outlive everything taken from the reader.
+// References a damaged file has out of range read as empty.
+//
+//	cryxmlb_reader_t reader;
+//	if (reader.open(data, size)) {
+//		std::string_view value = reader.root().child("Settings").attribute("Quality");
+//	}
+
+struct cryxmlb_reader_t;
+
+// Little-endian loads and stores, whatever the byte order and alignment
+inline uint32_t cryxmlb_load32(const unsigned char* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void cryxmlb_store32(unsigned char* p, uint32_t value) {
+	p[0] = (unsigned char)value;
+	p[1] = (unsigned char)(value >> 8);
+	p[2] = (unsigned char)(value >> 16);
+	p[3] = (unsigned char)(value >> 24);
+}
+
+inline int16_t cryxmlb_load16(const unsigned char* p) {
+	return (int16_t)(p[0] | (p[1] << 8));
+}
+
+struct cryxmlb_attribute_t {
+	const cryxmlb_reader_t* reader;
+	uint32_t index; // In the attribute table
+
+	std::string_view name() const;
+	std::string_view value() const;
+	uint32_t name_offset() const;  // In the data table; equal strings may
+	uint32_t value_offset() const; // be stored at different offsets
+};
+
+// Iteration over index..index + count of the attribute or child table
+template <class T>
+struct cryxmlb_range_t {
+	struct iterator {
+		const cryxmlb_reader_t* reader;
+		uint32_t index;
+
+		T operator*() const;
+		iterator& operator++() { index++; return *this; }
+		bool operator==(const iterator& other) const { return index == other.index; }
+		bool operator!=(const iterator& other) const { return index != other.index; }
+	};
+
+	const cryxmlb_reader_t* reader;
+	uint32_t first;
+	uint32_t count;
+
+	iterator begin() const { iterator it = { reader, first }; return it; }
+	iterator end() const { iterator it = { reader, first + count }; return it; }
+	uint32_t size() const { return count; }
+	bool empty() const { return count == 0; }
+};
+
+// A node. A default-constructed one, or one looked up and not found, is
+// null: it has no name, attributes or children.
+struct cryxmlb_element_t {
+	const cryxmlb_reader_t* reader;
+	uint32_t index; // In the node table
+
+	explicit operator bool() const { return reader != 0; }
+	std::string_view name() const;
+	std::string_view content() const;
+	uint32_t name_offset() const;
+	uint32_t content_offset() const;
+	cryxmlb_range_t<cryxmlb_attribute_t> attributes() const;
+	cryxmlb_range_t<cryxmlb_element_t> children() const;
+	cryxmlb_element_t parent() const;
+
+	// The value of the first attribute with the name, or fallback
+	std::string_view attribute(std::string_view name, std::string_view fallback = std::string_view()) const;
+	bool has_attribute(std::string_view name) const;
+
+	// The first child with the name
+	cryxmlb_element_t child(std::string_view name) const;
+};
+
+struct cryxmlb_reader_t {
+	const unsigned char* node_table;
+	const unsigned char* attr_table;
+	const unsigned char* child_table;
+	const char* data_table;
+	uint32_t node_count;
+	uint32_t attr_count;
+	uint32_t child_count;
+	uint32_t data_size;
+
+	cryxmlb_reader_t() { memset(this, 0, sizeof(*this)); }
+
+	// Checks the signature and that every table lies inside the data.
+	// Returns false if it is not a CryXmlB file.
+	bool open(const void* data, size_t size) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		memset(this, 0, sizeof(*this));
+		if (!bytes || size < 8 + 9 * 4 || memcmp(bytes, "CryXmlB", 8) != 0) {
+			return false;
+		}
+		uint32_t offsets[4];
+		uint32_t counts[4];
+		static const uint32_t entry_sizes[4] = { 28, 8, 4, 1 };
+		for (int t = 0; t < 4; t++) {
+			offsets[t] = cryxmlb_load32(bytes + 12 + t * 8);
+			counts[t] = cryxmlb_load32(bytes + 16 + t * 8);
+			if (offsets[t] > size || (size - offsets[t]) / entry_sizes[t] < counts[t]) {
+				return false;
+			}
+		}
+		// A terminator at the end means every string in range is terminated
+		if (counts[3] > 0 && bytes[offsets[3] + counts[3] - 1] != 0) {
+			return false;
+		}
+		node_table = bytes + offsets[0];
+		attr_table = bytes + offsets[1];
+		child_table = bytes + offsets[2];
+		data_table = (const char*)bytes + offsets[3];
+		node_count = counts[0];
+		attr_count = counts[1];
+		child_count = counts[2];
+		data_size = counts[3];
+		return true;
+	}
+
+	// Node 0, where the encoder puts the root
+	cryxmlb_element_t root() const { return element(0); }
+
+	cryxmlb_element_t element(uint32_t index) const {
+		cryxmlb_element_t result = { index < node_count ? this : 0, index };
+		return result;
+	}
+
+	std::string_view string(uint32_t offset) const {
+		if (offset >= data_size) {
+			return std::string_view();
+		}
+		return std::string_view(data_table + offset);
+	}
+
+	const unsigned char* node(uint32_t index) const { return node_table + (size_t)index * 28; }
+};
+
+inline std::string_view cryxmlb_attribute_t::name() const {
+	return reader->string(name_offset());
+}
+
+inline std::string_view cryxmlb_attribute_t::value() const {
+	return reader->string(value_offset());
+}
+
+inline uint32_t cryxmlb_attribute_t::name_offset() const {
+	return cryxmlb_load32(reader->attr_table + (size_t)index * 8);
+}
+
+inline uint32_t cryxmlb_attribute_t::value_offset() const {
+	return cryxmlb_load32(reader->attr_table + (size_t)index * 8 + 4);
+}
+
+template <>
+inline cryxmlb_attribute_t cryxmlb_range_t<cryxmlb_attribute_t>::iterator::operator*() const {
+	cryxmlb_attribute_t attr = { reader, index };
+	return attr;
+}
+
+template <>
+inline cryxmlb_element_t cryxmlb_range_t<cryxmlb_element_t>::iterator::operator*() const {
+	return reader->element(cryxmlb_load32(reader->child_table + (size_t)index * 4));
+}
+
+// A null element's offsets are past any data table
+inline uint32_t cryxmlb_element_t::name_offset() const {
+	return reader ? cryxmlb_load32(reader->node(index)) : UINT32_MAX;
+}
+
+inline uint32_t cryxmlb_element_t::content_offset() const {
+	return reader ? cryxmlb_load32(reader->node(index) + 4) : UINT32_MAX;
+}
+
+inline std::string_view cryxmlb_element_t::name() const {
+	return reader ? reader->string(name_offset()) : std::string_view();
+}
+
+inline std::string_view cryxmlb_element_t::content() const {
+	return reader ? reader->string(content_offset()) : std::string_view();
+}
+
+// An empty range unless first..first + count is inside a table of size entries
+inline bool cryxmlb_in_table(int32_t first, int16_t count, uint32_t size) {
+	return first >= 0 && count > 0 && (uint32_t)first <= size && size - (uint32_t)first >= (uint32_t)count;
+}
+
+inline cryxmlb_range_t<cryxmlb_attribute_t> cryxmlb_element_t::attributes() const {
+	cryxmlb_range_t<cryxmlb_attribute_t> range = { reader, 0, 0 };
+	if (reader) {
+		const unsigned char* node = reader->node(index);
+		int32_t first = (int32_t)cryxmlb_load32(node + 16);
+		int16_t count = cryxmlb_load16(node + 8);
+		if (cryxmlb_in_table(first, count, reader->attr_count)) {
+			range.first = (uint32_t)first;
+			range.count = (uint32_t)count;
+		}
+	}
+	return range;
+}
+
+inline cryxmlb_range_t<cryxmlb_element_t> cryxmlb_element_t::children() const {
+	cryxmlb_range_t<cryxmlb_element_t> range = { reader, 0, 0 };
+	if (reader) {
+		const unsigned char* node = reader->node(index);
+		int32_t first = (int32_t)cryxmlb_load32(node + 20);
+		int16_t count = cryxmlb_load16(node + 10);
+		if (cryxmlb_in_table(first, count, reader->child_count)) {
+			range.first = (uint32_t)first;
+			range.count = (uint32_t)count;
+		}
+	}
+	return range;
+}
+
+inline cryxmlb_element_t cryxmlb_element_t::parent() const {
+	cryxmlb_element_t result = { 0, 0 };
+	if (reader) {
+		int32_t parent_id = (int32_t)cryxmlb_load32(reader->node(index) + 12);
+		if (parent_id >= 0) {
+			result = reader->element((uint32_t)parent_id);
+		}
+	}
+	return result;
+}
+
+inline std::string_view cryxmlb_element_t::attribute(std::string_view name, std::string_view fallback) const {
+	for (cryxmlb_attribute_t attr : attributes()) {
+		if (attr.name() == name) {
+			return attr.value();
+		}
+	}
+	return fallback;
+}
+
+inline bool cryxmlb_element_t::has_attribute(std::string_view name) const {
+	for (cryxmlb_attribute_t attr : attributes()) {
+		if (attr.name() == name) {
+			return true;
+		}
+	}
+	return false;
+}
+
+inline cryxmlb_element_t cryxmlb_element_t::child(std::string_view name) const {
+	for (cryxmlb_element_t element : children()) {
+		if (element.name() == name) {
+			return element;
+		}
+	}
+	cryxmlb_element_t none = { 0, 0 };
+	return none;
+}
+
+#endif // CRYXMLB_READER_H
@@ -0,0 +1,1001 @@
+/*
+CryXmlB to XML converter
+Copyright (c) 2020 Bl00drav3n &&  Mphammed Hussin (MasterHunterr)
+MIT License
+
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "cryxmlb.h"
+
+struct cry_xml_value_t {
+	int32_t offset;
+	char* value;
+};
+
+read_file_result_t read_file(const char *filename) {
+	read_file_result_t result = {};
+	FILE* f = fopen(filename, "rb");
+	if (f) {
+		fseek(f, 0L, SEEK_END);
+		size_t size = ftell(f);
+		fseek(f, 0L, SEEK_SET);
+		unsigned char* data = (unsigned char*)malloc(size);
+		if (data && fread(data, 1, size, f) == size) {
+			result.data = data;
+			result.size = size;
+		}
+		else {
+			fprintf(stderr, "Error reading file %s\n", filename);
+			free(data); // Free allocated memory on error
+		}
+		fclose(f);
+	}
+	else {
+		fprintf(stderr, "Error opening file %s\n", filename);
+	}
+	return result;
+}
+
+bool write_file(const char* filename, const unsigned char* data, size_t size) {
+	bool result = true;
+	FILE *f = fopen(filename, "wb");
+	if (f) {
+		if (fwrite(data, 1, size, f) != size) {
+			fprintf(stderr, "Error writing file %s\n", filename);
+			result = false;
+		}
+		fclose(f);
+	}
+	else {
+		fprintf(stderr, "Error opening file %s\n", filename);
+	}
+	return result;
+}
+
+// Maps a file read-only, so its pages can be dropped again under memory
+// pressure. Sequential access tells the kernel to read ahead and release
+// pages behind the reader. Where mapping is not available the file is read.
+mapped_file_t map_file(const char* filename, bool sequential) {
+	mapped_file_t result = {};
+#if !defined(_WIN32)
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return result;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			if (sequential) {
+				madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+			}
+			result.data = (unsigned char*)data;
+			result.size = (uint64_t)st.st_size;
+			result.mapped = true;
+		}
+	}
+	close(fd);
+	if (result.data) {
+		return result;
+	}
+#else
+	(void)sequential;
+#endif
+	read_file_result_t file = read_file(filename);
+	result.data = file.data;
+	result.size = file.size;
+	return result;
+}
+
+void unmap_file(mapped_file_t* file) {
+#if !defined(_WIN32)
+	if (file->mapped) {
+		munmap(file->data, (size_t)file->size);
+		memset(file, 0, sizeof(*file));
+		return;
+	}
+#endif
+	free(file->data);
+	memset(file, 0, sizeof(*file));
+}
+
+// Gives the pages of a mapped range back to the system. They are read from
+// the file again if they are touched later.
+void release_mapped(const mapped_file_t* file, uint64_t begin, uint64_t end) {
+#if !defined(_WIN32)
+	if (!file->mapped) {
+		return;
+	}
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	begin = (begin + page - 1) / page * page;
+	end = (end < file->size ? end : file->size) / page * page;
+	if (begin < end) {
+		madvise(file->data + begin, (size_t)(end - begin), MADV_DONTNEED);
+	}
+#else
+	(void)file;
+	(void)begin;
+	(void)end;
+#endif
+}
+
+// Copies a file that is already in memory. On Linux the kernel copies it,
+// so the pages of a mapped file are not all brought in for the copy.
+bool copy_file(const char* filename, const mapped_file_t* source, const char* source_name) {
+#if defined(__linux__)
+	int in = open(source_name, O_RDONLY);
+	int out = in >= 0 ? open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+	uint64_t copied = 0;
+	while (out >= 0 && copied < source->size) {
+		ssize_t n = copy_file_range(in, 0, out, 0, (size_t)(source->size - copied), 0);
+		if (n <= 0) {
+			break;
+		}
+		copied += n;
+	}
+	if (out >= 0) {
+		close(out);
+	}
+	if (in >= 0) {
+		close(in);
+	}
+	if (copied == source->size) {
+		return true;
+	}
+#else
+	(void)source_name;
+#endif
+	return write_file(filename, source->data, (size_t)source->size);
+}
+
+uint64_t seek(binary_stream_t* stream, uint64_t offset) {
+	assert(offset < stream->size);
+	if (offset < stream->size) {
+		stream->ptr = offset;
+	}
+	return stream->ptr;
+}
+
+unsigned char peek_byte(binary_stream_t* stream) {
+	assert(stream->ptr < stream->size);
+	return (stream->ptr < stream->size) ? stream->data[stream->ptr] : 0;
+}
+
+char* read_string(binary_stream_t* stream, uint64_t size) {
+	char *result = 0;
+	assert(stream->ptr + size <= stream->size);
+	if (stream->ptr + size <= stream->size) {
+		result = (char*)(stream->data + stream->ptr);
+		stream->ptr += size;
+	}
+	else {
+		stream->ptr = stream->size;
+	}
+	return result;
+}
+
+char* read_cstring(binary_stream_t* stream) {
+	char *result = (char*)stream->data + stream->ptr;
+	for (; stream->data[stream->ptr]; stream->ptr++) {
+		assert(stream->ptr < stream->size);
+		if (stream->ptr == stream->size) {
+			result = 0;
+			break;
+		}
+	}
+	if (stream->ptr < stream->size) {
+		stream->ptr++;
+	}
+	return result;
+}
+
+unsigned char read_byte(binary_stream_t* stream) {
+	unsigned char result = 0;
+	assert(stream->ptr < stream->size);
+	if (stream->ptr < stream->size) {
+		result = stream->data[stream->ptr++];
+	}
+	return result;
+}
+
+uint16_t read_uint16(binary_stream_t* stream) {
+	unsigned char bytes[2];
+	bytes[0] = read_byte(stream);
+	bytes[1] = read_byte(stream);
+	return (bytes[1] << 8) | bytes[0];
+}
+
+int16_t read_int16(binary_stream_t* stream) {
+	return (int16_t)read_uint16(stream);
+}
+
+uint32_t read_uint32(binary_stream_t *stream) {
+	unsigned char bytes[4];
+	bytes[0] = read_byte(stream);
+	bytes[1] = read_byte(stream);
+	bytes[2] = read_byte(stream);
+	bytes[3] = read_byte(stream);
+	return (bytes[3] << 24) | (bytes[2] << 16) | (bytes[1] << 8) | bytes[0];
+}
+int32_t read_int32(binary_stream_t* stream) {
+	return (int32_t)read_uint32(stream);
+}
+
+// Files smaller than this are always written out on one thread
+static const uint64_t PARALLEL_EMIT_MIN_SIZE = 4 * 1024 * 1024;
+
+// The tree exactly as convert_file's DOM sees it: attributes are taken in
+// node order and every node is appended to its parent_id's children.
+struct cry_xml_tree_t {
+	const cry_xml_node_t* node_table;
+	const cry_xml_ref_t* attr_table;
+	const char* data_table;
+	std::vector<uint32_t> first_attr;
+	std::vector<uint32_t> child_start; // Children of node i: child_list[child_start[i]..child_start[i + 1])
+	std::vector<uint32_t> child_list;
+	std::vector<uint32_t> subtree_size;
+};
+
+// Builds the child lists. Only trees with a single root at index 0 and
+// parents before their children (which is what the encoder writes) are
+// accepted; anything else is left to the DOM path.
+bool build_tree(cry_xml_tree_t* tree, uint32_t node_count, uint32_t attr_count) {
+	if (node_count == 0 || tree->node_table[0].parent_id != -1) {
+		return false;
+	}
+	tree->first_attr.resize(node_count);
+	tree->child_start.assign(node_count + 1, 0);
+	tree->child_list.resize(node_count);
+	tree->subtree_size.assign(node_count, 1);
+
+	uint64_t attr_idx = 0;
+	for (uint32_t i = 0; i < node_count; i++) {
+		const cry_xml_node_t* node = tree->node_table + i;
+		if (i > 0 && (node->parent_id < 0 || (uint32_t)node->parent_id >= i)) {
+			return false;
+		}
+		tree->first_attr[i] = (uint32_t)attr_idx;
+		if (node->attribute_count > 0) {
+			attr_idx += node->attribute_count;
+		}
+		if (i > 0) {
+			tree->child_start[node->parent_id + 1]++;
+		}
+	}
+	if (attr_idx > attr_count) {
+		return false;
+	}
+	for (uint32_t i = 0; i < node_count; i++) {
+		tree->child_start[i + 1] += tree->child_start[i];
+	}
+	std::vector<uint32_t> fill(tree->child_start.begin(), tree->child_start.end() - 1);
+	for (uint32_t i = 1; i < node_count; i++) {
+		tree->child_list[fill[tree->node_table[i].parent_id]++] = i;
+	}
+	for (uint32_t i = node_count - 1; i > 0; i--) {
+		tree->subtree_size[tree->node_table[i].parent_id] += tree->subtree_size[i];
+	}
+	return true;
+}
+
+// Opens an element and prints its attributes and text the way the DOM would
+// hold them. SetAttribute replaces the value of an attribute that is already
+// there, so a repeated name keeps its first position and its last value.
+void print_element_start(tinyxml2::XMLPrinter* printer, const char* data_table, const cry_xml_node_t* node, const cry_xml_ref_t* attrs) {
+	printer->OpenElement(data_table + node->name_offset);
+	int attr_count = node->attribute_count > 0 ? node->attribute_count : 0;
+	for (int j = 0; j < attr_count; j++) {
+		const char* name = data_table + attrs[j].name_offset;
+		bool repeated = false;
+		for (int k = 0; k < j && !repeated; k++) {
+			repeated = strcmp(name, data_table + attrs[k].name_offset) == 0;
+		}
+		if (repeated) {
+			continue;
+		}
+		const char* value = data_table + attrs[j].value_offset;
+		for (int k = j + 1; k < attr_count; k++) {
+			if (strcmp(name, data_table + attrs[k].name_offset) == 0) {
+				value = data_table + attrs[k].value_offset;
+			}
+		}
+		printer->PushAttribute(name, value);
+	}
+	printer->PushText(data_table + node->content_offset);
+}
+
+void open_element(tinyxml2::XMLPrinter* printer, const cry_xml_tree_t* tree, uint32_t idx) {
+	print_element_start(printer, tree->data_table, tree->node_table + idx, tree->attr_table + tree->first_attr[idx]);
+}
+
+void print_subtree(tinyxml2::XMLPrinter* printer, const cry_xml_tree_t* tree, uint32_t idx) {
+	open_element(printer, tree, idx);
+	for (uint32_t c = tree->child_start[idx]; c < tree->child_start[idx + 1]; c++) {
+		print_subtree(printer, tree, tree->child_list[c]);
+	}
+	printer->CloseElement();
+}
+
+// Writes all buffers to the file in order
+bool write_buffers(const char* filename, const char* const* data, const size_t* size, int count) {
+#if defined(_WIN32)
+	// Text mode, like XMLDocument::SaveFile
+	FILE* f = fopen(filename, "w");
+	if (!f) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return false;
+	}
+	bool result = true;
+	for (int i = 0; i < count && result; i++) {
+		result = fwrite(data[i], 1, size[i], f) == size[i];
+	}
+	fclose(f);
+#else
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return false;
+	}
+	std::vector<struct iovec> iov(count);
+	for (int i = 0; i < count; i++) {
+		iov[i].iov_base = (void*)data[i];
+		iov[i].iov_len = size[i];
+	}
+	bool result = true;
+	size_t next = 0;
+	while (next < iov.size() && result) {
+		int batch = (int)(iov.size() - next < (size_t)IOV_MAX ? iov.size() - next : IOV_MAX);
+		ssize_t written = writev(fd, &iov[next], batch);
+		if (written < 0) {
+			result = false;
+			break;
+		}
+		// Skip what was written, including a partial buffer
+		while (next < iov.size() && (size_t)written >= iov[next].iov_len) {
+			written -= iov[next].iov_len;
+			next++;
+		}
+		if (written > 0) {
+			iov[next].iov_base = (char*)iov[next].iov_base + written;
+			iov[next].iov_len -= written;
+		}
+	}
+	close(fd);
+#endif
+	if (!result) {
+		fprintf(stderr, "Error writing file %s\n", filename);
+	}
+	return result;
+}
+
+// Prints the XML straight from the tables, splitting the root's children
+// into groups of similar node count that are printed into separate buffers
+// on separate threads. The text is the same as the DOM path writes. Returns
+// false without writing anything if the tree is not one this can handle;
+// otherwise sets *written to whether the file could be written.
+bool write_xml_parallel(const char* filename, const cryxmlb_file_t* file, unsigned thread_count, bool* written) {
+	cry_xml_tree_t tree;
+	tree.node_table = file->node_table;
+	tree.attr_table = file->attr_table;
+	tree.data_table = file->data_table;
+	uint32_t node_count = file->node_table_count;
+	if (!build_tree(&tree, node_count, file->attr_table_count)) {
+		return false;
+	}
+	uint32_t first_child = tree.child_start[0];
+	uint32_t child_count = tree.child_start[1] - first_child;
+	if (child_count < 2) {
+		return false;
+	}
+	if (thread_count > child_count) {
+		thread_count = child_count;
+	}
+
+	// Split the root's children into runs of similar node count
+	std::vector<uint32_t> group_begin(thread_count + 1, child_count);
+	uint64_t total = node_count - 1;
+	uint64_t seen = 0;
+	unsigned group = 0;
+	group_begin[0] = 0;
+	for (uint32_t c = 0; c < child_count && group + 1 < thread_count; c++) {
+		if (seen >= total * (group + 1) / thread_count) {
+			group_begin[++group] = c;
+		}
+		seen += tree.subtree_size[tree.child_list[first_child + c]];
+	}
+
+	// The root is printed here; its children go one level deeper
+	tinyxml2::XMLPrinter root_printer;
+	open_element(&root_printer, &tree, 0);
+
+	std::vector<tinyxml2::XMLPrinter*> printers(thread_count);
+	std::vector<std::thread> workers;
+	alloc_tracker_t* tracker = alloc_tracker;
+	for (unsigned t = 0; t < thread_count; t++) {
+		printers[t] = new tinyxml2::XMLPrinter(0, false, 1);
+		workers.push_back(std::thread([&, t]() {
+			alloc_scope_t tracking(tracker);
+			double start = stats_now();
+			for (uint32_t c = group_begin[t]; c < group_begin[t + 1]; c++) {
+				print_subtree(printers[t], &tree, tree.child_list[first_child + c]);
+			}
+			trace_event("worker", "print_group", filename, start, stats_now());
+		}));
+	}
+	double wait_start = stats_now();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	trace_event("wait", "join_workers", filename, wait_start, stats_now());
+
+	static const char newline[] = "\n";
+	std::vector<const char*> data;
+	std::vector<size_t> size;
+	data.push_back(root_printer.CStr());
+	size.push_back(root_printer.CStrSize() - 1);
+	for (unsigned t = 0; t < thread_count; t++) {
+		if (t > 0) {
+			// A fresh printer leaves out the newline before its first element
+			data.push_back(newline);
+			size.push_back(1);
+		}
+		data.push_back(printers[t]->CStr());
+		size.push_back(printers[t]->CStrSize() - 1);
+	}
+	std::string closing = std::string("\n</") + (tree.data_table + tree.node_table[0].name_offset) + ">\n";
+	data.push_back(closing.c_str());
+	size.push_back(closing.size());
+
+	*written = write_buffers(filename, data.data(), size.data(), (int)data.size());
+	for (unsigned t = 0; t < thread_count; t++) {
+		delete printers[t];
+	}
+	return true;
+}
+
+bool read_cryxmlb_header(const char* filename, binary_stream_t* stream, cryxmlb_header_t* header) {
+	char * signature = read_cstring(stream);
+	if (!signature) {
+		fprintf(stderr, "Error reading header of file %s\n", filename);
+		return false;
+	}
+	if (strncmp(signature, "CryXmlB", 7) != 0) {
+		fprintf(stderr, "Invalid header in file %s\n", filename);
+		return false;
+	}
+	if (stream->size - stream->ptr < 9 * sizeof(int32_t)) {
+		fprintf(stderr, "Header of file %s is cut short\n", filename);
+		return false;
+	}
+
+	header->file_size = read_int32(stream);
+
+	header->node_table_offset = read_int32(stream);
+	header->node_table_count = read_int32(stream);
+
+	header->attr_table_offset = read_int32(stream);
+	header->attr_table_count = read_int32(stream);
+
+	header->child_table_offset = read_int32(stream);
+	header->child_table_count = read_int32(stream);
+
+	header->data_table_offset = read_int32(stream);
+	header->data_table_size = read_int32(stream);
+	return true;
+}
+
+void read_node(binary_stream_t* stream, cry_xml_node_t* node) {
+	node->name_offset = read_int32(stream);
+	node->content_offset = read_int32(stream);
+	node->attribute_count = read_int16(stream);
+	node->child_count = read_int16(stream);
+	node->parent_id = read_int32(stream);
+	node->first_attr_idx = read_int32(stream);
+	node->first_child_idx = read_int32(stream);
+	node->reserved = read_int32(stream);
+}
+
+// True if every table the header describes lies inside a file of size bytes
+static bool tables_in_file(const cryxmlb_header_t* header, uint64_t size) {
+	return (uint64_t)header->node_table_offset + (uint64_t)header->node_table_count * sizeof(cry_xml_node_t) <= size
+		&& (uint64_t)header->attr_table_offset + (uint64_t)header->attr_table_count * sizeof(cry_xml_ref_t) <= size
+		&& (uint64_t)header->child_table_offset + (uint64_t)header->child_table_count * sizeof(uint32_t) <= size
+		&& (uint64_t)header->data_table_offset + header->data_table_size <= size;
+}
+
+// Reads the tables of a CryXmlB file. The file data must stay alive while
+// the tables are used.
+bool decode_cryxmlb(const char* filename, unsigned char* data, uint64_t size, cryxmlb_file_t* file) {
+	binary_stream_t the_stream = {};
+	binary_stream_t* stream = &the_stream;
+	stream->data = data;
+	stream->size = size;
+	memset(file, 0, sizeof(*file));
+
+	cryxmlb_header_t header;
+	if (!read_cryxmlb_header(filename, stream, &header)) {
+		return false;
+	}
+	// Damaged counts must not turn into huge allocations
+	if (!tables_in_file(&header, size)) {
+		fprintf(stderr, "Tables of file %s run past its end\n", filename);
+		return false;
+	}
+	uint32_t node_table_offset = header.node_table_offset;
+	uint32_t node_table_count = header.node_table_count;
+	uint32_t attr_table_offset = header.attr_table_offset;
+	uint32_t attr_table_count = header.attr_table_count;
+	uint32_t child_table_offset = header.child_table_offset;
+	uint32_t child_table_count = header.child_table_count;
+	uint32_t data_table_offset = header.data_table_offset;
+	uint32_t data_table_size = header.data_table_size;
+
+	cry_xml_node_t *node_table = (cry_xml_node_t*)scratch_alloc((size_t)node_table_count * sizeof(*node_table));
+	if (!node_table) {
+		fprintf(stderr, "Memory allocation failed\n");
+		return false;
+	}
+	seek(stream, node_table_offset);
+	for (uint32_t i = 0; i < node_table_count; i++) {
+		read_node(stream, node_table + i);
+	}
+
+	cry_xml_ref_t* attr_table = (cry_xml_ref_t*)scratch_alloc((size_t)attr_table_count * sizeof(*attr_table));
+	if (!attr_table) {
+		fprintf(stderr, "Memory allocation failed\n");
+		scratch_free(node_table);
+		return false;
+	}
+	seek(stream, attr_table_offset);
+	for (uint32_t i = 0; i < attr_table_count; i++) {
+		attr_table[i].name_offset = read_int32(stream);
+		attr_table[i].value_offset = read_int32(stream);
+	}
+
+	uint32_t* child_table = (uint32_t*)scratch_alloc((size_t)child_table_count * sizeof(*child_table));
+	if (!child_table) {
+		fprintf(stderr, "Memory allocation failed\n");
+		scratch_free(attr_table);
+		scratch_free(node_table);
+		return false;
+	}
+	seek(stream, child_table_offset);
+	for (uint32_t i = 0; i < child_table_count; i++) {
+		child_table[i] = read_int32(stream);
+	}
+
+	file->node_table = node_table;
+	file->node_table_count = node_table_count;
+	file->attr_table = attr_table;
+	file->attr_table_count = attr_table_count;
+	file->child_table = child_table;
+	file->child_table_count = child_table_count;
+	file->data_table = (char*)stream->data + data_table_offset;
+	file->data_table_size = data_table_size;
+	return true;
+}
+
+void free_cryxmlb(cryxmlb_file_t* file) {
+	scratch_free(file->child_table);
+	scratch_free(file->attr_table);
+	scratch_free(file->node_table);
+	memset(file, 0, sizeof(*file));
+}
+
+// True if the string at offset ends inside the first data_size bytes of the data table
+static bool valid_string(const cryxmlb_file_t* file, uint64_t data_size, int32_t offset) {
+	return offset >= 0 && (uint64_t)offset < data_size && memchr(file->data_table + offset, 0, data_size - offset);
+}
+
+// build_xml_document trusts the tables, so check what it follows first.
+// data_size is how much of the data table is really there, which a damaged
+// header can overstate. Parents have to come before their children so the
+// tree cannot loop. On failure message says which entry is wrong.
+bool check_cryxmlb_references(const cryxmlb_file_t* file, uint64_t data_size, char* message, size_t message_size) {
+	uint64_t attributes = 0;
+	for (uint32_t i = 0; i < file->node_table_count; i++) {
+		const cry_xml_node_t* node = file->node_table + i;
+		if (!valid_string(file, data_size, node->name_offset) || !valid_string(file, data_size, node->content_offset)) {
+			snprintf(message, message_size, "node %u: string out of range", i);
+			return false;
+		}
+		if (node->parent_id < -1 || node->parent_id >= (int64_t)i) {
+			snprintf(message, message_size, "node %u: parent out of range", i);
+			return false;
+		}
+		if (node->attribute_count < 0) {
+			snprintf(message, message_size, "node %u: negative attribute count", i);
+			return false;
+		}
+		attributes += node->attribute_count;
+	}
+	if (attributes > file->attr_table_count) {
+		snprintf(message, message_size, "attribute table too short");
+		return false;
+	}
+	for (uint32_t i = 0; i < file->attr_table_count; i++) {
+		const cry_xml_ref_t* attr = file->attr_table + i;
+		if (!valid_string(file, data_size, attr->name_offset) || !valid_string(file, data_size, attr->value_offset)) {
+			snprintf(message, message_size, "attribute %u: string out of range", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Rebuilds the element tree. Attributes are taken in node order and every
+// node is appended to the children of its parent_id.
+bool build_xml_document(const cryxmlb_file_t* file, tinyxml2::XMLDocument* doc) {
+	uint32_t node_table_count = file->node_table_count;
+	const cry_xml_node_t* node_table = file->node_table;
+	const cry_xml_ref_t* attr_table = file->attr_table;
+	const char* data_table = file->data_table;
+
+	tinyxml2::XMLElement **xml_nodes = (tinyxml2::XMLElement**)scratch_alloc((size_t)node_table_count * sizeof(*xml_nodes));
+	if (!xml_nodes) {
+		fprintf(stderr, "Memory allocation failed\n");
+		return false;
+	}
+	// Linking each element as soon as it exists keeps the document's list of
+	// unlinked nodes short; it is searched linearly on every insert, so
+	// linking them all at the end is quadratic. That only gives the same
+	// tree when every parent comes before its children.
+	bool link_early = true;
+	for (uint32_t i = 0; i < node_table_count && link_early; i++) {
+		link_early = node_table[i].parent_id == -1 || (node_table[i].parent_id >= 0 && (uint32_t)node_table[i].parent_id < i);
+	}
+
+	uint64_t attr_idx = 0;
+	for (uint32_t i = 0; i < node_table_count; i++) {
+		const cry_xml_node_t *node = node_table + i;
+		tinyxml2::XMLElement *elem = doc->NewElement(data_table + node->name_offset);
+		for (int16_t j = 0; j < node->attribute_count; j++) {
+			elem->SetAttribute(data_table + attr_table[attr_idx].name_offset, data_table + attr_table[attr_idx].value_offset);
+			attr_idx++;
+		}
+		const char* content = data_table + node->content_offset;
+		if (*content) {
+			elem->SetText(content);
+		}
+		xml_nodes[i] = elem;
+		if (link_early) {
+			if (node->parent_id == -1) {
+				doc->InsertFirstChild(elem);
+			}
+			else {
+				xml_nodes[node->parent_id]->InsertEndChild(elem);
+			}
+		}
+	}
+	if (!link_early) {
+		for (uint32_t i = 0; i < node_table_count; i++) {
+			const cry_xml_node_t* node = node_table + i;
+			if (node->parent_id == -1) {
+				doc->InsertFirstChild(xml_nodes[i]);
+			}
+			else {
+				xml_nodes[node->parent_id]->InsertEndChild(xml_nodes[i]);
+			}
+		}
+	}
+	scratch_free(xml_nodes);
+	return true;
+}
+
+bool save_xml_document(const tinyxml2::XMLDocument* doc, const char* filename) {
+	// Non-compact formatting with proper indentation
+	FILE* out = fopen(filename, "w");
+	if (!out) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return false;
+	}
+	cry_xml_printer_t printer(out);
+	doc->Print(&printer);
+	fclose(out);
+	return true;
+}
+
+// The reader gives mapped pages back once it is this far past them
+static const uint64_t STREAM_WINDOW_SIZE = 4 * 1024 * 1024;
+
+// Where the streaming reader is in one table of the mapped file
+struct stream_window_t {
+	uint64_t released; // Pages before this have been given back
+};
+
+static void advance_window(const mapped_file_t* file, stream_window_t* window, uint64_t position) {
+	if (position > window->released + STREAM_WINDOW_SIZE) {
+		release_mapped(file, window->released, position);
+		window->released = position;
+	}
+}
+
+// Prints the XML straight from a CryXmlB file in memory, in one pass over
+// the node and attribute tables. The encoder writes nodes depth first and
+// appends their strings as it goes, so all three tables are read front to
+// back and the pages of a mapped file are given back behind the reader;
+// only the open elements are kept. The text is the same as the DOM path
+// prints. Returns false when the nodes are not in that order (or the tables
+// are out of bounds); the printer may then hold part of the output.
+bool print_xml_streaming(tinyxml2::XMLPrinter* printer, const mapped_file_t* input, const cryxmlb_header_t* header, uint64_t* string_bytes) {
+	const uint64_t size = input->size;
+	if (!tables_in_file(header, size) || header->node_table_count == 0 || header->data_table_size == 0) {
+		return false;
+	}
+	// With the last byte a terminator, every string in range is terminated
+	const char* data_table = (const char*)input->data + header->data_table_offset;
+	const uint32_t data_table_size = header->data_table_size;
+	if (data_table[data_table_size - 1] != 0) {
+		return false;
+	}
+
+	binary_stream_t nodes = { input->data, header->node_table_offset, size };
+	binary_stream_t attrs = { input->data, header->attr_table_offset, size };
+	stream_window_t node_window = { header->node_table_offset };
+	stream_window_t attr_window = { header->attr_table_offset };
+	stream_window_t data_window = { header->data_table_offset };
+	std::vector<int32_t> open_nodes;
+	std::vector<cry_xml_ref_t> node_attrs;
+	uint64_t attr_idx = 0;
+	uint64_t data_end = 0;
+	bool ok = true;
+	for (uint32_t i = 0; i < header->node_table_count && ok; i++) {
+		cry_xml_node_t node;
+		read_node(&nodes, &node);
+
+		// The parent must be open: close elements until it is on top
+		if (i == 0) {
+			ok = node.parent_id == -1;
+		}
+		while (ok && !open_nodes.empty() && open_nodes.back() != node.parent_id) {
+			printer->CloseElement();
+			open_nodes.pop_back();
+		}
+		ok = ok && (i == 0 || !open_nodes.empty());
+
+		int attr_count = node.attribute_count > 0 ? node.attribute_count : 0;
+		ok = ok && attr_idx + attr_count <= header->attr_table_count;
+		node_attrs.resize(ok ? attr_count : 0);
+		for (int j = 0; j < (int)node_attrs.size(); j++) {
+			node_attrs[j].name_offset = read_int32(&attrs);
+			node_attrs[j].value_offset = read_int32(&attrs);
+			ok = ok && (uint32_t)node_attrs[j].name_offset < data_table_size && (uint32_t)node_attrs[j].value_offset < data_table_size;
+			data_end = std::max<uint64_t>(data_end, std::max(node_attrs[j].name_offset, node_attrs[j].value_offset));
+		}
+		attr_idx += attr_count;
+		ok = ok && (uint32_t)node.name_offset < data_table_size && (uint32_t)node.content_offset < data_table_size;
+		if (!ok) {
+			break;
+		}
+		print_element_start(printer, data_table, &node, node_attrs.data());
+		open_nodes.push_back((int32_t)i);
+
+		if (string_bytes) {
+			*string_bytes += strlen(data_table + node.name_offset) + 1 + strlen(data_table + node.content_offset) + 1;
+			for (const cry_xml_ref_t& attr : node_attrs) {
+				*string_bytes += strlen(data_table + attr.name_offset) + 1 + strlen(data_table + attr.value_offset) + 1;
+			}
+		}
+		data_end = std::max<uint64_t>(data_end, std::max(node.name_offset, node.content_offset));
+		advance_window(input, &node_window, nodes.ptr);
+		advance_window(input, &attr_window, attrs.ptr);
+		advance_window(input, &data_window, header->data_table_offset + data_end);
+	}
+	while (ok && !open_nodes.empty()) {
+		printer->CloseElement();
+		open_nodes.pop_back();
+	}
+	return ok;
+}
+
+// Prints a mapped CryXmlB file into an XML file with print_xml_streaming.
+// The tables are only checked as they are printed, so the text goes to
+// filename.tmp, which replaces the file once it is complete. Returns false
+// if it could not; the file is then left as it was.
+bool write_xml_streaming(const char* filename, const mapped_file_t* input, const cryxmlb_header_t* header, uint64_t* string_bytes) {
+	std::string temp_name = std::string(filename) + ".tmp";
+	FILE* out = fopen(temp_name.c_str(), "w");
+	if (!out) {
+		fprintf(stderr, "Error opening file %s\n", temp_name.c_str());
+		return false;
+	}
+	tinyxml2::XMLPrinter printer(out, false);
+	bool ok = print_xml_streaming(&printer, input, header, string_bytes);
+	ok = fclose(out) == 0 && ok;
+#if defined(_WIN32)
+	// rename does not replace an existing file here
+	ok = ok && remove(filename) == 0;
+#endif
+	if (!ok || rename(temp_name.c_str(), filename) != 0) {
+		remove(temp_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+void convert_file(const char *filename, const convert_options_t* options, conversion_stats_t* stats) {
+	// Timings are always taken; they are only reported with --stats
+	conversion_stats_t unused_stats = {};
+	bool collect_stats = stats != 0;
+	if (!stats) {
+		stats = &unused_stats;
+	}
+	stats->filename = filename;
+	stats->to_cryxmlb = false;
+
+	// Allocations are only counted with --alloc-stats
+	alloc_tracker_t tracker = {};
+	alloc_scope_t tracking(options->track_allocations ? &tracker : 0);
+
+	// The input is mapped, so the streaming path only has the pages it is
+	// working on in memory
+	const char *ext_str = "bak";
+	double start = stats_now();
+	mapped_file_t xml_file = map_file(filename, true);
+	stats_phase_end(stats, STATS_READ, start);
+	stats->bytes_in = xml_file.size;
+
+	if (xml_file.data && xml_file.size) {
+		unsigned char peek = xml_file.data[0];
+		if (peek == '<') {
+			fprintf(options->messages, "File %s is already XML\n", filename);
+			unmap_file(&xml_file);
+			return;
+		}
+		else if (peek != 'C') {
+			fprintf(stderr, "File %s has unknown file format\n", filename);
+			unmap_file(&xml_file);
+			return;
+		}
+
+		start = stats_now();
+		binary_stream_t stream = { xml_file.data, 0, xml_file.size };
+		cryxmlb_header_t header;
+		bool valid = read_cryxmlb_header(filename, &stream, &header);
+		stats_phase_end(stats, STATS_PARSE, start);
+		if (!valid) {
+			unmap_file(&xml_file);
+			return;
+		}
+
+		start = stats_now();
+		char* backup_name = (char*)malloc(strlen(filename) + strlen(ext_str) + 2); // +2 for the dot and null terminator
+		if (!backup_name) {
+			fprintf(stderr, "Memory allocation failed\n");
+			unmap_file(&xml_file);
+			return;
+		}
+		sprintf(backup_name, "%s.%s", filename, ext_str);
+		if (!copy_file(backup_name, &xml_file, filename)) {
+			fprintf(stderr, "Aborting.\n");
+			free(backup_name);
+			unmap_file(&xml_file);
+			exit(1);
+		}
+		stats_phase_end(stats, STATS_WRITE, start);
+
+		// The file is about to be overwritten, so read the backup from here on
+		unmap_file(&xml_file);
+		xml_file = map_file(backup_name, true);
+		free(backup_name);
+		if (!xml_file.data || xml_file.size != stats->bytes_in) {
+			unmap_file(&xml_file);
+			return;
+		}
+
+		// Files the encoder wrote are printed in one pass over the mapped
+		// tables, which all counts as writing. Large files are left to the
+		// parallel printer when there are threads for it.
+		bool parallel = options->threads > 1 && xml_file.size >= PARALLEL_EMIT_MIN_SIZE;
+		start = stats_now();
+		if (!parallel && write_xml_streaming(filename, &xml_file, &header, collect_stats ? &stats->string_bytes : 0)) {
+			stats_phase_end(stats, STATS_WRITE, start);
+			stats->nodes = header.node_table_count;
+			stats->attributes = header.attr_table_count;
+			stats->children = header.child_table_count;
+			stats->data_table_size = header.data_table_size;
+			stats->converted = true;
+		}
+		else {
+			stats->string_bytes = 0;
+
+			// Decoding the tables counts as parsing, building the DOM as
+			// encoding. Printing goes straight into the file, so it is all
+			// counted as writing.
+			cryxmlb_file_t cry_file;
+			start = stats_now();
+			bool decoded = decode_cryxmlb(filename, xml_file.data, xml_file.size, &cry_file);
+			stats_phase_end(stats, STATS_PARSE, start);
+
+			// Both printers below trust the tables
+			char message[128];
+			if (decoded && !check_cryxmlb_references(&cry_file, cry_file.data_table_size, message, sizeof(message))) {
+				fprintf(stderr, "File %s is damaged: %s\n", filename, message);
+				free_cryxmlb(&cry_file);
+				decoded = false;
+			}
+			if (decoded) {
+				stats->nodes = cry_file.node_table_count;
+				stats->attributes = cry_file.attr_table_count;
+				stats->children = cry_file.child_table_count;
+				stats->data_table_size = cry_file.data_table_size;
+				if (collect_stats) {
+					stats->string_bytes = count_string_bytes(cry_file.node_table, cry_file.node_table_count,
+						cry_file.attr_table, cry_file.attr_table_count, cry_file.data_table,
+						xml_file.size - (cry_file.data_table - (char*)xml_file.data));
+				}
+
+				// Large files can be printed straight from the tables on several
+				// threads. A failed write is not retried on the DOM path.
+				start = stats_now();
+				bool written = false;
+				if (parallel && write_xml_parallel(filename, &cry_file, options->threads, &written)) {
+					stats->converted = written;
+				}
+				else {
+					tinyxml2::XMLDocument doc;
+					if (build_xml_document(&cry_file, &doc)) {
+						start = stats_phase_end(stats, STATS_ENCODE, start);
+						stats->converted = save_xml_document(&doc, filename);
+					}
+					alloc_count_document(&doc);
+				}
+				stats_phase_end(stats, STATS_WRITE, start);
+				free_cryxmlb(&cry_file);
+			}
+		}
+	}
+
+	// Unmap the file data
+	unmap_file(&xml_file);
+
+	if (stats->converted) {
+		FILE* f = fopen(filename, "rb");
+		if (f) {
+			fseek(f, 0L, SEEK_END);
+			stats->bytes_out = ftell(f);
+			fclose(f);
+		}
+	}
+	stats->peak_memory = peak_memory_bytes();
+	if (options->track_allocations) {
+		alloc_report(&tracker, stats);
+	}
+}
@@ -0,0 +1,320 @@
+/*
+CryXmlB writer
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cryxmlb.h"
+
+static const size_t INTERN_MIN_SLOTS = 1024;
+
+cryxmlb_writer_t::cryxmlb_writer_t(bool intern_strings) : target(&own_tables) {
+	init(intern_strings);
+}
+
+cryxmlb_writer_t::cryxmlb_writer_t(cryxmlb_tables_t* tables, bool intern_strings) : target(tables) {
+	init(intern_strings);
+}
+
+void cryxmlb_writer_t::init(bool intern_strings) {
+	node_base = target->node_table.size();
+	child_base = target->child_table.size();
+	head_open = false;
+	text_written = false;
+	finished = false;
+	intern = intern_strings;
+	interned = 0;
+	error_message = 0;
+}
+
+// Keeps the first error; every call after it does nothing
+bool cryxmlb_writer_t::fail(const char* message) {
+	if (!error_message) {
+		error_message = message;
+	}
+	return false;
+}
+
+// Appends a null-terminated string to the data table and returns its
+// offset. When interning, a string already added by this writer is not
+// added again; the table of offsets is open-addressed on an FNV-1a hash.
+int32_t cryxmlb_writer_t::add_string(const char* str) {
+	if (!str) {
+		str = "";
+	}
+	size_t length = strlen(str);
+	table_vector_t<char>& data_table = target->data_table;
+	if (!intern) {
+		int32_t offset = static_cast<int32_t>(data_table.size());
+		data_table.insert(data_table.end(), str, str + length + 1);
+		return offset;
+	}
+
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+	}
+	if ((interned + 1) * 2 > intern_slots.size()) {
+		// Keep the table at most half full
+		std::vector<intern_slot_t> slots(intern_slots.empty() ? INTERN_MIN_SLOTS : intern_slots.size() * 2);
+		for (size_t i = 0; i < slots.size(); i++) {
+			slots[i].offset = -1;
+		}
+		size_t mask = slots.size() - 1;
+		for (const intern_slot_t& slot : intern_slots) {
+			if (slot.offset >= 0) {
+				size_t i = slot.hash & mask;
+				while (slots[i].offset >= 0) {
+					i = (i + 1) & mask;
+				}
+				slots[i] = slot;
+			}
+		}
+		intern_slots.swap(slots);
+	}
+
+	size_t mask = intern_slots.size() - 1;
+	size_t i = hash & mask;
+	while (intern_slots[i].offset >= 0) {
+		const intern_slot_t& slot = intern_slots[i];
+		if (slot.hash == hash && data_table.size() - slot.offset > length
+			&& memcmp(&data_table[slot.offset], str, length + 1) == 0) {
+			return slot.offset;
+		}
+		i = (i + 1) & mask;
+	}
+	int32_t offset = static_cast<int32_t>(data_table.size());
+	data_table.insert(data_table.end(), str, str + length + 1);
+	intern_slots[i].offset = offset;
+	intern_slots[i].hash = hash;
+	interned++;
+	return offset;
+}
+
+// Appends a block of strings as they are and returns the offset of its
+// first byte
+int32_t cryxmlb_writer_t::add_strings(const char* block, size_t size) {
+	table_vector_t<char>& data_table = target->data_table;
+	int32_t offset = static_cast<int32_t>(data_table.size());
+	if (size == 0 || block[size - 1] != 0) {
+		fail("string block not terminated");
+		return offset;
+	}
+	data_table.insert(data_table.end(), block, block + size);
+	return offset;
+}
+
+// An offset given to the _at calls must be the start of a string in the
+// data table; the last byte of the table is a null, so it is terminated
+bool cryxmlb_writer_t::valid_offset(int32_t offset) {
+	if (offset < 0 || static_cast<size_t>(offset) >= target->data_table.size()) {
+		return fail("string offset out of range");
+	}
+	return true;
+}
+
+// The converter writes the content string right after the name, so an
+// element without text gets an empty one before its first attribute
+void cryxmlb_writer_t::write_empty_text() {
+	target->node_table[open_elements.back()].content_offset = add_string("");
+	text_written = true;
+}
+
+// The node goes into the table now, in preorder. Until finish, its
+// first_child_idx counts its children: child_count is only 16 bits wide,
+// but the child table gets an entry for every child. The caller sets its
+// name.
+bool cryxmlb_writer_t::begin_node() {
+	if (error_message) {
+		return false;
+	}
+	if (finished) {
+		return fail("element begun after finish");
+	}
+	table_vector_t<cry_xml_node_t>& node_table = target->node_table;
+	int32_t parent_id = -1;
+	if (!open_elements.empty()) {
+		if (head_open && !text_written) {
+			write_empty_text();
+		}
+		parent_id = open_elements.back();
+		node_table[parent_id].child_count++;
+		node_table[parent_id].first_child_idx++;
+	}
+	else if (node_table.size() > node_base) {
+		return fail("more than one root element");
+	}
+
+	cry_xml_node_t node = {};
+	node.parent_id = parent_id;
+	node.first_attr_idx = static_cast<int32_t>(target->attr_table.size());
+	open_elements.push_back(static_cast<int32_t>(node_table.size()));
+	node_table.push_back(node);
+	head_open = true;
+	text_written = false;
+	return true;
+}
+
+void cryxmlb_writer_t::begin_element(const char* name) {
+	if (begin_node()) {
+		target->node_table.back().name_offset = add_string(name);
+	}
+}
+
+void cryxmlb_writer_t::begin_element_at(int32_t name_offset) {
+	if (valid_offset(name_offset) && begin_node()) {
+		target->node_table.back().name_offset = name_offset;
+	}
+}
+
+// Checks that an attribute can go on the element begun last
+bool cryxmlb_writer_t::begin_attribute() {
+	if (error_message) {
+		return false;
+	}
+	if (!head_open) {
+		return fail(open_elements.empty() ? "attribute outside an element" : "attribute after a child element");
+	}
+	if (!text_written) {
+		write_empty_text();
+	}
+	return true;
+}
+
+void cryxmlb_writer_t::attribute(const char* name, const char* value) {
+	if (begin_attribute()) {
+		cry_xml_ref_t attr_ref = {};
+		attr_ref.name_offset = add_string(name);
+		attr_ref.value_offset = add_string(value);
+		target->attr_table.push_back(attr_ref);
+		target->node_table[open_elements.back()].attribute_count++;
+	}
+}
+
+void cryxmlb_writer_t::attribute_at(int32_t name_offset, int32_t value_offset) {
+	if (valid_offset(name_offset) && valid_offset(value_offset) && begin_attribute()) {
+		cry_xml_ref_t attr_ref = {};
+		attr_ref.name_offset = name_offset;
+		attr_ref.value_offset = value_offset;
+		target->attr_table.push_back(attr_ref);
+		target->node_table[open_elements.back()].attribute_count++;
+	}
+}
+
+// Text given again replaces the element's content
+void cryxmlb_writer_t::text(const char* text) {
+	if (error_message) {
+		return;
+	}
+	if (!head_open) {
+		fail(open_elements.empty() ? "text outside an element" : "text after a child element");
+		return;
+	}
+	target->node_table[open_elements.back()].content_offset = add_string(text);
+	text_written = true;
+}
+
+void cryxmlb_writer_t::text_at(int32_t offset) {
+	if (!valid_offset(offset) || error_message) {
+		return;
+	}
+	if (!head_open) {
+		fail(open_elements.empty() ? "text outside an element" : "text after a child element");
+		return;
+	}
+	target->node_table[open_elements.back()].content_offset = offset;
+	text_written = true;
+}
+
+void cryxmlb_writer_t::end_element() {
+	if (error_message) {
+		return;
+	}
+	if (open_elements.empty()) {
+		fail("element ended that was not begun");
+		return;
+	}
+	if (head_open && !text_written) {
+		write_empty_text();
+	}
+	open_elements.pop_back();
+	head_open = false;
+}
+
+// Lays out the child table as the converter does: the entries of each node
+// in node order, each node's children in document order. Walking the nodes
+// backwards, every node is put in the last free entry of its parent's run.
+bool cryxmlb_writer_t::finish() {
+	if (error_message) {
+		return false;
+	}
+	if (finished) {
+		return true;
+	}
+	table_vector_t<cry_xml_node_t>& node_table = target->node_table;
+	if (!open_elements.empty()) {
+		return fail("element not ended");
+	}
+	if (node_table.size() == node_base) {
+		return fail("no root element");
+	}
+
+	// The runs, with first_child_idx at the end of each for now
+	uint64_t next = child_base;
+	for (size_t i = node_base; i < node_table.size(); i++) {
+		next += static_cast<uint32_t>(node_table[i].first_child_idx);
+		node_table[i].first_child_idx = static_cast<int32_t>(next);
+	}
+	uint64_t file_size = 8 + 9 * sizeof(int32_t) + node_table.size() * sizeof(cry_xml_node_t)
+		+ target->attr_table.size() * sizeof(cry_xml_ref_t) + next * sizeof(uint32_t) + target->data_table.size();
+	if (next > INT32_MAX || target->data_table.size() > INT32_MAX || file_size > UINT32_MAX) {
+		return fail("tables too large for CryXmlB");
+	}
+	table_vector_t<uint32_t>& child_table = target->child_table;
+	child_table.resize(next);
+	for (size_t i = node_table.size() - 1; i > node_base; i--) {
+		int32_t parent_id = node_table[i].parent_id;
+		child_table[--node_table[parent_id].first_child_idx] = static_cast<uint32_t>(i);
+	}
+	finished = true;
+	return true;
+}
+
+// Before finish the child table is missing and first_child_idx holds counts
+void cryxmlb_writer_t::serialize(output_buffer_t& output_buffer) const {
+	assert(finished && !error_message);
+	serialize_cryxmlb(*target, output_buffer);
+}
+
+bool cryxmlb_writer_t::save(const char* filename) {
+	if (!finished || error_message) {
+		return fail("not finished");
+	}
+	output_buffer_t output_buffer;
+	serialize(output_buffer);
+	return write_file(filename, output_buffer.data(), output_buffer.size());
+}
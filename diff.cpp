@@ -0,0 +1,909 @@
+/*
+Node-level delta between CryXmlB files
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "cryxmlb.h"
+#include "cryxmlb_index.h"
+
+// A delta rebuilds the new file's tree in preorder. Each element is one
+// operation, or a run of elements is one copy:
+//
+//	COPY_RUN start count  the next count children are the old parent's
+//	                      children start.., each with its whole subtree
+//	COPY node             the subtree under any old node
+//	EDIT position ...     the old parent's child at position, with the
+//	                      same name; its text, attributes and children follow
+//	NEW name ...          an element that was not in the old file
+//
+// Delta layout, little-endian:
+//	char[8]   "CXDelta"
+//	uint32    version (1)
+//	uint32    flags: DELTA_INTERNED, DELTA_BFS, how the new file was written
+//	uint64    hash of the old tree
+//	uint64    hash of the new tree
+//	ops       as below, numbers as LEB128 varints
+//
+//	COPY_RUN  varint start, varint count
+//	COPY      varint old node
+//	EDIT      varint position, text, attributes, varint child count
+//	NEW       string name, string text, varint attribute count, per
+//	          attribute string name and string value, varint child count
+//
+// In an EDIT the text is a byte, 0 for the old text or 1 and a string. The
+// attributes are varint 0 for the old ones, or count + 1 and per attribute
+// a varint: 0 and a name and value, 2 * i + 1 for the old attribute i, or
+// 2 * i + 2 for the name of old attribute i and a value. A string is varint
+// 0 and its bytes up to a null, or i + 1 for the i-th string given that way.
+// Positions count from the old parent's first child; at the top the old
+// parent is taken to have the old root as its only child.
+enum delta_op_t {
+	DELTA_COPY_RUN = 1,
+	DELTA_COPY,
+	DELTA_EDIT,
+	DELTA_NEW
+};
+
+static const uint32_t DELTA_VERSION = 1;
+static const uint32_t DELTA_INTERNED = 1; // Strings stored once
+static const uint32_t DELTA_BFS = 2;      // Nodes breadth first
+static const size_t DELTA_HEADER_SIZE = 8 + 2 * 4 + 2 * 8;
+
+// A file's tree as the delta sees it
+struct diff_tree_t {
+	cryxmlb_reader_t reader;
+	std::vector<uint32_t> order;   // Nodes reachable from the root, in preorder
+	std::vector<bool> reached;
+	std::vector<uint64_t> hashes;  // Of the subtree under each reached node
+	std::vector<uint32_t> sizes;   // Nodes in the subtree
+	uint32_t flags;                // DELTA_INTERNED and DELTA_BFS as written
+};
+
+static void store64(unsigned char* p, uint64_t value) {
+	cryxmlb_store32(p, (uint32_t)value);
+	cryxmlb_store32(p + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t load64(const unsigned char* p) {
+	return cryxmlb_load32(p) | ((uint64_t)cryxmlb_load32(p + 4) << 32);
+}
+
+static uint64_t feed32(uint64_t hash, uint32_t value) {
+	unsigned char bytes[4];
+	cryxmlb_store32(bytes, value);
+	return cryxmlb_index_feed(hash, (const char*)bytes, sizeof(bytes));
+}
+
+// Name, text, attributes in order and the hashes of the children. Every
+// string ends with its null and the counts come first, so no two trees
+// feed the same bytes.
+static uint64_t subtree_hash(const cryxmlb_element_t& element, const std::vector<uint64_t>& hashes) {
+	cryxmlb_range_t<cryxmlb_attribute_t> attributes = element.attributes();
+	cryxmlb_range_t<cryxmlb_element_t> children = element.children();
+	uint64_t hash = cryxmlb_index_feed(CRYXMLB_INDEX_SEED, element.name());
+	hash = cryxmlb_index_feed(hash, "", 1);
+	hash = cryxmlb_index_feed(hash, element.content());
+	hash = cryxmlb_index_feed(hash, "", 1);
+	hash = feed32(feed32(hash, attributes.size()), children.size());
+	for (cryxmlb_attribute_t attr : attributes) {
+		hash = cryxmlb_index_feed(hash, attr.name());
+		hash = cryxmlb_index_feed(hash, "", 1);
+		hash = cryxmlb_index_feed(hash, attr.value());
+		hash = cryxmlb_index_feed(hash, "", 1);
+	}
+	for (cryxmlb_element_t child : children) {
+		unsigned char bytes[8];
+		store64(bytes, hashes[child.index]);
+		hash = cryxmlb_index_feed(hash, (const char*)bytes, sizeof(bytes));
+	}
+	// 0 marks a free slot in diff_map_t
+	hash = cryxmlb_index_mix(hash);
+	return hash ? hash : 1;
+}
+
+// Walks the tree from the root and hashes every subtree. Fails for a file
+// whose child table reaches a node twice or one that does not exist, which
+// nothing can be copied from safely.
+static bool load_diff_tree(const char* filename, const unsigned char* data, uint64_t size, diff_tree_t* tree) {
+	cryxmlb_reader_t& reader = tree->reader;
+	if (!reader.open(data, (size_t)size)) {
+		fprintf(stderr, "File %s is not in CryXmlB format\n", filename);
+		return false;
+	}
+	if (reader.node_count == 0) {
+		fprintf(stderr, "File %s has no elements\n", filename);
+		return false;
+	}
+	tree->order.clear();
+	tree->order.reserve(reader.node_count);
+	tree->reached.assign(reader.node_count, false);
+	std::vector<uint32_t> stack(1, 0);
+	tree->reached[0] = true;
+	while (!stack.empty()) {
+		cryxmlb_element_t element = reader.element(stack.back());
+		stack.pop_back();
+		tree->order.push_back(element.index);
+		cryxmlb_range_t<cryxmlb_element_t> children = element.children();
+		for (uint32_t i = children.size(); i-- > 0;) {
+			uint32_t child = cryxmlb_load32(reader.child_table + (size_t)(children.first + i) * 4);
+			if (child >= reader.node_count || tree->reached[child]) {
+				fprintf(stderr, "File %s is damaged: node %u is not a tree\n", filename, element.index);
+				return false;
+			}
+			tree->reached[child] = true;
+			stack.push_back(child);
+		}
+	}
+
+	// Children come after their parent in preorder, so backwards every
+	// child is hashed before its parent
+	tree->hashes.assign(reader.node_count, 0);
+	tree->sizes.assign(reader.node_count, 0);
+	for (size_t i = tree->order.size(); i-- > 0;) {
+		cryxmlb_element_t element = reader.element(tree->order[i]);
+		tree->hashes[element.index] = subtree_hash(element, tree->hashes);
+		uint32_t nodes = 1;
+		for (cryxmlb_element_t child : element.children()) {
+			nodes += tree->sizes[child.index];
+		}
+		tree->sizes[element.index] = nodes;
+	}
+
+	// How the file was written, so applying a delta writes it the same way:
+	// the interning writer gives strings used twice one offset, and the
+	// breadth first layout numbers nodes level by level
+	tree->flags = 0;
+	std::vector<bool> referenced(reader.data_size, false);
+	for (uint32_t index : tree->order) {
+		cryxmlb_element_t element = reader.element(index);
+		uint32_t offsets[2] = { element.name_offset(), element.content_offset() };
+		for (uint32_t offset : offsets) {
+			if (offset < reader.data_size && referenced[offset]) {
+				tree->flags |= DELTA_INTERNED;
+			}
+			else if (offset < reader.data_size) {
+				referenced[offset] = true;
+			}
+		}
+		for (cryxmlb_attribute_t attr : element.attributes()) {
+			uint32_t attr_offsets[2] = { attr.name_offset(), attr.value_offset() };
+			for (uint32_t offset : attr_offsets) {
+				if (offset < reader.data_size && referenced[offset]) {
+					tree->flags |= DELTA_INTERNED;
+				}
+				else if (offset < reader.data_size) {
+					referenced[offset] = true;
+				}
+			}
+		}
+	}
+	bool preorder = tree->order.size() == reader.node_count;
+	for (size_t i = 0; preorder && i < tree->order.size(); i++) {
+		preorder = tree->order[i] == i;
+	}
+	if (!preorder && tree->order.size() == reader.node_count) {
+		bool bfs = true;
+		uint32_t next = 1;
+		for (uint32_t i = 0; bfs && i < reader.node_count; i++) {
+			for (cryxmlb_element_t child : reader.element(i).children()) {
+				bfs = bfs && child.index == next++;
+			}
+		}
+		tree->flags |= bfs ? DELTA_BFS : 0;
+	}
+	return true;
+}
+
+// The i-th of a range of children
+static cryxmlb_element_t child_at(const cryxmlb_range_t<cryxmlb_element_t>& children, uint32_t i) {
+	return children.reader->element(cryxmlb_load32(children.reader->child_table + (size_t)(children.first + i) * 4));
+}
+
+// Open-addressed map from nonzero 64-bit hashes to values, linear probing
+struct diff_map_t {
+	std::vector<uint64_t> keys; // 0 for a free slot
+	std::vector<uint32_t> values;
+	size_t count;
+};
+
+// Empties the map with room for capacity keys
+static void map_reset(diff_map_t* map, size_t capacity) {
+	size_t slots = 16;
+	while (slots < capacity * 2) {
+		slots *= 2;
+	}
+	map->keys.assign(slots, 0);
+	map->values.resize(slots);
+	map->count = 0;
+}
+
+static size_t map_slot(const diff_map_t* map, uint64_t key) {
+	size_t mask = map->keys.size() - 1;
+	size_t slot = (size_t)cryxmlb_index_mix(key) & mask;
+	while (map->keys[slot] != 0 && map->keys[slot] != key) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// The value of key, or null
+static uint32_t* map_find(diff_map_t* map, uint64_t key) {
+	size_t slot = map_slot(map, key);
+	return map->keys[slot] == key ? &map->values[slot] : 0;
+}
+
+// Adds key with value unless it is there already; grows the map when it
+// is half full
+static void map_insert(diff_map_t* map, uint64_t key, uint32_t value) {
+	if ((map->count + 1) * 2 > map->keys.size()) {
+		diff_map_t larger;
+		map_reset(&larger, map->count + 1);
+		for (size_t i = 0; i < map->keys.size(); i++) {
+			if (map->keys[i] != 0) {
+				map_insert(&larger, map->keys[i], map->values[i]);
+			}
+		}
+		*map = larger;
+	}
+	size_t slot = map_slot(map, key);
+	if (map->keys[slot] == 0) {
+		map->keys[slot] = key;
+		map->values[slot] = value;
+		map->count++;
+	}
+}
+
+// How an element of the new tree is made
+enum child_plan_kind_t {
+	PLAN_NEW,
+	PLAN_COPY_RUN, // old is the position among the old parent's children
+	PLAN_COPY,     // old is a node of the old tree
+	PLAN_EDIT      // old is the position among the old parent's children
+};
+
+struct child_plan_t {
+	child_plan_kind_t kind;
+	uint32_t old;
+};
+
+// The differ's state: both trees, the delta being written and its strings
+struct diff_state_t {
+	const diff_tree_t* old_tree;
+	const diff_tree_t* new_tree;
+	const std::vector<std::string>* key_attributes;
+	diff_map_t old_subtrees; // Every subtree of the old tree, by hash
+	diff_map_t chains;       // Scratch for matching children
+	std::vector<uint32_t> next_old;
+	diff_map_t string_ids;   // Strings written so far, by hash
+	std::vector<std::string_view> strings;
+	output_buffer_t* output;
+	uint32_t copied;
+	uint32_t edited;
+	uint32_t added;
+};
+
+static void put_varint(output_buffer_t* output, uint64_t value) {
+	while (value >= 0x80) {
+		output->push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	output->push_back((unsigned char)value);
+}
+
+// A string given before is written as its number
+static void put_string(diff_state_t* state, std::string_view text) {
+	uint64_t hash = cryxmlb_index_mix(cryxmlb_index_feed(CRYXMLB_INDEX_SEED, text));
+	hash = hash ? hash : 1;
+	uint32_t* id = map_find(&state->string_ids, hash);
+	if (id && state->strings[*id] == text) {
+		put_varint(state->output, (uint64_t)*id + 1);
+		return;
+	}
+	if (!id) {
+		map_insert(&state->string_ids, hash, (uint32_t)state->strings.size());
+		state->strings.push_back(text);
+	}
+	state->output->push_back(0);
+	state->output->insert(state->output->end(), text.begin(), text.end());
+	state->output->push_back(0);
+}
+
+// The hash an element is matched on by its key attributes: the first of
+// them it has, in the order given. 0 if it has none.
+static uint64_t element_key(const diff_state_t* state, const cryxmlb_element_t& element) {
+	for (const std::string& key : *state->key_attributes) {
+		for (cryxmlb_attribute_t attr : element.attributes()) {
+			if (attr.name() == key) {
+				return cryxmlb_index_key_hash(element.name(), key, attr.value()) | 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static uint64_t name_key(const cryxmlb_element_t& element) {
+	return cryxmlb_index_mix(cryxmlb_index_feed(CRYXMLB_INDEX_SEED, element.name())) | 1;
+}
+
+// Pairs each new child still without a plan with the first unpaired old
+// child of the same key, in order. Keys of 0 take no part. Paired elements
+// have the same name, whatever the hashes say.
+static void match_children(diff_state_t* state, const std::vector<cryxmlb_element_t>& old_children,
+	const std::vector<uint64_t>& old_keys, const std::vector<cryxmlb_element_t>& new_children,
+	const std::vector<uint64_t>& new_keys, std::vector<bool>* paired, std::vector<child_plan_t>* plan, child_plan_kind_t kind) {
+	// Each key's old children are chained in order from the map
+	diff_map_t& chains = state->chains;
+	std::vector<uint32_t>& next = state->next_old;
+	map_reset(&chains, old_children.size());
+	next.assign(old_children.size(), UINT32_MAX);
+	for (size_t i = old_children.size(); i-- > 0;) {
+		if (old_keys[i] == 0 || (*paired)[i]) {
+			continue;
+		}
+		uint32_t* head = map_find(&chains, old_keys[i]);
+		if (head) {
+			next[i] = *head;
+			*head = (uint32_t)i;
+		}
+		else {
+			map_insert(&chains, old_keys[i], (uint32_t)i);
+		}
+	}
+	for (size_t i = 0; i < new_children.size(); i++) {
+		if ((*plan)[i].kind != PLAN_NEW || new_keys[i] == 0) {
+			continue;
+		}
+		uint32_t* head = map_find(&chains, new_keys[i]);
+		if (!head || *head == UINT32_MAX || old_children[*head].name() != new_children[i].name()) {
+			continue;
+		}
+		(*plan)[i].kind = kind;
+		(*plan)[i].old = *head;
+		(*paired)[*head] = true;
+		*head = next[*head];
+	}
+}
+
+// Decides how each child of new_element is made. Under an element that was
+// in the old file its children are paired with the old ones: identical
+// subtrees first, which are copied, then by key attribute and then by name
+// in order, which are edited. Whatever is left is copied from anywhere in
+// the old tree if it is there unchanged, or added.
+static void plan_children(diff_state_t* state, const cryxmlb_element_t& old_element, const cryxmlb_element_t& new_element,
+	std::vector<child_plan_t>* plan) {
+	const std::vector<uint64_t>& old_hashes = state->old_tree->hashes;
+	const std::vector<uint64_t>& new_hashes = state->new_tree->hashes;
+	std::vector<cryxmlb_element_t> new_children;
+	for (cryxmlb_element_t child : new_element.children()) {
+		new_children.push_back(child);
+	}
+	child_plan_t added = { PLAN_NEW, 0 };
+	plan->assign(new_children.size(), added);
+
+	if (old_element) {
+		std::vector<cryxmlb_element_t> old_children;
+		for (cryxmlb_element_t child : old_element.children()) {
+			old_children.push_back(child);
+		}
+		std::vector<bool> paired(old_children.size(), false);
+		std::vector<uint64_t> old_keys(old_children.size());
+		std::vector<uint64_t> new_keys(new_children.size());
+		for (size_t i = 0; i < old_children.size(); i++) {
+			old_keys[i] = old_hashes[old_children[i].index];
+		}
+		for (size_t i = 0; i < new_children.size(); i++) {
+			new_keys[i] = new_hashes[new_children[i].index];
+		}
+		match_children(state, old_children, old_keys, new_children, new_keys, &paired, plan, PLAN_COPY_RUN);
+		std::vector<uint64_t> old_element_keys(old_children.size());
+		std::vector<uint64_t> new_element_keys(new_children.size());
+		for (size_t i = 0; i < old_children.size(); i++) {
+			old_element_keys[i] = paired[i] ? 0 : element_key(state, old_children[i]);
+			old_keys[i] = old_element_keys[i];
+		}
+		for (size_t i = 0; i < new_children.size(); i++) {
+			new_element_keys[i] = (*plan)[i].kind != PLAN_NEW ? 0 : element_key(state, new_children[i]);
+			new_keys[i] = new_element_keys[i];
+		}
+		match_children(state, old_children, old_keys, new_children, new_keys, &paired, plan, PLAN_EDIT);
+		// Elements with a key are only paired by it
+		for (size_t i = 0; i < old_children.size(); i++) {
+			old_keys[i] = paired[i] || old_element_keys[i] ? 0 : name_key(old_children[i]);
+		}
+		for (size_t i = 0; i < new_children.size(); i++) {
+			new_keys[i] = (*plan)[i].kind != PLAN_NEW || new_element_keys[i] ? 0 : name_key(new_children[i]);
+		}
+		match_children(state, old_children, old_keys, new_children, new_keys, &paired, plan, PLAN_EDIT);
+	}
+
+	for (size_t i = 0; i < new_children.size(); i++) {
+		uint32_t* node = (*plan)[i].kind == PLAN_NEW ? map_find(&state->old_subtrees, new_hashes[new_children[i].index]) : 0;
+		if (node) {
+			(*plan)[i].kind = PLAN_COPY;
+			(*plan)[i].old = *node;
+		}
+	}
+}
+
+// The attributes of an edited element: 0 when they are the old ones, or
+// each one taken from an old attribute where it can be
+static void put_edited_attributes(diff_state_t* state, const cryxmlb_element_t& old_element, const cryxmlb_element_t& new_element) {
+	cryxmlb_range_t<cryxmlb_attribute_t> old_attributes = old_element.attributes();
+	cryxmlb_range_t<cryxmlb_attribute_t> new_attributes = new_element.attributes();
+	bool same = old_attributes.size() == new_attributes.size();
+	for (uint32_t i = 0; same && i < new_attributes.size(); i++) {
+		cryxmlb_attribute_t old_attr = { old_element.reader, old_attributes.first + i };
+		cryxmlb_attribute_t new_attr = { new_element.reader, new_attributes.first + i };
+		same = old_attr.name() == new_attr.name() && old_attr.value() == new_attr.value();
+	}
+	if (same) {
+		put_varint(state->output, 0);
+		return;
+	}
+	put_varint(state->output, (uint64_t)new_attributes.size() + 1);
+	for (uint32_t i = 0; i < new_attributes.size(); i++) {
+		cryxmlb_attribute_t new_attr = { new_element.reader, new_attributes.first + i };
+		// The old attribute of the name, looked for at the same place first
+		uint32_t found = UINT32_MAX;
+		for (uint32_t k = 0; k < old_attributes.size() && found == UINT32_MAX; k++) {
+			uint32_t j = (i + k) % old_attributes.size();
+			cryxmlb_attribute_t old_attr = { old_element.reader, old_attributes.first + j };
+			if (old_attr.name() == new_attr.name()) {
+				found = j;
+			}
+		}
+		if (found == UINT32_MAX) {
+			put_varint(state->output, 0);
+			put_string(state, new_attr.name());
+			put_string(state, new_attr.value());
+			continue;
+		}
+		cryxmlb_attribute_t old_attr = { old_element.reader, old_attributes.first + found };
+		if (old_attr.value() == new_attr.value()) {
+			put_varint(state->output, (uint64_t)found * 2 + 1);
+		}
+		else {
+			put_varint(state->output, (uint64_t)found * 2 + 2);
+			put_string(state, new_attr.value());
+		}
+	}
+}
+
+// An element of the new tree whose children are still to be written
+struct diff_frame_t {
+	cryxmlb_element_t old_element; // Null under an added element and at the top
+	bool top;
+	std::vector<cryxmlb_element_t> new_children;
+	std::vector<child_plan_t> plan;
+	size_t next;
+};
+
+// Writes the operations for the new tree, element by element in preorder
+static void write_delta_ops(diff_state_t* state) {
+	const cryxmlb_reader_t& old_reader = state->old_tree->reader;
+	const cryxmlb_reader_t& new_reader = state->new_tree->reader;
+	output_buffer_t* output = state->output;
+	std::vector<diff_frame_t> stack(1);
+
+	// At the top the old root stands in the place of the new one
+	diff_frame_t& top = stack.back();
+	cryxmlb_element_t old_root = old_reader.root();
+	cryxmlb_element_t new_root = new_reader.root();
+	child_plan_t root_plan = { PLAN_NEW, 0 };
+	if (state->old_tree->hashes[0] == state->new_tree->hashes[0]) {
+		root_plan.kind = PLAN_COPY_RUN;
+	}
+	else if (old_root.name() == new_root.name()) {
+		root_plan.kind = PLAN_EDIT;
+	}
+	top.top = true;
+	top.old_element = cryxmlb_element_t();
+	top.new_children.push_back(new_root);
+	top.plan.push_back(root_plan);
+	top.next = 0;
+
+	while (!stack.empty()) {
+		diff_frame_t& frame = stack.back();
+		if (frame.next == frame.plan.size()) {
+			stack.pop_back();
+			continue;
+		}
+		size_t i = frame.next++;
+		child_plan_t plan = frame.plan[i];
+		cryxmlb_element_t element = frame.new_children[i];
+		cryxmlb_element_t old_element = frame.top ? old_root
+			: plan.kind == PLAN_EDIT ? child_at(frame.old_element.children(), plan.old)
+			: cryxmlb_element_t();
+
+		if (plan.kind == PLAN_COPY_RUN) {
+			// Runs of children copied in order are one operation
+			uint32_t count = 1;
+			state->copied += state->new_tree->sizes[element.index];
+			while (frame.next < frame.plan.size() && frame.plan[frame.next].kind == PLAN_COPY_RUN
+				&& frame.plan[frame.next].old == plan.old + count) {
+				state->copied += state->new_tree->sizes[frame.new_children[frame.next].index];
+				frame.next++;
+				count++;
+			}
+			output->push_back(DELTA_COPY_RUN);
+			put_varint(output, plan.old);
+			put_varint(output, count);
+			continue;
+		}
+		if (plan.kind == PLAN_COPY) {
+			state->copied += state->new_tree->sizes[element.index];
+			output->push_back(DELTA_COPY);
+			put_varint(output, plan.old);
+			continue;
+		}
+
+		cryxmlb_range_t<cryxmlb_attribute_t> attributes = element.attributes();
+		if (plan.kind == PLAN_EDIT) {
+			state->edited++;
+			output->push_back(DELTA_EDIT);
+			put_varint(output, plan.old);
+			if (old_element.content() == element.content()) {
+				output->push_back(0);
+			}
+			else {
+				output->push_back(1);
+				put_string(state, element.content());
+			}
+			put_edited_attributes(state, old_element, element);
+		}
+		else {
+			state->added++;
+			old_element = cryxmlb_element_t();
+			output->push_back(DELTA_NEW);
+			put_string(state, element.name());
+			put_string(state, element.content());
+			put_varint(output, attributes.size());
+			for (cryxmlb_attribute_t attr : attributes) {
+				put_string(state, attr.name());
+				put_string(state, attr.value());
+			}
+		}
+		put_varint(output, element.children().size());
+
+		diff_frame_t child_frame;
+		child_frame.old_element = old_element;
+		child_frame.top = false;
+		for (cryxmlb_element_t child : element.children()) {
+			child_frame.new_children.push_back(child);
+		}
+		plan_children(state, old_element, element, &child_frame.plan);
+		child_frame.next = 0;
+		stack.push_back(std::move(child_frame));
+	}
+}
+
+// Writes delta_name, from which apply_cryxmlb_delta makes new_name's tree
+// out of old_name's. Elements are paired by the key attributes given.
+bool diff_cryxmlb_files(const char* old_name, const char* new_name, const char* delta_name, const std::vector<std::string>& key_attributes) {
+	mapped_file_t old_file = map_file(old_name, false);
+	if (!old_file.data) {
+		return false;
+	}
+	mapped_file_t new_file = map_file(new_name, false);
+	if (!new_file.data) {
+		unmap_file(&old_file);
+		return false;
+	}
+	diff_tree_t old_tree;
+	diff_tree_t new_tree;
+	bool loaded = load_diff_tree(old_name, old_file.data, old_file.size, &old_tree)
+		&& load_diff_tree(new_name, new_file.data, new_file.size, &new_tree);
+	bool written = false;
+	if (loaded) {
+		output_buffer_t output(DELTA_HEADER_SIZE, 0);
+		memcpy(output.data(), "CXDelta", 8);
+		cryxmlb_store32(output.data() + 8, DELTA_VERSION);
+		cryxmlb_store32(output.data() + 12, new_tree.flags);
+		store64(output.data() + 16, old_tree.hashes[0]);
+		store64(output.data() + 24, new_tree.hashes[0]);
+
+		diff_state_t state;
+		state.old_tree = &old_tree;
+		state.new_tree = &new_tree;
+		state.key_attributes = &key_attributes;
+		map_reset(&state.old_subtrees, old_tree.order.size());
+		for (uint32_t index : old_tree.order) {
+			map_insert(&state.old_subtrees, old_tree.hashes[index], index);
+		}
+		map_reset(&state.string_ids, 1024);
+		state.output = &output;
+		state.copied = 0;
+		state.edited = 0;
+		state.added = 0;
+		write_delta_ops(&state);
+
+		written = write_file(delta_name, output.data(), output.size());
+		if (written) {
+			fprintf(stdout, "Wrote %s: %llu bytes for %llu of %s (%u elements copied, %u edited, %u added)\n", delta_name,
+				(unsigned long long)output.size(), (unsigned long long)new_file.size, new_name, state.copied, state.edited, state.added);
+		}
+	}
+	unmap_file(&new_file);
+	unmap_file(&old_file);
+	return written;
+}
+
+// Bounds-checked reads of the operations
+struct delta_reader_t {
+	const unsigned char* p;
+	const unsigned char* end;
+	bool valid;
+	std::vector<const char*> strings; // Null-terminated, in the delta
+};
+
+static uint64_t read_varint(delta_reader_t* reader) {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (reader->p == reader->end) {
+			break;
+		}
+		unsigned char byte = *reader->p++;
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return value;
+		}
+	}
+	reader->valid = false;
+	return 0;
+}
+
+static unsigned char read_byte(delta_reader_t* reader) {
+	if (reader->p == reader->end) {
+		reader->valid = false;
+		return 0;
+	}
+	return *reader->p++;
+}
+
+static const char* read_string(delta_reader_t* reader) {
+	uint64_t id = read_varint(reader);
+	if (id > 0) {
+		if (id > reader->strings.size()) {
+			reader->valid = false;
+			return "";
+		}
+		return reader->strings[id - 1];
+	}
+	const unsigned char* terminator = reader->p < reader->end ? (const unsigned char*)memchr(reader->p, 0, reader->end - reader->p) : 0;
+	if (!terminator) {
+		reader->valid = false;
+		return "";
+	}
+	const char* text = (const char*)reader->p;
+	reader->strings.push_back(text);
+	reader->p = terminator + 1;
+	return text;
+}
+
+// Strings of a reader end where the data table has a null
+static const char* c_str(std::string_view text) {
+	return text.data() ? text.data() : "";
+}
+
+// Writes the subtree under an element of the old tree, which
+// load_diff_tree found to be a tree
+static void copy_subtree(cryxmlb_writer_t* writer, const cryxmlb_element_t& root,
+	std::vector<std::pair<cryxmlb_element_t, uint32_t> >* stack) {
+	stack->clear();
+	stack->push_back(std::make_pair(root, 0u));
+	while (!stack->empty()) {
+		cryxmlb_element_t element = stack->back().first;
+		uint32_t next = stack->back().second;
+		if (next == 0) {
+			writer->begin_element(c_str(element.name()));
+			writer->text(c_str(element.content()));
+			for (cryxmlb_attribute_t attr : element.attributes()) {
+				writer->attribute(c_str(attr.name()), c_str(attr.value()));
+			}
+		}
+		cryxmlb_range_t<cryxmlb_element_t> children = element.children();
+		if (next == children.size()) {
+			writer->end_element();
+			stack->pop_back();
+			continue;
+		}
+		stack->back().second++;
+		stack->push_back(std::make_pair(child_at(children, next), 0u));
+	}
+}
+
+// An element being rebuilt whose children are still to come
+struct apply_frame_t {
+	cryxmlb_element_t old_element; // Null under an added element and at the top
+	bool top;
+	uint64_t remaining;
+};
+
+// Runs the operations into writer. Returns false, with a message, if the
+// delta refers to anything the old tree does not have.
+static bool run_delta_ops(delta_reader_t* reader, const diff_tree_t* old_tree, cryxmlb_writer_t* writer, const char** message) {
+	const cryxmlb_reader_t& old_reader = old_tree->reader;
+	std::vector<apply_frame_t> stack;
+	std::vector<std::pair<cryxmlb_element_t, uint32_t> > copy_stack;
+	apply_frame_t top = { cryxmlb_element_t(), true, 1 };
+	stack.push_back(top);
+	*message = "truncated";
+	while (!stack.empty() && reader->valid) {
+		apply_frame_t& frame = stack.back();
+		if (frame.remaining == 0) {
+			if (!frame.top) {
+				writer->end_element();
+			}
+			stack.pop_back();
+			continue;
+		}
+		// The old parent's children; the root alone at the top
+		cryxmlb_range_t<cryxmlb_element_t> old_children = frame.old_element.children();
+		uint32_t old_count = frame.top ? 1 : old_children.size();
+		cryxmlb_element_t old_element = frame.old_element;
+		unsigned char op = read_byte(reader);
+		if (op == DELTA_COPY_RUN) {
+			uint64_t start = read_varint(reader);
+			uint64_t count = read_varint(reader);
+			if (count == 0 || count > frame.remaining || start > old_count || old_count - start < count) {
+				*message = "copy out of range";
+				return false;
+			}
+			for (uint64_t i = start; i < start + count; i++) {
+				copy_subtree(writer, frame.top ? old_reader.root() : child_at(old_children, (uint32_t)i), &copy_stack);
+			}
+			frame.remaining -= count;
+			continue;
+		}
+		if (op == DELTA_COPY) {
+			uint64_t node = read_varint(reader);
+			if (node >= old_reader.node_count || !old_tree->reached[node]) {
+				*message = "copy out of range";
+				return false;
+			}
+			copy_subtree(writer, old_reader.element((uint32_t)node), &copy_stack);
+			frame.remaining--;
+			continue;
+		}
+
+		if (op == DELTA_EDIT) {
+			uint64_t position = read_varint(reader);
+			if (position >= old_count) {
+				*message = "edit out of range";
+				return false;
+			}
+			old_element = frame.top ? old_reader.root() : child_at(old_children, (uint32_t)position);
+			writer->begin_element(c_str(old_element.name()));
+			writer->text(read_byte(reader) ? read_string(reader) : c_str(old_element.content()));
+			cryxmlb_range_t<cryxmlb_attribute_t> old_attributes = old_element.attributes();
+			uint64_t attribute_count = read_varint(reader);
+			if (attribute_count == 0) {
+				for (cryxmlb_attribute_t attr : old_attributes) {
+					writer->attribute(c_str(attr.name()), c_str(attr.value()));
+				}
+			}
+			for (uint64_t i = 1; i < attribute_count && reader->valid; i++) {
+				uint64_t from = read_varint(reader);
+				if (from == 0) {
+					const char* name = read_string(reader);
+					writer->attribute(name, read_string(reader));
+					continue;
+				}
+				uint64_t j = (from - 1) / 2;
+				if (j >= old_attributes.size()) {
+					*message = "attribute out of range";
+					return false;
+				}
+				cryxmlb_attribute_t attr = { &old_reader, old_attributes.first + (uint32_t)j };
+				writer->attribute(c_str(attr.name()), from % 2 ? c_str(attr.value()) : read_string(reader));
+			}
+		}
+		else if (op == DELTA_NEW) {
+			old_element = cryxmlb_element_t();
+			writer->begin_element(read_string(reader));
+			writer->text(read_string(reader));
+			uint64_t attribute_count = read_varint(reader);
+			for (uint64_t i = 0; i < attribute_count && reader->valid; i++) {
+				const char* name = read_string(reader);
+				writer->attribute(name, read_string(reader));
+			}
+		}
+		else {
+			*message = "unknown operation";
+			return false;
+		}
+		frame.remaining--;
+		apply_frame_t child_frame = { old_element, false, read_varint(reader) };
+		stack.push_back(child_frame);
+	}
+	if (!reader->valid || reader->p != reader->end) {
+		*message = reader->valid ? "data after the last operation" : "truncated";
+		return false;
+	}
+	return true;
+}
+
+// Writes new_name from old_name and a delta diff_cryxmlb_files made from
+// it. The tree written is checked against the one the delta was made for.
+bool apply_cryxmlb_delta(const char* delta_name, const char* old_name, const char* new_name) {
+	mapped_file_t delta = map_file(delta_name, false);
+	if (!delta.data) {
+		return false;
+	}
+	if (delta.size < DELTA_HEADER_SIZE || memcmp(delta.data, "CXDelta", 8) != 0 || cryxmlb_load32(delta.data + 8) != DELTA_VERSION) {
+		fprintf(stderr, "File %s is not a CryXmlB delta\n", delta_name);
+		unmap_file(&delta);
+		return false;
+	}
+	mapped_file_t old_file = map_file(old_name, false);
+	if (!old_file.data) {
+		unmap_file(&delta);
+		return false;
+	}
+	uint32_t flags = cryxmlb_load32(delta.data + 12);
+	diff_tree_t old_tree;
+	bool written = false;
+	if (load_diff_tree(old_name, old_file.data, old_file.size, &old_tree)) {
+		if (old_tree.hashes[0] != load64(delta.data + 16)) {
+			fprintf(stderr, "Delta %s was not made from %s\n", delta_name, old_name);
+		}
+		else {
+			delta_reader_t reader = { delta.data + DELTA_HEADER_SIZE, delta.data + delta.size, true, std::vector<const char*>() };
+			cryxmlb_writer_t writer((flags & DELTA_INTERNED) != 0);
+			const char* message = 0;
+			if (!run_delta_ops(&reader, &old_tree, &writer, &message)) {
+				fprintf(stderr, "Delta %s is damaged: %s\n", delta_name, message);
+			}
+			else if (!writer.finish()) {
+				fprintf(stderr, "Delta %s is damaged: %s\n", delta_name, writer.error());
+			}
+			else {
+				if (flags & DELTA_BFS) {
+					layout_cryxmlb_bfs(writer.tables());
+				}
+				output_buffer_t output;
+				writer.serialize(output);
+				diff_tree_t new_tree;
+				if (!load_diff_tree(new_name, output.data(), output.size(), &new_tree) || new_tree.hashes[0] != load64(delta.data + 24)) {
+					fprintf(stderr, "Delta %s did not rebuild the file it was made for\n", delta_name);
+				}
+				else if (write_file(new_name, output.data(), output.size())) {
+					fprintf(stdout, "Wrote %s from %s and %s\n", new_name, old_name, delta_name);
+					written = true;
+				}
+			}
+		}
+	}
+	unmap_file(&old_file);
+	unmap_file(&delta);
+	return written;
+}
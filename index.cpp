@@ -0,0 +1,253 @@
+/*
+CryXmlB sidecar index
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cryxmlb.h"
+#include "cryxmlb_index.h"
+
+static const char* INDEX_EXTENSION = ".cxi";
+
+static bool is_key_attribute(const std::vector<std::string>& key_attributes, std::string_view name) {
+	for (const std::string& key : key_attributes) {
+		if (name == key) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The table being built: the full hash and the last entry of the key in
+// each slot, next to the slots and entries being written
+struct index_builder_t {
+	unsigned char* slots;
+	unsigned char* entries;
+	uint32_t mask;
+	uint32_t entry_count;
+	std::vector<uint64_t> slot_hashes;
+	std::vector<uint32_t> slot_tails;
+};
+
+// Adds node under the key with the hash. Linear probing finds the key's
+// slot, or an empty one for a new key; the node goes on the end of the
+// key's chain, so chains are in the order nodes are added.
+static void index_insert(index_builder_t* builder, uint64_t hash, uint32_t node) {
+	uint32_t slot = (uint32_t)hash & builder->mask;
+	while (cryxmlb_load32(builder->slots + (size_t)slot * 8 + 4) != 0 && builder->slot_hashes[slot] != hash) {
+		slot = (slot + 1) & builder->mask;
+	}
+	uint32_t entry = builder->entry_count++;
+	cryxmlb_store32(builder->entries + (size_t)entry * 8, node);
+	if (cryxmlb_load32(builder->slots + (size_t)slot * 8 + 4) == 0) {
+		cryxmlb_store32(builder->slots + (size_t)slot * 8, (uint32_t)(hash >> 32));
+		cryxmlb_store32(builder->slots + (size_t)slot * 8 + 4, entry + 1);
+		builder->slot_hashes[slot] = hash;
+	}
+	else {
+		cryxmlb_store32(builder->entries + (size_t)builder->slot_tails[slot] * 8 + 4, entry + 1);
+	}
+	builder->slot_tails[slot] = entry;
+}
+
+// Writes filename.cxi for a CryXmlB file: every element by its path, and
+// by the value of each key attribute it has. Elements are added in
+// document order, walking from the root, so lookups find them in that
+// order whatever the node layout.
+bool build_cryxmlb_index(const char* filename, const std::vector<std::string>& key_attributes) {
+	mapped_file_t file = map_file(filename, false);
+	if (!file.data) {
+		return false;
+	}
+	cryxmlb_reader_t reader;
+	unsigned char header_fields[9 * 4];
+	if (!reader.open(file.data, (size_t)file.size)) {
+		fprintf(stderr, "File %s is not in CryXmlB format\n", filename);
+		unmap_file(&file);
+		return false;
+	}
+
+	// The keys of every element reachable from the root, depth first with
+	// the hash of each node's path continuing from its parent's. A damaged
+	// child table may reach a node twice.
+	std::vector<std::pair<uint64_t, uint32_t> > keys;
+	std::vector<std::pair<uint32_t, uint64_t> > stack;
+	std::vector<bool> visited(reader.node_count, false);
+	if (reader.node_count > 0) {
+		stack.push_back(std::make_pair(0u, CRYXMLB_INDEX_SEED));
+	}
+	while (!stack.empty()) {
+		uint32_t index = stack.back().first;
+		uint64_t path_hash = stack.back().second;
+		stack.pop_back();
+		if (visited[index]) {
+			continue;
+		}
+		visited[index] = true;
+		cryxmlb_element_t element = reader.element(index);
+		path_hash = cryxmlb_index_feed(cryxmlb_index_feed(path_hash, "/", 1), element.name());
+		keys.push_back(std::make_pair(cryxmlb_index_mix(path_hash), index));
+		for (cryxmlb_attribute_t attr : element.attributes()) {
+			if (is_key_attribute(key_attributes, attr.name())) {
+				keys.push_back(std::make_pair(cryxmlb_index_key_hash(element.name(), attr.name(), attr.value()), index));
+			}
+		}
+		// Pushed last to first, so they come off the stack in order
+		cryxmlb_range_t<cryxmlb_element_t> children = element.children();
+		for (uint32_t i = children.size(); i-- > 0;) {
+			cryxmlb_element_t child = reader.element(cryxmlb_load32(reader.child_table + (size_t)(children.first + i) * 4));
+			if (child) {
+				stack.push_back(std::make_pair(child.index, path_hash));
+			}
+		}
+	}
+	memcpy(header_fields, file.data + 8, sizeof(header_fields));
+	unmap_file(&file);
+
+	// Twice as many slots as distinct keys keep probe runs short
+	std::vector<uint64_t> hashes(keys.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		hashes[i] = keys[i].first;
+	}
+	std::sort(hashes.begin(), hashes.end());
+	uint64_t distinct = std::unique(hashes.begin(), hashes.end()) - hashes.begin();
+	std::vector<uint64_t>().swap(hashes);
+	uint64_t slot_count = 16;
+	while (slot_count < distinct * 2) {
+		slot_count *= 2;
+	}
+	if (slot_count > UINT32_MAX || keys.size() > UINT32_MAX) {
+		fprintf(stderr, "File %s has too many elements to index\n", filename);
+		return false;
+	}
+	uint64_t names_size = 0;
+	for (const std::string& key : key_attributes) {
+		names_size += key.size() + 1;
+	}
+
+	output_buffer_t output(CRYXMLB_INDEX_HEADER_SIZE + (slot_count + keys.size()) * 8 + names_size, 0);
+	unsigned char* header = output.data();
+	memcpy(header, "CXIndex", 8);
+	cryxmlb_store32(header + 8, CRYXMLB_INDEX_VERSION);
+	cryxmlb_store32(header + 12, (uint32_t)slot_count);
+	cryxmlb_store32(header + 16, (uint32_t)keys.size());
+	cryxmlb_store32(header + 20, (uint32_t)names_size);
+	memcpy(header + 24, header_fields, sizeof(header_fields));
+	index_builder_t builder;
+	builder.slots = header + CRYXMLB_INDEX_HEADER_SIZE;
+	builder.entries = builder.slots + slot_count * 8;
+	builder.mask = (uint32_t)slot_count - 1;
+	builder.entry_count = 0;
+	builder.slot_hashes.resize(slot_count);
+	builder.slot_tails.resize(slot_count);
+	for (const std::pair<uint64_t, uint32_t>& key : keys) {
+		index_insert(&builder, key.first, key.second);
+	}
+	unsigned char* names = builder.entries + keys.size() * 8;
+	for (const std::string& key : key_attributes) {
+		memcpy(names, key.c_str(), key.size() + 1);
+		names += key.size() + 1;
+	}
+
+	std::string index_name = std::string(filename) + INDEX_EXTENSION;
+	if (!write_file(index_name.c_str(), output.data(), output.size())) {
+		return false;
+	}
+	fprintf(stdout, "Indexed %u elements and keys of %s in %s\n", builder.entry_count, filename, index_name.c_str());
+	return true;
+}
+
+// Looks key up through the file's sidecar: /path, or
+// Element[@attribute=value] for a key attribute. Appends a line per match
+// as --query does.
+bool lookup_file(const char* filename, const char* key, std::string* output, size_t* matches) {
+	*matches = 0;
+	std::string index_name = std::string(filename) + INDEX_EXTENSION;
+	mapped_file_t file = map_file(filename, false);
+	if (!file.data) {
+		return false;
+	}
+	// A missing sidecar is not an error to report as map_file would
+	FILE* probe = fopen(index_name.c_str(), "rb");
+	if (!probe) {
+		fprintf(stderr, "No index for %s; build it with --build-index\n", filename);
+		unmap_file(&file);
+		return false;
+	}
+	fclose(probe);
+	mapped_file_t index_file = map_file(index_name.c_str(), false);
+	cryxmlb_index_t index;
+	if (!index_file.data || !index.open(file.data, (size_t)file.size, index_file.data, (size_t)index_file.size)) {
+		fprintf(stderr, "Index %s is out of date or damaged; rebuild it with --build-index\n", index_name.c_str());
+		unmap_file(&index_file);
+		unmap_file(&file);
+		return false;
+	}
+
+	bool valid = true;
+	std::vector<cryxmlb_element_t> found(16);
+	size_t count = 0;
+	std::string_view text(key);
+	size_t bracket = text.find("[@");
+	size_t equals = text.find('=', bracket);
+	if (!text.empty() && text[0] == '/') {
+		while ((count = index.find_all_paths(text, found.data(), found.size())) == found.size()) {
+			found.resize(found.size() * 2);
+		}
+	}
+	else if (bracket != std::string_view::npos && equals != std::string_view::npos && text.back() == ']') {
+		std::string_view element = text.substr(0, bracket);
+		std::string_view attribute = text.substr(bracket + 2, equals - bracket - 2);
+		std::string_view value = text.substr(equals + 1, text.size() - equals - 2);
+		if (value.size() >= 2 && (value[0] == '\'' || value[0] == '"') && value.back() == value[0]) {
+			value = value.substr(1, value.size() - 2);
+		}
+		if (!index.indexed(attribute)) {
+			fprintf(stderr, "Attribute %.*s is not a key of the index of %s\n", (int)attribute.size(), attribute.data(), filename);
+			valid = false;
+		}
+		while (valid && (count = index.find_all(element, attribute, value, found.data(), found.size())) == found.size()) {
+			found.resize(found.size() * 2);
+		}
+	}
+	else {
+		fprintf(stderr, "Invalid lookup %s; expected /path or Element[@attribute=value]\n", key);
+		valid = false;
+	}
+	for (size_t i = 0; valid && i < count; i++) {
+		append_element_line(output, filename, found[i]);
+	}
+	*matches = valid ? count : 0;
+	unmap_file(&index_file);
+	unmap_file(&file);
+	return valid;
+}
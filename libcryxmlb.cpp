@@ -0,0 +1,248 @@
+/*
+CryXmlB conversion library
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+#include "cryxmlb.h"
+#include "libcryxmlb.h"
+
+struct cryxmlb_context_t {
+	tinyxml2::XMLDocument doc; // Its node pools keep their blocks between calls
+	cryxmlb_tables_t tables;
+	output_buffer_t output;
+	cry_xml_printer_t* printer; // Holds the XML output
+	cryxmlb_error_t error;
+};
+
+// The context's memory must outlive any arena of the calling thread, so
+// allocations during a call go to the heap
+struct library_scope_t {
+	arena_t* arena;
+	library_scope_t() : arena(thread_arena) {
+		thread_arena = 0;
+	}
+	~library_scope_t() {
+		thread_arena = arena;
+	}
+};
+
+static cryxmlb_status_t set_error(cryxmlb_context_t* context, cryxmlb_status_t status, int line, const char* format, ...) {
+	context->error.status = status;
+	context->error.line = line;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(context->error.message, sizeof(context->error.message), format, args);
+	va_end(args);
+	return status;
+}
+
+static cryxmlb_status_t set_ok(cryxmlb_context_t* context) {
+	memset(&context->error, 0, sizeof(context->error));
+	return CRYXMLB_OK;
+}
+
+cryxmlb_context_t* cryxmlb_context_create(void) {
+	library_scope_t scope;
+	cryxmlb_context_t* context = new (std::nothrow) cryxmlb_context_t();
+	if (context) {
+		context->printer = new (std::nothrow) cry_xml_printer_t();
+		if (!context->printer) {
+			delete context;
+			return 0;
+		}
+	}
+	return context;
+}
+
+void cryxmlb_context_destroy(cryxmlb_context_t* context) {
+	library_scope_t scope;
+	if (context) {
+		delete context->printer;
+		delete context;
+	}
+}
+
+const cryxmlb_error_t* cryxmlb_context_error(const cryxmlb_context_t* context) {
+	return context ? &context->error : 0;
+}
+
+cryxmlb_status_t cryxmlb_from_xml(cryxmlb_context_t* context, const char* xml, size_t size, cryxmlb_buffer_t* out) {
+	if (!context) {
+		return CRYXMLB_ERROR_ARGUMENT;
+	}
+	library_scope_t scope;
+	if (!xml || size == 0 || !out) {
+		return set_error(context, CRYXMLB_ERROR_ARGUMENT, 0, "no input or output");
+	}
+	if (size >= 8 && memcmp(xml, "CryXmlB", 8) == 0) {
+		return set_error(context, CRYXMLB_ERROR_FORMAT, 0, "input is already in CryXmlB format");
+	}
+
+	try {
+		tinyxml2::XMLDocument& doc = context->doc;
+		cryxmlb_tables_t& tables = context->tables;
+		context->output.clear();
+		if (doc.Parse(xml, size) != tinyxml2::XML_SUCCESS) {
+			set_error(context, CRYXMLB_ERROR_PARSE, doc.ErrorLineNum(), "%s", doc.ErrorStr());
+			doc.Clear();
+			return context->error.status;
+		}
+		if (!doc.RootElement()) {
+			return set_error(context, CRYXMLB_ERROR_PARSE, 0, "no root element");
+		}
+		tables.node_table.clear();
+		tables.attr_table.clear();
+		tables.child_table.clear();
+		tables.data_table.clear();
+		const char* error = 0;
+		bool encoded = encode_xml_tables(doc.RootElement(), tables, &error);
+		doc.Clear();
+		if (!encoded) {
+			return set_error(context, CRYXMLB_ERROR_TOO_LARGE, 0, "%s", error);
+		}
+		serialize_cryxmlb(tables, context->output);
+	}
+	catch (const std::bad_alloc&) {
+		context->doc.Clear();
+		return set_error(context, CRYXMLB_ERROR_MEMORY, 0, "out of memory");
+	}
+	out->data = context->output.data();
+	out->size = context->output.size();
+	return set_ok(context);
+}
+
+cryxmlb_status_t xml_from_cryxmlb(cryxmlb_context_t* context, const unsigned char* data, size_t size, cryxmlb_buffer_t* out) {
+	if (!context) {
+		return CRYXMLB_ERROR_ARGUMENT;
+	}
+	library_scope_t scope;
+	if (!data || size == 0 || !out) {
+		return set_error(context, CRYXMLB_ERROR_ARGUMENT, 0, "no input or output");
+	}
+	const size_t header_size = 8 + 9 * sizeof(int32_t);
+	if (size < header_size || memcmp(data, "CryXmlB", 8) != 0) {
+		return set_error(context, CRYXMLB_ERROR_FORMAT, 0, data[0] == '<' ? "input is already XML" : "input is not in CryXmlB format");
+	}
+
+	// With the signature in place the header reads without errors. The
+	// decoder seeks to every table, so each must start inside the input.
+	binary_stream_t stream = { (unsigned char*)data, 0, size };
+	cryxmlb_header_t header;
+	read_cryxmlb_header("buffer", &stream, &header);
+	if (header.node_table_count == 0 || header.data_table_size == 0
+		|| header.node_table_offset >= size || header.node_table_offset + (uint64_t)header.node_table_count * sizeof(cry_xml_node_t) > size
+		|| header.attr_table_offset >= size || header.attr_table_offset + (uint64_t)header.attr_table_count * sizeof(cry_xml_ref_t) > size
+		|| header.child_table_offset >= size || header.child_table_offset + (uint64_t)header.child_table_count * sizeof(uint32_t) > size
+		|| header.data_table_offset + (uint64_t)header.data_table_size > size
+		|| data[header.data_table_offset + header.data_table_size - 1] != 0) {
+		return set_error(context, CRYXMLB_ERROR_CORRUPT, 0, "tables out of range");
+	}
+
+	try {
+		// Files in the encoder's order are printed straight from the input
+		mapped_file_t input = { (unsigned char*)data, size, false };
+		if (!context->printer) {
+			context->printer = new cry_xml_printer_t();
+		}
+		context->printer->ClearBuffer();
+		if (!print_xml_streaming(context->printer, &input, &header, 0)) {
+			// The printer may have elements open; start over with a new one
+			delete context->printer;
+			context->printer = 0;
+			context->printer = new cry_xml_printer_t();
+
+			cryxmlb_file_t file;
+			if (!decode_cryxmlb("buffer", (unsigned char*)data, size, &file)) {
+				return set_error(context, CRYXMLB_ERROR_MEMORY, 0, "out of memory");
+			}
+			char message[128];
+			bool valid = check_cryxmlb_references(&file, file.data_table_size, message, sizeof(message));
+			bool built = valid && build_xml_document(&file, &context->doc);
+			free_cryxmlb(&file);
+			if (built) {
+				context->doc.Print(context->printer);
+			}
+			context->doc.Clear();
+			if (!valid) {
+				return set_error(context, CRYXMLB_ERROR_CORRUPT, 0, "%s", message);
+			}
+			if (!built) {
+				return set_error(context, CRYXMLB_ERROR_MEMORY, 0, "out of memory");
+			}
+		}
+	}
+	catch (const std::bad_alloc&) {
+		context->doc.Clear();
+		return set_error(context, CRYXMLB_ERROR_MEMORY, 0, "out of memory");
+	}
+	out->data = (const unsigned char*)context->printer->CStr();
+	out->size = context->printer->CStrSize() - 1;
+	return set_ok(context);
+}
+
+cryxmlb_status_t cryxmlb_patch(cryxmlb_context_t* context, const unsigned char* data, size_t size,
+	const char* const* assignments, size_t count, cryxmlb_buffer_t* out) {
+	if (!context) {
+		return CRYXMLB_ERROR_ARGUMENT;
+	}
+	library_scope_t scope;
+	if (!data || size == 0 || !out || !assignments || count == 0) {
+		return set_error(context, CRYXMLB_ERROR_ARGUMENT, 0, "no input, output or assignments");
+	}
+	if (size < 8 || memcmp(data, "CryXmlB", 8) != 0) {
+		return set_error(context, CRYXMLB_ERROR_FORMAT, 0, "input is not in CryXmlB format");
+	}
+
+	try {
+		std::vector<cryxmlb_assignment_t> parsed(count);
+		for (size_t i = 0; i < count; i++) {
+			if (!assignments[i] || !parse_assignment(assignments[i], &parsed[i])) {
+				return set_error(context, CRYXMLB_ERROR_ARGUMENT, 0, "invalid assignment %s", assignments[i] ? assignments[i] : "(null)");
+			}
+		}
+		cryxmlb_patch_t patch;
+		char message[sizeof(context->error.message)];
+		if (!plan_cryxmlb_patch(data, size, parsed.data(), count, &patch, message, sizeof(message))) {
+			return set_error(context, CRYXMLB_ERROR_PATCH, 0, "%s", message);
+		}
+		output_buffer_t& output = context->output;
+		output.assign(data, data + size);
+		output.insert(output.end(), patch.strings.begin(), patch.strings.end());
+		apply_cryxmlb_patch(output.data(), &patch);
+	}
+	catch (const std::bad_alloc&) {
+		return set_error(context, CRYXMLB_ERROR_MEMORY, 0, "out of memory");
+	}
+	out->data = context->output.data();
+	out->size = context->output.size();
+	return set_ok(context);
+}
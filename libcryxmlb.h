@@ -0,0 +1,111 @@
+/*
+CryXmlB conversion library
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef LIBCRYXMLB_INCLUDED
+#define LIBCRYXMLB_INCLUDED
+
+#include <stddef.h>
+
+// Buffer to buffer conversion between XML and CryXmlB, for tools that link
+// the converter instead of running it. Nothing is read from or written to
+// files; errors are returned with the context.
+//
+// Every call takes a context, which keeps the parser's pools, the tables and
+// the output between calls so converting many files reuses their memory.
+// A context must only be used by one thread at a time; separate contexts can
+// be used on separate threads at once.
+
+#if defined(_WIN32)
+#   if defined(CRYXMLB_EXPORT)
+#       define CRYXMLB_LIB __declspec(dllexport)
+#   elif defined(CRYXMLB_IMPORT)
+#       define CRYXMLB_LIB __declspec(dllimport)
+#   else
+#       define CRYXMLB_LIB
+#   endif
+#elif __GNUC__ >= 4
+#   define CRYXMLB_LIB __attribute__((visibility("default")))
+#else
+#   define CRYXMLB_LIB
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum cryxmlb_status_t {
+	CRYXMLB_OK = 0,
+	CRYXMLB_ERROR_ARGUMENT, // A null pointer or empty input
+	CRYXMLB_ERROR_FORMAT, // The input is not in the format converted from
+	CRYXMLB_ERROR_PARSE, // The XML is not well formed; line is set
+	CRYXMLB_ERROR_CORRUPT, // The CryXmlB tables point outside the input
+	CRYXMLB_ERROR_TOO_LARGE, // The result does not fit the 32-bit offsets of CryXmlB
+	CRYXMLB_ERROR_MEMORY,
+	CRYXMLB_ERROR_PATCH // An assignment selects nothing to change
+} cryxmlb_status_t;
+
+typedef struct cryxmlb_error_t {
+	cryxmlb_status_t status;
+	int line; // Line of an XML parse error, or 0
+	char message[256];
+} cryxmlb_error_t;
+
+// Output of a conversion. It belongs to the context and stays valid until
+// the next call with it.
+typedef struct cryxmlb_buffer_t {
+	const unsigned char* data;
+	size_t size;
+} cryxmlb_buffer_t;
+
+typedef struct cryxmlb_context_t cryxmlb_context_t;
+
+// Returns null when out of memory
+CRYXMLB_LIB cryxmlb_context_t* cryxmlb_context_create(void);
+CRYXMLB_LIB void cryxmlb_context_destroy(cryxmlb_context_t* context);
+
+// Encodes XML text as a CryXmlB file, the same bytes the converter writes
+CRYXMLB_LIB cryxmlb_status_t cryxmlb_from_xml(cryxmlb_context_t* context, const char* xml, size_t size, cryxmlb_buffer_t* out);
+
+// Prints a CryXmlB file as XML text, the same text the converter writes
+// (with \n line ends on every platform)
+CRYXMLB_LIB cryxmlb_status_t xml_from_cryxmlb(cryxmlb_context_t* context, const unsigned char* data, size_t size, cryxmlb_buffer_t* out);
+
+// Sets attributes or text in a CryXmlB file without converting it. Each
+// assignment is path/@attribute=value or path=value, as --set takes them;
+// all paths are matched against the input. The output is the input with
+// the new strings appended to the data table and only the changed offsets
+// and the header sizes rewritten.
+CRYXMLB_LIB cryxmlb_status_t cryxmlb_patch(cryxmlb_context_t* context, const unsigned char* data, size_t size,
+	const char* const* assignments, size_t count, cryxmlb_buffer_t* out);
+
+// What went wrong in the last call with the context; status is CRYXMLB_OK
+// after a successful one
+CRYXMLB_LIB const cryxmlb_error_t* cryxmlb_context_error(const cryxmlb_context_t* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBCRYXMLB_INCLUDED
@@ -27,359 +27,392 @@ SOFTWARE.
 */
 
 #define _CRT_SECURE_NO_WARNINGS
-#include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-
-#include "tinyxml2.h"
-
-struct cry_xml_node_t {
-	int32_t name_offset;
-	int32_t content_offset;
-	int16_t attribute_count;
-	int16_t child_count;
-	int32_t parent_id;
-	int32_t first_attr_idx;
-	int32_t first_child_idx;
-	int32_t reserved;
-};
-
-struct cry_xml_ref_t {
-	int32_t name_offset;
-	int32_t value_offset;
-};
-
-struct cry_xml_value_t {
-	int32_t offset;
-	char* value;
-};
-
-struct read_file_result_t {
-	unsigned char *data;
-	uint64_t size;
-};
-read_file_result_t read_file(const char *filename) {
-	read_file_result_t result = {};
-	FILE* f = fopen(filename, "rb");
-	if (f) {
-		fseek(f, 0L, SEEK_END);
-		size_t size = ftell(f);
-		fseek(f, 0L, SEEK_SET);
-		unsigned char* data = (unsigned char*)malloc(size);
-		if (data && fread(data, 1, size, f) == size) {
-			result.data = data;
-			result.size = size;
-		}
-		else {
-			fprintf(stderr, "Error reading file %s\n", filename);
-			free(data); // Free allocated memory on error
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cryxmlb.h"
+
+// Attributes separated by commas after an option's '=', or Name and Id
+static void parse_key_attributes(const char* list, std::vector<std::string>* keys) {
+	keys->clear();
+	for (const char* key = list; *key;) {
+		const char* end = strchr(key, ',');
+		size_t length = end ? (size_t)(end - key) : strlen(key);
+		if (length > 0) {
+			keys->push_back(std::string(key, length));
 		}
-		fclose(f);
+		key += length + (end ? 1 : 0);
 	}
-	else {
-		fprintf(stderr, "Error opening file %s\n", filename);
+	if (keys->empty()) {
+		keys->push_back("Name");
+		keys->push_back("Id");
 	}
-	return result;
 }
 
-bool write_file(const char* filename, const unsigned char* data, size_t size) {
-	bool result = true;
-	FILE *f = fopen(filename, "wb");
-	if (f) {
-		if (fwrite(data, 1, size, f) != size) {
-			fprintf(stderr, "Error writing file %s\n", filename);
-			result = false;
-		}
-		fclose(f);
-	}
-	else {
-		fprintf(stderr, "Error opening file %s\n", filename);
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "USAGE: CryXmlB filename [filenames...] [--to-xml|--to-cryxmlb] [--layout=preorder|bfs] [--parallel[=threads]] [--jobs=N] [--arena-retain=MB] [--memory-budget=MB] [--stats[=json]] [--stats-out=file] [--alloc-stats] [--trace=file]\n");
+		fprintf(stderr, "       CryXmlB --verify filename [filenames...] [--jobs=N] [--trace=file]\n");
+		fprintf(stderr, "       CryXmlB --set path/@attribute=value [--set ...] filename [filenames...] [--jobs=N]\n");
+		fprintf(stderr, "       CryXmlB --query path file-or-directory [...] [--jobs=N]\n");
+		fprintf(stderr, "       CryXmlB --build-index[=attribute,...] filename [filenames...]\n");
+		fprintf(stderr, "       CryXmlB --lookup /path|Element[@attribute=value] filename [filenames...]\n");
+		fprintf(stderr, "       CryXmlB --diff[=attribute,...] old new delta\n");
+		fprintf(stderr, "       CryXmlB --apply delta old new\n");
+		fprintf(stderr, "       CryXmlB --merge[=attribute,...] base overlay [overlays...] [--out=file]\n");
+		fprintf(stderr, "       CryXmlB --benchmark [--iterations=N] [--scale=F] [--seed=N] [--dir=path]\n"
+			"                    [--save-baseline=file] [--compare=file] [--threshold=percent]\n");
+		return 1;
 	}
-	return result;
-}
 
-struct binary_stream_t {
-	unsigned char* data;
-	uint64_t ptr;
-	uint64_t size;
-};
-
-uint64_t seek(binary_stream_t* stream, uint64_t offset) {
-	assert(offset < stream->size);
-	if (offset < stream->size) {
-		stream->ptr = offset;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--benchmark") == 0) {
+			return run_benchmark(argc, argv);
+		}
 	}
-	return stream->ptr;
-}
-
-unsigned char peek_byte(binary_stream_t* stream) {
-	assert(stream->ptr < stream->size);
-	return (stream->ptr < stream->size) ? stream->data[stream->ptr] : 0;
-}
 
-char* read_string(binary_stream_t* stream, uint64_t size) {
-	char *result = 0;
-	assert(stream->ptr + size <= stream->size);
-	if (stream->ptr + size <= stream->size) {
-		result = (char*)(stream->data + stream->ptr);
-		stream->ptr += size;
+	bool to_cryxmlb = false;
+	bool auto_detect = true;
+	convert_options_t options = {};
+	options.threads = 1;
+	unsigned jobs = 1;
+	bool jobs_given = false;
+	size_t arena_retain = 64 * 1024 * 1024;
+	bool verify = false;
+	bool show_stats = false;
+	bool stats_json = false;
+	const char* stats_path = 0;
+	const char* trace_path = 0;
+	std::vector<const char*> files;
+	std::vector<cryxmlb_assignment_t> assignments;
+	cryxmlb_query_t query;
+	bool querying = false;
+	std::vector<std::string> query_paths; // Files found under the paths given
+	bool build_index = false;
+	std::vector<std::string> key_attributes;
+	const char* lookup_key = 0;
+	bool diffing = false;
+	bool applying = false;
+	bool merging = false;
+	const char* output_name = 0;
+
+	// Options may appear anywhere; every other argument is a file
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		if (strncmp(arg, "--", 2) != 0) {
+			files.push_back(arg);
+			continue;
+		}
+		if (strcmp(arg, "--to-cryxmlb") == 0) {
+			to_cryxmlb = true;
+			auto_detect = false;
+		}
+		else if (strcmp(arg, "--to-xml") == 0) {
+			to_cryxmlb = false;
+			auto_detect = false;
+		}
+		else if (strcmp(arg, "--layout=preorder") == 0) {
+			options.layout = LAYOUT_PREORDER;
+		}
+		else if (strcmp(arg, "--layout=bfs") == 0) {
+			options.layout = LAYOUT_BFS;
+		}
+		else if (strcmp(arg, "--parallel") == 0) {
+			options.threads = std::thread::hardware_concurrency();
+		}
+		else if (strncmp(arg, "--parallel=", 11) == 0) {
+			options.threads = (unsigned)atoi(arg + 11);
+		}
+		else if (strcmp(arg, "--jobs") == 0) {
+			jobs = std::thread::hardware_concurrency();
+			jobs_given = true;
+		}
+		else if (strncmp(arg, "--jobs=", 7) == 0) {
+			jobs = (unsigned)atoi(arg + 7);
+			jobs_given = true;
+		}
+		else if (strcmp(arg, "--verify") == 0) {
+			verify = true;
+		}
+		else if (strncmp(arg, "--arena-retain=", 15) == 0) {
+			arena_retain = (size_t)strtoull(arg + 15, 0, 10) * 1024 * 1024;
+		}
+		else if (strncmp(arg, "--memory-budget=", 16) == 0) {
+			options.memory_budget = strtoull(arg + 16, 0, 10) * 1024 * 1024;
+		}
+		else if (strcmp(arg, "--stats") == 0) {
+			show_stats = true;
+		}
+		else if (strcmp(arg, "--stats=json") == 0) {
+			show_stats = true;
+			stats_json = true;
+		}
+		else if (strncmp(arg, "--stats-out=", 12) == 0) {
+			show_stats = true;
+			stats_path = arg + 12;
+		}
+		else if (strcmp(arg, "--alloc-stats") == 0) {
+			show_stats = true;
+			options.track_allocations = true;
+		}
+		else if (strcmp(arg, "--set") == 0 || strncmp(arg, "--set=", 6) == 0) {
+			// The assignment is the next argument, or follows the '='
+			const char* spec = arg[5] == '=' ? arg + 6 : (i + 1 < argc ? argv[++i] : "");
+			assignments.push_back(cryxmlb_assignment_t());
+			if (!parse_assignment(spec, &assignments.back())) {
+				fprintf(stderr, "Invalid --set %s; expected path/@attribute=value or path=value\n", spec);
+				return 1;
+			}
+		}
+		else if (strcmp(arg, "--query") == 0 || strncmp(arg, "--query=", 8) == 0) {
+			const char* text = arg[7] == '=' ? arg + 8 : (i + 1 < argc ? argv[++i] : "");
+			std::string error;
+			if (!compile_query(text, &query, &error)) {
+				fprintf(stderr, "Invalid --query %s: %s\n", text, error.c_str());
+				return 1;
+			}
+			querying = true;
+		}
+		else if (strcmp(arg, "--build-index") == 0 || strncmp(arg, "--build-index=", 14) == 0) {
+			build_index = true;
+			parse_key_attributes(arg[13] == '=' ? arg + 14 : "", &key_attributes);
+		}
+		else if (strcmp(arg, "--diff") == 0 || strncmp(arg, "--diff=", 7) == 0) {
+			diffing = true;
+			parse_key_attributes(arg[6] == '=' ? arg + 7 : "", &key_attributes);
+		}
+		else if (strcmp(arg, "--apply") == 0) {
+			applying = true;
+		}
+		else if (strcmp(arg, "--merge") == 0 || strncmp(arg, "--merge=", 8) == 0) {
+			merging = true;
+			parse_key_attributes(arg[7] == '=' ? arg + 8 : "", &key_attributes);
+		}
+		else if (strncmp(arg, "--out=", 6) == 0) {
+			output_name = arg + 6;
+		}
+		else if (strcmp(arg, "--lookup") == 0 || strncmp(arg, "--lookup=", 9) == 0) {
+			lookup_key = arg[8] == '=' ? arg + 9 : (i + 1 < argc ? argv[++i] : "");
+		}
+		else if (strncmp(arg, "--trace=", 8) == 0) {
+			trace_path = arg + 8;
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", arg);
+			return 1;
+		}
 	}
-	else {
-		stream->ptr = stream->size;
+	if (diffing || applying) {
+		if (files.size() != 3) {
+			fprintf(stderr, diffing ? "--diff takes an old file, a new file and the delta to write\n"
+				: "--apply takes a delta, the old file and the new file to write\n");
+			return 1;
+		}
+		bool done = diffing ? diff_cryxmlb_files(files[0], files[1], files[2], key_attributes)
+			: apply_cryxmlb_delta(files[0], files[1], files[2]);
+		return done ? 0 : 1;
 	}
-	return result;
-}
-
-char* read_cstring(binary_stream_t* stream) {
-	char *result = (char*)stream->data + stream->ptr;
-	for (; stream->data[stream->ptr]; stream->ptr++) {
-		assert(stream->ptr < stream->size);
-		if (stream->ptr == stream->size) {
-			result = 0;
-			break;
+	if (merging) {
+		if (files.size() < 2) {
+			fprintf(stderr, "--merge takes a CryXmlB file and the XML overlays to merge onto it\n");
+			return 1;
 		}
+		return merge_cryxmlb_file(files[0], files.data() + 1, files.size() - 1, output_name, key_attributes) ? 0 : 1;
 	}
-	if (stream->ptr < stream->size) {
-		stream->ptr++;
+	if (querying) {
+		// Directories are searched through, on every core unless told otherwise
+		for (const char* path : files) {
+			list_files(path, &query_paths);
+		}
+		files.clear();
+		for (const std::string& path : query_paths) {
+			files.push_back(path.c_str());
+		}
+		if (!jobs_given) {
+			jobs = std::thread::hardware_concurrency();
+		}
 	}
-	return result;
-}
-
-unsigned char read_byte(binary_stream_t* stream) {
-	unsigned char result = 0;
-	assert(stream->ptr < stream->size);
-	if (stream->ptr < stream->size) {
-		result = stream->data[stream->ptr++];
+	if (jobs < 1) {
+		jobs = 1;
+	}
+	if (jobs > files.size()) {
+		jobs = files.size() ? (unsigned)files.size() : 1;
+	}
+	if (trace_path) {
+		trace_start();
+	}
+	if (options.track_allocations) {
+		alloc_tracking_start();
 	}
-	return result;
-}
-
-uint16_t read_uint16(binary_stream_t* stream) {
-	unsigned char bytes[2];
-	bytes[0] = read_byte(stream);
-	bytes[1] = read_byte(stream);
-	return (bytes[1] << 8) | bytes[0];
-}
-
-int16_t read_int16(binary_stream_t* stream) {
-	return (int16_t)read_uint16(stream);
-}
-
-uint32_t read_uint32(binary_stream_t *stream) {
-	unsigned char bytes[4];
-	bytes[0] = read_byte(stream);
-	bytes[1] = read_byte(stream);
-	bytes[2] = read_byte(stream);
-	bytes[3] = read_byte(stream);
-	return (bytes[3] << 24) | (bytes[2] << 16) | (bytes[1] << 8) | bytes[0];
-}
-int32_t read_int32(binary_stream_t* stream) {
-	return (int32_t)read_uint32(stream);
-}
-
-void convert_file(const char *filename) {
-	binary_stream_t the_stream = {};
-
-	const char *ext_str = "bak";
-	read_file_result_t xml_file = read_file(filename);
-
-	binary_stream_t* stream = &the_stream;
-	stream->data = xml_file.data;
-	stream->size = xml_file.size;
-
-	if (xml_file.data && xml_file.size) {
-		unsigned char peek = peek_byte(stream);
-		if (peek == '<') {
-			fprintf(stdout, "File %s is already XML\n", filename);
-			free(xml_file.data);
-			return;
-		}
-		else if (peek != 'C') {
-			fprintf(stderr, "File %s has unknown file format\n", filename);
-			free(xml_file.data);
-			return;
-		}
-
-		char* backup_name = (char*)malloc(strlen(filename) + strlen(ext_str) + 2); // +2 for the dot and null terminator
-		if (!backup_name) {
-			fprintf(stderr, "Memory allocation failed\n");
-			free(xml_file.data);
-			return;
-		}
-		sprintf(backup_name, "%s.%s", filename, ext_str);
-		if (!write_file(backup_name, xml_file.data, xml_file.size)) {
-			fprintf(stderr, "Aborting.\n");
-			free(backup_name);
-			free(xml_file.data);
-			exit(1);
-		}
-		free(backup_name);
-
-		char * header = read_cstring(stream);
-		if (header) {
-			if (strncmp(header, "CryXmlB", 7) == 0) {
-				uint32_t file_size = read_int32(stream);
-
-				uint32_t node_table_offset = read_int32(stream);
-				uint32_t node_table_count = read_int32(stream);
-
-				uint32_t attr_table_offset = read_int32(stream);
-				uint32_t attr_table_count = read_int32(stream);
-
-				uint32_t child_table_offset = read_int32(stream);
-				uint32_t child_table_count = read_int32(stream);
 
-				uint32_t data_table_offset = read_int32(stream);
-				uint32_t data_table_size = read_int32(stream);
+	// A JSON report on stdout has to be the only thing there
+	options.messages = (stats_json && !stats_path) ? stderr : stdout;
 
-				cry_xml_node_t *node_table = (cry_xml_node_t*)calloc(node_table_count, sizeof(*node_table));
-				if (!node_table) {
-					fprintf(stderr, "Memory allocation failed\n");
-					free(xml_file.data);
-					return;
-				}
-				seek(stream, node_table_offset);
-				for (uint32_t i = 0; i < node_table_count; i++) {
-					cry_xml_node_t *node = node_table + i;
-					node->name_offset = read_int32(stream);
-					node->content_offset = read_int32(stream);
-					node->attribute_count = read_int16(stream);
-					node->child_count = read_int16(stream);
-					node->parent_id = read_int32(stream);
-					node->first_attr_idx = read_int32(stream);
-					node->first_child_idx = read_int32(stream);
-					node->reserved = read_int32(stream);
-				}
+	std::vector<conversion_stats_t> stats;
+	if (show_stats) {
+		stats.resize(files.size());
+	}
 
-				cry_xml_ref_t* attr_table = (cry_xml_ref_t*)calloc(attr_table_count, sizeof(*attr_table));
-				if (!attr_table) {
-					fprintf(stderr, "Memory allocation failed\n");
-					free(node_table);
-					free(xml_file.data);
-					return;
-				}
-				seek(stream, attr_table_offset);
-				for (uint32_t i = 0; i < attr_table_count; i++) {
-					attr_table[i].name_offset = read_int32(stream);
-					attr_table[i].value_offset = read_int32(stream);
+	// Workers take the next file from a shared queue, so one slow file
+	// only holds up its own worker. Each has an arena for the converters'
+	// scratch memory that is reset after every file.
+	size_t next_file = 0;
+	std::atomic<size_t> failed_files(0);
+	std::atomic<size_t> query_matches(0);
+	std::atomic<size_t> matched_files(0);
+	std::mutex queue_mutex;
+	std::mutex print_mutex;
+	auto process_files = [&]() {
+		arena_t arena(arena_retain);
+		thread_arena = &arena;
+		query_state_t query_state;
+		std::string query_output;
+		for (;;) {
+			double start = stats_now();
+			size_t index;
+			{
+				std::lock_guard<std::mutex> lock(queue_mutex);
+				index = next_file++;
+			}
+			trace_event("wait", "queue", 0, start, stats_now());
+			if (index >= files.size()) {
+				break;
+			}
+			const char* filename = files[index];
+			start = stats_now();
+			if (verify) {
+				if (!verify_file(filename)) {
+					failed_files++;
 				}
-
-				uint32_t* child_table = (uint32_t*)calloc(child_table_count, sizeof(*child_table));
-				if (!child_table) {
-					fprintf(stderr, "Memory allocation failed\n");
-					free(attr_table);
-					free(node_table);
-					free(xml_file.data);
-					return;
+				arena_reset(&arena);
+				trace_event("file", "verify", filename, start, stats_now());
+				continue;
+			}
+			if (build_index) {
+				if (!build_cryxmlb_index(filename, key_attributes)) {
+					failed_files++;
 				}
-				seek(stream, child_table_offset);
-				for (uint32_t i = 0; i < child_table_count; i++) {
-					child_table[i] = read_int32(stream);
+				trace_event("file", "build_index", filename, start, stats_now());
+				continue;
+			}
+			if (querying || lookup_key) {
+				size_t matches = 0;
+				query_output.clear();
+				bool found = querying ? query_file(filename, &query, &query_state, &query_output, &matches)
+					: lookup_file(filename, lookup_key, &query_output, &matches);
+				if (!found) {
+					failed_files++;
 				}
-
-				tinyxml2::XMLDocument doc;
-				tinyxml2::XMLElement **xml_nodes = (tinyxml2::XMLElement**)malloc(node_table_count * sizeof(*xml_nodes));
-				if (!xml_nodes) {
-					fprintf(stderr, "Memory allocation failed\n");
-					free(child_table);
-					free(attr_table);
-					free(node_table);
-					free(xml_file.data);
-					return;
+				if (matches > 0) {
+					std::lock_guard<std::mutex> lock(print_mutex);
+					fwrite(query_output.data(), 1, query_output.size(), stdout);
+					query_matches += matches;
+					matched_files++;
 				}
-				uint64_t attr_idx = 0;
-				char *data_table = (char*)stream->data + data_table_offset;
-				for (uint32_t i = 0; i < node_table_count; i++) {
-					cry_xml_node_t *node = node_table + i;
-					tinyxml2::XMLElement *elem = doc.NewElement(data_table + node->name_offset);
-					for (int16_t j = 0; j < node->attribute_count; j++) {
-						elem->SetAttribute(data_table + attr_table[attr_idx].name_offset, data_table + attr_table[attr_idx].value_offset);
-						attr_idx++;
-					}
-					elem->SetText(data_table + node->content_offset);
-					xml_nodes[i] = elem;
+				trace_event("file", querying ? "query" : "lookup", filename, start, stats_now());
+				continue;
+			}
+			if (!assignments.empty()) {
+				if (!patch_cryxmlb_file(filename, assignments.data(), assignments.size())) {
+					failed_files++;
 				}
-				for (uint32_t i = 0; i < node_table_count; i++) {
-					cry_xml_node_t* node = node_table + i;
-					if (node->parent_id == -1) {
-						doc.InsertFirstChild(xml_nodes[i]);
-					}
-					else {
-						xml_nodes[node->parent_id]->InsertEndChild(xml_nodes[i]);
-					}
+				arena_reset(&arena);
+				trace_event("file", "patch", filename, start, stats_now());
+				continue;
+			}
+			fprintf(options.messages, "Processing file: %s\n", filename);
+
+			// If conversion type wasn't specified, auto-detect based on file content
+			bool current_to_cryxmlb = to_cryxmlb;
+			if (auto_detect) {
+				// Only the first byte is needed, not the whole file
+				FILE* file = fopen(filename, "rb");
+				if (file) {
+					current_to_cryxmlb = (fgetc(file) == '<'); // If it starts with '<', it's XML
+					fclose(file);
 				}
+				trace_event("phase", "detect", filename, start, stats_now());
+			}
 
-				// Switch to non-compact formatting with proper indentation
-				doc.SaveFile(filename, false);
-
-				// Free all allocated memory
-				free(xml_nodes);
-				free(child_table);
-				free(attr_table);
-				free(node_table);
+			// Convert the file
+			conversion_stats_t* file_stats = show_stats ? &stats[index] : 0;
+			if (current_to_cryxmlb) {
+				convert_xml_to_cryxmlb(filename, &options, file_stats);
 			}
 			else {
-				fprintf(stderr, "Invalid header in file %s\n", filename);
+				convert_file(filename, &options, file_stats);
+			}
+			arena_reset(&arena);
+			trace_event("file", "convert", filename, start, stats_now());
+			if (file_stats && !stats_json && !stats_path) {
+				std::lock_guard<std::mutex> lock(print_mutex);
+				print_stats(stdout, file_stats);
 			}
 		}
-		else {
-			fprintf(stderr, "Error reading header of file %s\n", filename);
+		thread_arena = 0;
+	};
+
+	// Process each file, on this thread unless --jobs asks for more
+	if (jobs > 1) {
+		std::vector<std::thread> workers;
+		for (unsigned j = 0; j < jobs; j++) {
+			workers.push_back(std::thread(process_files));
 		}
-
-		// Free the file data
-		free(xml_file.data);
+		double wait_start = stats_now();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		trace_event("wait", "join_workers", 0, wait_start, stats_now());
 	}
-}
-
-int main(int argc, char* argv[]) {
-	if (argc < 2) {
-		fprintf(stderr, "USAGE: CryXmlB filename [filenames...] [--to-xml|--to-cryxmlb]\n");
-		return 1;
+	else {
+		process_files();
 	}
 
-	bool to_cryxmlb = false;
-	int file_start_index = 1;
-	int file_end_index = argc;
-
-	// Check if the last argument is a conversion option
-	if (argc >= 3) {
-		const char* last_arg = argv[argc - 1];
-		if (strcmp(last_arg, "--to-cryxmlb") == 0) {
-			to_cryxmlb = true;
-			file_end_index = argc - 1; // Exclude the option from file list
+	if (show_stats) {
+		// The report goes to stdout unless a file is given, which keeps it
+		// apart from the progress messages
+		FILE* stats_file = stats_path ? fopen(stats_path, "w") : stdout;
+		if (!stats_file) {
+			fprintf(stderr, "Error opening file %s\n", stats_path);
+			return 1;
 		}
-		else if (strcmp(last_arg, "--to-xml") == 0) {
-			to_cryxmlb = false;
-			file_end_index = argc - 1; // Exclude the option from file list
+		if (stats_json) {
+			print_stats_json(stats_file, stats.data(), stats.size());
 		}
-	}
-
-	// Process each file
-	for (int i = file_start_index; i < file_end_index; i++) {
-		const char* filename = argv[i];
-		fprintf(stdout, "Processing file: %s\n", filename);
-
-		// If conversion type wasn't specified, auto-detect based on file content
-		bool current_to_cryxmlb = to_cryxmlb;
-		if (file_end_index == argc) { // No conversion option was specified
-			read_file_result_t file = read_file(filename);
-			if (file.data && file.size > 0) {
-				current_to_cryxmlb = (file.data[0] == '<'); // If it starts with '<', it's XML
-				free(file.data);
+		else {
+			if (stats_path) {
+				for (const conversion_stats_t& file_stats : stats) {
+					print_stats(stats_file, &file_stats);
+				}
 			}
+			print_stats_summary(stats_file, stats.data(), stats.size());
 		}
-
-		// Convert the file
-		if (current_to_cryxmlb) {
-			extern void convert_xml_to_cryxmlb(const char* filename);
-			convert_xml_to_cryxmlb(filename);
-		}
-		else {
-			convert_file(filename);
+		if (stats_path) {
+			fclose(stats_file);
 		}
 	}
 
+	if (trace_path && !trace_write(trace_path)) {
+		return 1;
+	}
+	if (querying || lookup_key) {
+		// As with grep, finding nothing is a failure
+		fflush(stdout);
+		fprintf(stderr, "%u matches in %u of %u files\n", (unsigned)query_matches, (unsigned)matched_files, (unsigned)files.size());
+		return (failed_files > 0 || query_matches == 0) ? 1 : 0;
+	}
+	if (failed_files > 0) {
+		fprintf(stderr, "%u of %u files failed %s\n", (unsigned)failed_files, (unsigned)files.size(),
+			verify ? "verification" : build_index ? "to index" : "to patch");
+		return 1;
+	}
+
 	return 0;
 }
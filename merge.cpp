@@ -0,0 +1,422 @@
+/*
+Overlay merge of XML onto CryXmlB files
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cryxmlb.h"
+#include "cryxmlb_index.h"
+
+// An overlay element pairs with an element of the same name under the
+// element its parent paired with: by the value of its first key attribute
+// when it has one, or else by position among the elements of that name
+// without a key.
+// Its attributes replace or are added to the base element's, its text, if
+// it has any, replaces the base text, and its children pair in the same way.
+// Elements that pair with nothing are added after the base children.
+//
+// All overlays are folded into one tree by the same rules first, so the
+// base is read and written once whatever their number.
+struct overlay_node_t {
+	std::string name;
+	bool has_text;
+	std::string text;
+	std::vector<std::pair<std::string, std::string> > attributes;
+	int key;               // Index of its key attribute, or -1
+	std::string key_value;
+	std::vector<uint32_t> children; // In overlay_t::nodes
+
+	// For pairing with base elements, filled in by index_overlay: positions in
+	// children by key hash, and by name in order for those without a key
+	std::vector<std::pair<uint64_t, uint32_t> > keyed;
+	std::vector<std::pair<std::string, std::vector<uint32_t> > > unkeyed;
+};
+
+struct overlay_t {
+	std::vector<overlay_node_t> nodes; // 0 is the root
+	const std::vector<std::string>* key_attributes;
+};
+
+// The first key attribute an overlay element has, in the order given
+static int overlay_key(const overlay_t* overlay, const tinyxml2::XMLElement* element, const char** value) {
+	const std::vector<std::string>& keys = *overlay->key_attributes;
+	for (size_t k = 0; k < keys.size(); k++) {
+		const char* found = element->Attribute(keys[k].c_str());
+		if (found) {
+			*value = found;
+			return (int)k;
+		}
+	}
+	return -1;
+}
+
+static uint32_t add_overlay_node(overlay_t* overlay, const tinyxml2::XMLElement* element) {
+	overlay_node_t node;
+	node.name = element->Name();
+	node.has_text = false;
+	const char* value = "";
+	node.key = overlay_key(overlay, element, &value);
+	node.key_value = value;
+	overlay->nodes.push_back(node);
+	return (uint32_t)overlay->nodes.size() - 1;
+}
+
+// Folds an overlay element into the node it paired with
+static void fold_overlay(overlay_t* overlay, uint32_t index, const tinyxml2::XMLElement* element) {
+	for (const tinyxml2::XMLAttribute* attr = element->FirstAttribute(); attr; attr = attr->Next()) {
+		std::vector<std::pair<std::string, std::string> >& attributes = overlay->nodes[index].attributes;
+		size_t i = 0;
+		while (i < attributes.size() && attributes[i].first != attr->Name()) {
+			i++;
+		}
+		if (i == attributes.size()) {
+			attributes.push_back(std::make_pair(std::string(attr->Name()), std::string()));
+		}
+		attributes[i].second = attr->Value();
+	}
+	if (element->GetText()) {
+		overlay->nodes[index].has_text = true;
+		overlay->nodes[index].text = element->GetText();
+	}
+
+	for (const tinyxml2::XMLElement* child = element->FirstChildElement(); child; child = child->NextSiblingElement()) {
+		const char* value = "";
+		int key = overlay_key(overlay, child, &value);
+		// Without a key, the n-th of its name pairs with the n-th
+		size_t position = 0;
+		if (key < 0) {
+			for (const tinyxml2::XMLElement* before = element->FirstChildElement(child->Name()); before != child;
+				before = before->NextSiblingElement(child->Name())) {
+				position += overlay_key(overlay, before, &value) < 0;
+			}
+		}
+		uint32_t paired = UINT32_MAX;
+		for (uint32_t existing : overlay->nodes[index].children) {
+			const overlay_node_t& node = overlay->nodes[existing];
+			if (node.name != child->Name() || node.key != key) {
+				continue;
+			}
+			if (key >= 0 ? node.key_value == value : position-- == 0) {
+				paired = existing;
+				break;
+			}
+		}
+		if (paired == UINT32_MAX) {
+			paired = add_overlay_node(overlay, child);
+			overlay->nodes[index].children.push_back(paired);
+		}
+		fold_overlay(overlay, paired, child);
+	}
+}
+
+// Sorts the children of every node for pairing with base elements
+static void index_overlay(overlay_t* overlay) {
+	for (overlay_node_t& node : overlay->nodes) {
+		for (uint32_t position = 0; position < node.children.size(); position++) {
+			const overlay_node_t& child_node = overlay->nodes[node.children[position]];
+			if (child_node.key >= 0) {
+				uint64_t hash = cryxmlb_index_key_hash(child_node.name, (*overlay->key_attributes)[child_node.key], child_node.key_value);
+				node.keyed.push_back(std::make_pair(hash, position));
+				continue;
+			}
+			size_t i = 0;
+			while (i < node.unkeyed.size() && node.unkeyed[i].first != child_node.name) {
+				i++;
+			}
+			if (i == node.unkeyed.size()) {
+				node.unkeyed.push_back(std::make_pair(child_node.name, std::vector<uint32_t>()));
+			}
+			node.unkeyed[i].second.push_back(position);
+		}
+		// Stable, so equal keys stay in document order
+		std::stable_sort(node.keyed.begin(), node.keyed.end(),
+			[](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) { return a.first < b.first; });
+	}
+}
+
+// A base element being written, with the overlay node it paired with
+struct merge_frame_t {
+	cryxmlb_element_t element;
+	uint32_t next;                // Next child to write
+	uint32_t overlay;             // UINT32_MAX for none
+	std::vector<bool> paired;     // Per overlay child
+	std::vector<uint32_t> seen;   // Base children without a key so far, per unkeyed name
+};
+
+// The state of one merge: the base, the folded overlays and the writer
+struct merge_state_t {
+	const cryxmlb_reader_t* reader;
+	const overlay_t* overlay;
+	cryxmlb_writer_t* writer;
+	int32_t base;     // Where the base data table starts in the new one
+	uint32_t changed; // Base elements an overlay element paired with
+	uint32_t added;
+};
+
+// The overlay child a base child pairs with, or UINT32_MAX
+static uint32_t pair_child(merge_frame_t* frame, const overlay_t* overlay, const cryxmlb_element_t& child) {
+	const overlay_node_t& node = overlay->nodes[frame->overlay];
+	std::string_view name = child.name();
+	bool has_key = false;
+	for (const std::string& key : *overlay->key_attributes) {
+		if (!child.has_attribute(key)) {
+			continue;
+		}
+		has_key = true;
+		if (node.keyed.empty()) {
+			break;
+		}
+		std::string_view value = child.attribute(key);
+		uint64_t hash = cryxmlb_index_key_hash(name, key, value);
+		std::vector<std::pair<uint64_t, uint32_t> >::const_iterator it = std::lower_bound(node.keyed.begin(), node.keyed.end(),
+			std::make_pair(hash, (uint32_t)0), [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) { return a.first < b.first; });
+		for (; it != node.keyed.end() && it->first == hash; ++it) {
+			const overlay_node_t& candidate = overlay->nodes[node.children[it->second]];
+			if (!frame->paired[it->second] && candidate.name == name && (*overlay->key_attributes)[candidate.key] == key
+				&& candidate.key_value == value) {
+				frame->paired[it->second] = true;
+				return node.children[it->second];
+			}
+		}
+	}
+	// Elements without a key pair by position among those of their name
+	for (size_t i = 0; !has_key && i < node.unkeyed.size(); i++) {
+		if (node.unkeyed[i].first != name) {
+			continue;
+		}
+		uint32_t nth = frame->seen[i]++;
+		if (nth < node.unkeyed[i].second.size()) {
+			uint32_t position = node.unkeyed[i].second[nth];
+			frame->paired[position] = true;
+			return node.children[position];
+		}
+	}
+	return UINT32_MAX;
+}
+
+// Writes an overlay element that paired with nothing, with its children
+static void write_overlay_node(merge_state_t* state, uint32_t index) {
+	const overlay_node_t& node = state->overlay->nodes[index];
+	cryxmlb_writer_t* writer = state->writer;
+	writer->begin_element(node.name.c_str());
+	writer->text(node.text.c_str());
+	for (const std::pair<std::string, std::string>& attr : node.attributes) {
+		writer->attribute(attr.first.c_str(), attr.second.c_str());
+	}
+	for (uint32_t child : node.children) {
+		write_overlay_node(state, child);
+	}
+	writer->end_element();
+	state->added++;
+}
+
+// Writes a base element's name, text and attributes, with the overlay's
+// changes when one paired with it. Base strings are referred to where they
+// are; only the overlay's are added.
+static void write_base_head(merge_state_t* state, const cryxmlb_element_t& element, uint32_t overlay_index) {
+	cryxmlb_writer_t* writer = state->writer;
+	const overlay_node_t* node = overlay_index != UINT32_MAX ? &state->overlay->nodes[overlay_index] : 0;
+	writer->begin_element_at(state->base + (int32_t)element.name_offset());
+	if (node && node->has_text) {
+		writer->text(node->text.c_str());
+	}
+	else {
+		writer->text_at(state->base + (int32_t)element.content_offset());
+	}
+	if (!node) {
+		for (cryxmlb_attribute_t attr : element.attributes()) {
+			writer->attribute_at(state->base + (int32_t)attr.name_offset(), state->base + (int32_t)attr.value_offset());
+		}
+		return;
+	}
+	state->changed += node->has_text || !node->attributes.empty();
+	std::vector<bool> replaced(node->attributes.size(), false);
+	for (cryxmlb_attribute_t attr : element.attributes()) {
+		size_t i = 0;
+		while (i < node->attributes.size() && node->attributes[i].first != attr.name()) {
+			i++;
+		}
+		if (i < node->attributes.size()) {
+			replaced[i] = true;
+			writer->attribute_at(state->base + (int32_t)attr.name_offset(), writer->add_string(node->attributes[i].second.c_str()));
+		}
+		else {
+			writer->attribute_at(state->base + (int32_t)attr.name_offset(), state->base + (int32_t)attr.value_offset());
+		}
+	}
+	for (size_t i = 0; i < node->attributes.size(); i++) {
+		if (!replaced[i]) {
+			writer->attribute(node->attributes[i].first.c_str(), node->attributes[i].second.c_str());
+		}
+	}
+}
+
+static merge_frame_t merge_frame(const overlay_t* overlay, const cryxmlb_element_t& element, uint32_t overlay_index) {
+	merge_frame_t frame;
+	frame.element = element;
+	frame.next = 0;
+	frame.overlay = overlay_index;
+	if (overlay_index != UINT32_MAX) {
+		frame.paired.assign(overlay->nodes[overlay_index].children.size(), false);
+		frame.seen.assign(overlay->nodes[overlay_index].unkeyed.size(), 0);
+	}
+	return frame;
+}
+
+// Writes the base tree in preorder, one element at a time, merging the
+// overlay where it pairs. Fails, with the writer's error set or a message,
+// on a base whose child table is not a tree.
+static bool write_merged_tree(merge_state_t* state, const char* base_name) {
+	const cryxmlb_reader_t& reader = *state->reader;
+	cryxmlb_writer_t* writer = state->writer;
+	std::vector<bool> reached(reader.node_count, false);
+	std::vector<merge_frame_t> stack;
+	reached[0] = true;
+	write_base_head(state, reader.root(), 0);
+	stack.push_back(merge_frame(state->overlay, reader.root(), 0));
+	while (!stack.empty() && !writer->error()) {
+		merge_frame_t& frame = stack.back();
+		cryxmlb_range_t<cryxmlb_element_t> children = frame.element.children();
+		if (frame.next == children.size()) {
+			// Overlay elements that paired with nothing go last
+			if (frame.overlay != UINT32_MAX) {
+				const overlay_node_t& node = state->overlay->nodes[frame.overlay];
+				for (size_t i = 0; i < node.children.size(); i++) {
+					if (!frame.paired[i]) {
+						write_overlay_node(state, node.children[i]);
+					}
+				}
+			}
+			writer->end_element();
+			stack.pop_back();
+			continue;
+		}
+		uint32_t index = cryxmlb_load32(reader.child_table + (size_t)(children.first + frame.next) * 4);
+		frame.next++;
+		if (index >= reader.node_count || reached[index]) {
+			fprintf(stderr, "File %s is damaged: node %u is not a tree\n", base_name, frame.element.index);
+			return false;
+		}
+		reached[index] = true;
+		cryxmlb_element_t child = reader.element(index);
+		uint32_t overlay_index = frame.overlay != UINT32_MAX ? pair_child(&frame, state->overlay, child) : UINT32_MAX;
+		write_base_head(state, child, overlay_index);
+		stack.push_back(merge_frame(state->overlay, child, overlay_index));
+	}
+	return true;
+}
+
+// Merges XML overlays onto a CryXmlB file and writes the result to
+// output_name, or over the base after copying it to base_name.bak.
+// Elements are paired by the key attributes given.
+bool merge_cryxmlb_file(const char* base_name, const char* const* overlay_names, size_t overlay_count,
+	const char* output_name, const std::vector<std::string>& key_attributes) {
+	mapped_file_t file = map_file(base_name, false);
+	if (!file.data) {
+		return false;
+	}
+	cryxmlb_reader_t reader;
+	if (!reader.open(file.data, (size_t)file.size) || reader.node_count == 0 || reader.data_size == 0) {
+		fprintf(stderr, "File %s is not in CryXmlB format\n", base_name);
+		unmap_file(&file);
+		return false;
+	}
+
+	// The overlays, folded in order into one tree under the base's root
+	overlay_t overlay;
+	overlay.key_attributes = &key_attributes;
+	overlay_node_t root;
+	root.name = std::string(reader.root().name());
+	root.has_text = false;
+	root.key = -1;
+	overlay.nodes.push_back(root);
+	for (size_t i = 0; i < overlay_count; i++) {
+		read_file_result_t xml_file = read_file(overlay_names[i]);
+		if (!xml_file.data) {
+			unmap_file(&file);
+			return false;
+		}
+		tinyxml2::XMLDocument doc;
+		tinyxml2::XMLError error = doc.Parse((const char*)xml_file.data, xml_file.size);
+		free(xml_file.data);
+		if (error != tinyxml2::XML_SUCCESS || !doc.RootElement()) {
+			fprintf(stderr, "Error parsing XML file %s: %s\n", overlay_names[i], error != tinyxml2::XML_SUCCESS ? doc.ErrorStr() : "no root element");
+			unmap_file(&file);
+			return false;
+		}
+		if (root.name != doc.RootElement()->Name()) {
+			fprintf(stderr, "Overlay %s has root <%s>, not <%s> as %s\n", overlay_names[i], doc.RootElement()->Name(), root.name.c_str(), base_name);
+			unmap_file(&file);
+			return false;
+		}
+		fold_overlay(&overlay, 0, doc.RootElement());
+	}
+	index_overlay(&overlay);
+
+	// The base strings are taken over as they are, so only the overlays'
+	// are added, each once
+	cryxmlb_writer_t writer(true);
+	merge_state_t state;
+	state.reader = &reader;
+	state.overlay = &overlay;
+	state.writer = &writer;
+	state.base = writer.add_strings(reader.data_table, reader.data_size);
+	state.changed = 0;
+	state.added = 0;
+	bool merged = write_merged_tree(&state, base_name);
+	if (merged && !writer.finish()) {
+		fprintf(stderr, "Error merging into %s: %s\n", base_name, writer.error());
+		merged = false;
+	}
+	if (!merged) {
+		unmap_file(&file);
+		return false;
+	}
+	output_buffer_t output;
+	writer.serialize(output);
+
+	if (!output_name) {
+		std::string backup_name = std::string(base_name) + ".bak";
+		if (!copy_file(backup_name.c_str(), &file, base_name)) {
+			fprintf(stderr, "Error creating backup file %s\n", backup_name.c_str());
+			unmap_file(&file);
+			return false;
+		}
+		output_name = base_name;
+	}
+	unmap_file(&file);
+	if (!write_file(output_name, output.data(), output.size())) {
+		return false;
+	}
+	fprintf(stdout, "Merged %zu overlays into %s: %u elements changed, %u added\n", overlay_count, output_name, state.changed, state.added);
+	return true;
+}
@@ -0,0 +1,218 @@
+/*
+In-place CryXmlB patching
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "cryxmlb.h"
+#include "cryxmlb_reader.h"
+
+// Offsets of the header fields a patch changes
+static const uint64_t HEADER_FILE_SIZE_OFFSET = 8;
+static const uint64_t HEADER_DATA_SIZE_OFFSET = 8 + 8 * sizeof(uint32_t);
+
+// Parses path/@attribute=value or path=value, where path is a query path
+// (see cryxmlb_query_t). The value is everything after the first '='
+// outside brackets.
+bool parse_assignment(const char* spec, cryxmlb_assignment_t* assignment) {
+	assignment->spec = spec;
+	const char* p = spec;
+	int depth = 0;
+	char quote = 0;
+	for (; *p && (depth > 0 || *p != '='); p++) {
+		if (quote) {
+			quote = (*p == quote) ? 0 : quote;
+		}
+		else if (depth > 0 && (*p == '\'' || *p == '"')) {
+			quote = *p;
+		}
+		else {
+			depth += (*p == '[') - (*p == ']');
+		}
+	}
+	if (*p != '=') {
+		return false;
+	}
+	std::string error;
+	assignment->value = p + 1;
+	return compile_query(std::string(spec, p).c_str(), &assignment->path, &error);
+}
+
+// Works out what the assignments change in a CryXmlB file: the offsets to
+// point at new strings, and the strings to append to the data table, which
+// must end the file as the encoder writes it. Every path is matched
+// against the file as it is, before any assignment, and only the tables on
+// the way to the selected elements are read. Values that are already set
+// are left alone, and so are selected elements without the attribute.
+// Returns false, with a message, if the file cannot be patched or an
+// assignment changes nothing it selects.
+bool plan_cryxmlb_patch(const unsigned char* data, uint64_t size, const cryxmlb_assignment_t* assignments, size_t count,
+	cryxmlb_patch_t* patch, char* message, size_t message_size) {
+	patch->edits.clear();
+	patch->strings.clear();
+	patch->elements = 0;
+
+	cryxmlb_reader_t reader;
+	if (!reader.open(data, (size_t)size)) {
+		snprintf(message, message_size, "not a CryXmlB file");
+		return false;
+	}
+	if ((const unsigned char*)reader.data_table + reader.data_size != data + size) {
+		snprintf(message, message_size, "the data table is not at the end of the file");
+		return false;
+	}
+
+	query_state_t state;
+	std::vector<uint32_t> selected;
+	for (size_t a = 0; a < count; a++) {
+		const cryxmlb_assignment_t& assignment = assignments[a];
+		const cryxmlb_query_t& path = assignment.path;
+		query_begin_file(&path, &reader, &state);
+		run_query(&path, &reader, &state, &selected);
+		if (selected.empty()) {
+			snprintf(message, message_size, "%s: no element matches", assignment.spec.c_str());
+			return false;
+		}
+
+		// Every selected element points at one copy of the value
+		uint64_t value_offset = reader.data_size + patch->strings.size();
+		bool value_used = false;
+		bool found = false;
+		for (uint32_t index : selected) {
+			cryxmlb_element_t element = reader.element(index);
+			const unsigned char* field = reader.node(index) + 4; // content_offset
+			std::string_view current = element.content();
+			if (!path.attribute.empty()) {
+				field = 0;
+				for (cryxmlb_attribute_t attr : element.attributes()) {
+					if (attr.name() == path.attribute) {
+						field = reader.attr_table + (size_t)attr.index * 8 + 4; // value_offset
+						current = attr.value();
+						break;
+					}
+				}
+				if (!field) {
+					continue; // Attributes are only changed, not added
+				}
+			}
+			patch->elements++;
+			found = true;
+			if (current == assignment.value) {
+				continue;
+			}
+			cryxmlb_patch_edit_t edit = { (uint64_t)(field - data), (uint32_t)value_offset };
+			patch->edits.push_back(edit);
+			value_used = true;
+		}
+		if (!found) {
+			snprintf(message, message_size, "%s: no selected element has the attribute", assignment.spec.c_str());
+			return false;
+		}
+		if (value_used) {
+			patch->strings.insert(patch->strings.end(), assignment.value.c_str(), assignment.value.c_str() + assignment.value.size() + 1);
+		}
+	}
+
+	patch->file_size = size + patch->strings.size();
+	patch->data_size = reader.data_size + patch->strings.size();
+	if (patch->file_size > UINT32_MAX || patch->data_size > INT32_MAX) {
+		snprintf(message, message_size, "the patched file is too large for CryXmlB");
+		return false;
+	}
+	return true;
+}
+
+// Applies a patch to a copy of the file that already has the strings
+// appended
+void apply_cryxmlb_patch(unsigned char* data, const cryxmlb_patch_t* patch) {
+	cryxmlb_store32(data + HEADER_FILE_SIZE_OFFSET, (uint32_t)patch->file_size);
+	cryxmlb_store32(data + HEADER_DATA_SIZE_OFFSET, (uint32_t)patch->data_size);
+	for (const cryxmlb_patch_edit_t& edit : patch->edits) {
+		cryxmlb_store32(data + edit.offset, edit.value);
+	}
+}
+
+// Writes a 32-bit field of the file in place
+static bool write_field(FILE* file, uint64_t offset, uint32_t value) {
+	unsigned char bytes[4];
+	cryxmlb_store32(bytes, value);
+	return seek_file(file, offset) == 0 && fwrite(bytes, 1, 4, file) == 4;
+}
+
+// Patches a CryXmlB file where it is, after copying it to filename.bak.
+// Nothing else is read or rewritten: the strings go on the end, then the
+// header sizes and the changed offsets are overwritten. Until the offsets
+// are, the file reads as before with some unused strings at the end.
+bool patch_cryxmlb_file(const char* filename, const cryxmlb_assignment_t* assignments, size_t count) {
+	mapped_file_t file = map_file(filename, false);
+	if (!file.data) {
+		return false;
+	}
+	cryxmlb_patch_t patch;
+	char message[512];
+	if (!plan_cryxmlb_patch(file.data, file.size, assignments, count, &patch, message, sizeof(message))) {
+		fprintf(stderr, "Error patching file %s: %s\n", filename, message);
+		unmap_file(&file);
+		return false;
+	}
+	if (patch.edits.empty()) {
+		fprintf(stdout, "File %s already has the values (%zu elements)\n", filename, patch.elements);
+		unmap_file(&file);
+		return true;
+	}
+
+	std::string backup_name = std::string(filename) + ".bak";
+	bool backed_up = copy_file(backup_name.c_str(), &file, filename);
+	uint64_t old_size = file.size;
+	unmap_file(&file);
+	if (!backed_up) {
+		fprintf(stderr, "Error creating backup file %s\n", backup_name.c_str());
+		return false;
+	}
+
+	FILE* out = fopen(filename, "r+b");
+	if (!out) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return false;
+	}
+	bool written = seek_file(out, old_size) == 0 && fwrite(patch.strings.data(), 1, patch.strings.size(), out) == patch.strings.size()
+		&& fflush(out) == 0
+		&& write_field(out, HEADER_FILE_SIZE_OFFSET, (uint32_t)patch.file_size)
+		&& write_field(out, HEADER_DATA_SIZE_OFFSET, (uint32_t)patch.data_size);
+	for (size_t i = 0; written && i < patch.edits.size(); i++) {
+		written = write_field(out, patch.edits[i].offset, patch.edits[i].value);
+	}
+	if (fclose(out) != 0 || !written) {
+		fprintf(stderr, "Error writing file %s; the original is in %s\n", filename, backup_name.c_str());
+		return false;
+	}
+	fprintf(stdout, "Patched %zu values in %s\n", patch.edits.size(), filename);
+	return true;
+}
@@ -0,0 +1,472 @@
+/*
+Path queries over CryXmlB files
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "cryxmlb.h"
+#include "cryxmlb_reader.h"
+
+// Cached results per string test; a power of two
+static const size_t QUERY_CACHE_ENTRIES = 1024;
+static const int QUERY_CACHE_BITS = 10;
+
+static bool query_error(std::string* error, const char* text, const char* p, const char* what) {
+	char message[128];
+	snprintf(message, sizeof(message), "%s at column %d", what, (int)(p - text) + 1);
+	*error = message;
+	return false;
+}
+
+// Names run up to the next character the syntax uses
+static std::string parse_name(const char*& p) {
+	const char* begin = p;
+	while (*p && !strchr("/[]@=^~'\"*", *p)) {
+		p++;
+	}
+	return std::string(begin, p);
+}
+
+// Returns the index of the test, sharing it with an identical one
+static int add_test(cryxmlb_query_t* query, query_op_t op, const std::string& literal) {
+	for (size_t i = 0; i < query->tests.size(); i++) {
+		if (query->tests[i].op == op && query->tests[i].literal == literal) {
+			return (int)i;
+		}
+	}
+	query_string_test_t test;
+	test.op = op;
+	test.literal = literal;
+	if (op == QUERY_REGEX) {
+		test.regex = std::regex(literal, std::regex::ECMAScript | std::regex::optimize);
+	}
+	query->tests.push_back(test);
+	return (int)query->tests.size() - 1;
+}
+
+// Parses a query path, described with cryxmlb_query_t. Returns false with
+// error set if it is not one.
+bool compile_query(const char* text, cryxmlb_query_t* query, std::string* error) {
+	query->steps.clear();
+	query->attribute.clear();
+	query->attribute_test = -1;
+	query->tests.clear();
+
+	const char* p = text;
+	bool descendant = false;
+	if (p[0] == '/' && p[1] == '/') {
+		descendant = true;
+		p += 2;
+	}
+	else if (p[0] == '/') {
+		p++;
+	}
+	for (;;) {
+		if (*p == '@') {
+			p++;
+			query->attribute = parse_name(p);
+			if (query->steps.empty() || descendant || query->attribute.empty() || *p) {
+				return query_error(error, text, p, "expected an element step before @ and nothing after its name");
+			}
+			query->attribute_test = add_test(query, QUERY_EQUALS, query->attribute);
+			return true;
+		}
+
+		query_step_t step;
+		step.descendant = descendant;
+		step.name_test = -1;
+		if (*p == '*') {
+			p++;
+		}
+		else {
+			std::string name = parse_name(p);
+			if (name.empty()) {
+				return query_error(error, text, p, "expected an element name or *");
+			}
+			step.name_test = add_test(query, QUERY_EQUALS, name);
+		}
+		while (*p == '[') {
+			p++;
+			if (*p++ != '@') {
+				return query_error(error, text, p - 1, "expected [@attribute");
+			}
+			std::string name = parse_name(p);
+			if (name.empty()) {
+				return query_error(error, text, p, "expected an attribute name");
+			}
+			query_predicate_t predicate = { add_test(query, QUERY_EQUALS, name), -1 };
+			if (*p != ']') {
+				query_op_t op = QUERY_EQUALS;
+				if (p[0] == '=' && p[1] == '~') {
+					op = QUERY_REGEX;
+					p += 2;
+				}
+				else if (p[0] == '^' && p[1] == '=') {
+					op = QUERY_PREFIX;
+					p += 2;
+				}
+				else if (p[0] == '=') {
+					p++;
+				}
+				else {
+					return query_error(error, text, p, "expected =, ^= or =~");
+				}
+				std::string literal;
+				if (*p == '\'' || *p == '"') {
+					const char* end = strchr(p + 1, *p);
+					if (!end) {
+						return query_error(error, text, p, "unterminated quote");
+					}
+					literal.assign(p + 1, end);
+					p = end + 1;
+				}
+				else {
+					const char* end = strchr(p, ']');
+					literal.assign(p, end ? end : p + strlen(p));
+					p += literal.size();
+				}
+				try {
+					predicate.value_test = add_test(query, op, literal);
+				}
+				catch (const std::regex_error& e) {
+					return query_error(error, text, p, e.what());
+				}
+			}
+			if (*p++ != ']') {
+				return query_error(error, text, p - 1, "expected ]");
+			}
+			step.predicates.push_back(predicate);
+		}
+		query->steps.push_back(step);
+
+		if (!*p) {
+			return true;
+		}
+		if (*p != '/') {
+			return query_error(error, text, p, "expected / between steps");
+		}
+		p++;
+		descendant = false;
+		if (*p == '/') {
+			descendant = true;
+			p++;
+		}
+	}
+}
+
+// Resets the cached test results for another file
+void query_begin_file(const cryxmlb_query_t* query, const cryxmlb_reader_t* reader, query_state_t* state) {
+	(void)reader;
+	query_cache_entry_t empty = { UINT32_MAX, false };
+	state->cache.assign(query->tests.size() * QUERY_CACHE_ENTRIES, empty);
+	state->visited.clear();
+	state->stamp = 0;
+}
+
+// The result of a string test for the string at offset, computed once per
+// offset while it stays in the test's cache
+static bool test_string(const cryxmlb_query_t* query, const cryxmlb_reader_t* reader, query_state_t* state, int test, uint32_t offset) {
+	if (offset >= reader->data_size) {
+		return false;
+	}
+	query_cache_entry_t& entry = state->cache[test * QUERY_CACHE_ENTRIES + ((uint32_t)(offset * 2654435761u) >> (32 - QUERY_CACHE_BITS))];
+	if (entry.offset == offset) {
+		return entry.result;
+	}
+	const query_string_test_t& string_test = query->tests[test];
+	std::string_view value = reader->string(offset);
+	bool result;
+	switch (string_test.op) {
+	case QUERY_PREFIX:
+		result = value.compare(0, string_test.literal.size(), string_test.literal) == 0;
+		break;
+	case QUERY_REGEX:
+		result = std::regex_search(value.begin(), value.end(), string_test.regex);
+		break;
+	default:
+		result = value == string_test.literal;
+		break;
+	}
+	entry.offset = offset;
+	entry.result = result;
+	return result;
+}
+
+static bool step_matches(const cryxmlb_query_t* query, const cryxmlb_reader_t* reader, query_state_t* state,
+	const query_step_t& step, cryxmlb_element_t element) {
+	if (!element || (step.name_test >= 0 && !test_string(query, reader, state, step.name_test, element.name_offset()))) {
+		return false;
+	}
+	for (const query_predicate_t& predicate : step.predicates) {
+		bool found = false;
+		for (cryxmlb_attribute_t attr : element.attributes()) {
+			if (test_string(query, reader, state, predicate.name_test, attr.name_offset())
+				&& (predicate.value_test < 0 || test_string(query, reader, state, predicate.value_test, attr.value_offset()))) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Adds the nodes below start (and start itself with include_start) that
+// match the step. Nodes another walk of the same step reached are not
+// walked again, which also stops at cycles in a damaged child table.
+static void walk_descendants(const cryxmlb_query_t* query, const cryxmlb_reader_t* reader, query_state_t* state,
+	const query_step_t& step, cryxmlb_element_t start, bool include_start) {
+	std::vector<uint32_t>& stack = state->stack;
+	stack.clear();
+	if (include_start) {
+		stack.push_back(start.index);
+	}
+	else {
+		for (cryxmlb_element_t child : start.children()) {
+			if (child) {
+				stack.push_back(child.index);
+			}
+		}
+	}
+	while (!stack.empty()) {
+		uint32_t index = stack.back();
+		stack.pop_back();
+		if (state->visited[index] == state->stamp) {
+			continue;
+		}
+		state->visited[index] = state->stamp;
+		cryxmlb_element_t element = reader->element(index);
+		if (step_matches(query, reader, state, step, element)) {
+			state->next.push_back(index);
+		}
+		for (cryxmlb_element_t child : element.children()) {
+			if (child) {
+				stack.push_back(child.index);
+			}
+		}
+	}
+}
+
+// Evaluates the query's element steps from the root; nodes gets the
+// indices of the selected elements in node order. The tables are only read
+// along the way, so a path of child steps touches few of them.
+void run_query(const cryxmlb_query_t* query, const cryxmlb_reader_t* reader, query_state_t* state, std::vector<uint32_t>* nodes) {
+	nodes->clear();
+	if (reader->node_count == 0) {
+		return;
+	}
+	bool from_root = true;
+	for (const query_step_t& step : query->steps) {
+		state->next.clear();
+		if (step.descendant) {
+			if (state->visited.size() != reader->node_count) {
+				state->visited.assign(reader->node_count, 0);
+			}
+			if (++state->stamp == 0) {
+				std::fill(state->visited.begin(), state->visited.end(), 0);
+				state->stamp = 1;
+			}
+		}
+		if (from_root) {
+			if (step.descendant) {
+				walk_descendants(query, reader, state, step, reader->root(), true);
+			}
+			else if (step_matches(query, reader, state, step, reader->root())) {
+				state->next.push_back(0);
+			}
+		}
+		else {
+			for (uint32_t index : *nodes) {
+				cryxmlb_element_t element = reader->element(index);
+				if (step.descendant) {
+					walk_descendants(query, reader, state, step, element, false);
+					continue;
+				}
+				for (cryxmlb_element_t child : element.children()) {
+					if (step_matches(query, reader, state, step, child)) {
+						state->next.push_back(child.index);
+					}
+				}
+			}
+		}
+		// Contexts can nest, so neither order nor uniqueness is given
+		std::sort(state->next.begin(), state->next.end());
+		state->next.erase(std::unique(state->next.begin(), state->next.end()), state->next.end());
+		nodes->swap(state->next);
+		from_root = false;
+		if (nodes->empty()) {
+			break;
+		}
+	}
+}
+
+static void append_escaped(std::string* output, std::string_view text) {
+	for (char c : text) {
+		switch (c) {
+		case '&': *output += "&amp;"; break;
+		case '<': *output += "&lt;"; break;
+		case '"': *output += "&quot;"; break;
+		case '\n': *output += "&#10;"; break;
+		case '\r': *output += "&#13;"; break;
+		default: *output += c; break;
+		}
+	}
+}
+
+// Appends filename:node: and the element's start tag on a line of its own
+void append_element_line(std::string* output, const char* filename, const cryxmlb_element_t& element) {
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), ":%u: <", element.index);
+	*output += filename;
+	*output += prefix;
+	output->append(element.name());
+	for (cryxmlb_attribute_t attr : element.attributes()) {
+		*output += ' ';
+		output->append(attr.name());
+		*output += "=\"";
+		append_escaped(output, attr.value());
+		*output += '"';
+	}
+	*output += element.children().empty() ? "/>\n" : ">\n";
+}
+
+// Appends a line per match to output: filename:node: and the element's
+// start tag, or the attribute's value as it is. Files that are not
+// CryXmlB are skipped. Returns false if the file could not be read.
+bool query_file(const char* filename, const cryxmlb_query_t* query, query_state_t* state, std::string* output, size_t* matches) {
+	*matches = 0;
+	mapped_file_t file = map_file(filename, false);
+	if (!file.data) {
+		return false;
+	}
+	cryxmlb_reader_t reader;
+	if (!reader.open(file.data, (size_t)file.size)) {
+		unmap_file(&file);
+		return true;
+	}
+	query_begin_file(query, &reader, state);
+	std::vector<uint32_t> nodes;
+	run_query(query, &reader, state, &nodes);
+
+	char prefix[32];
+	for (uint32_t index : nodes) {
+		cryxmlb_element_t element = reader.element(index);
+		snprintf(prefix, sizeof(prefix), ":%u: ", index);
+		if (query->attribute_test >= 0) {
+			for (cryxmlb_attribute_t attr : element.attributes()) {
+				if (test_string(query, &reader, state, query->attribute_test, attr.name_offset())) {
+					*output += filename;
+					*output += prefix;
+					output->append(attr.value());
+					*output += '\n';
+					(*matches)++;
+				}
+			}
+			continue;
+		}
+		append_element_line(output, filename, element);
+		(*matches)++;
+	}
+	unmap_file(&file);
+	return true;
+}
+
+// Adds path, or the files under it when it is a directory, in name order.
+// Links to directories are not followed.
+void list_files(const char* path, std::vector<std::string>* files) {
+	std::vector<std::string> entries;
+#if defined(_WIN32)
+	DWORD attributes = GetFileAttributesA(path);
+	if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		files->push_back(path);
+		return;
+	}
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA((std::string(path) + "\\*").c_str(), &found);
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		if (strcmp(found.cFileName, ".") != 0 && strcmp(found.cFileName, "..") != 0
+			&& !(found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+			entries.push_back(found.cFileName);
+		}
+	} while (FindNextFileA(find, &found));
+	FindClose(find);
+	const char separator = '\\';
+#else
+	struct stat info;
+	if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+		files->push_back(path);
+		return;
+	}
+	DIR* dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Error opening directory %s\n", path);
+		return;
+	}
+	while (struct dirent* entry = readdir(dir)) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+			entries.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+	const char separator = '/';
+#endif
+	std::sort(entries.begin(), entries.end());
+	std::string prefix = path;
+	if (!prefix.empty() && prefix.back() != '/' && prefix.back() != separator) {
+		prefix += separator;
+	}
+	for (const std::string& name : entries) {
+		std::string child = prefix + name;
+#if !defined(_WIN32)
+		struct stat link_info;
+		if (lstat(child.c_str(), &link_info) != 0 || S_ISLNK(link_info.st_mode)) {
+			if (stat(child.c_str(), &link_info) != 0 || !S_ISREG(link_info.st_mode)) {
+				continue;
+			}
+		}
+		else if (!S_ISDIR(link_info.st_mode) && !S_ISREG(link_info.st_mode)) {
+			continue;
+		}
+#endif
+		list_files(child.c_str(), files);
+	}
+}
@@ -0,0 +1,377 @@
+/*
+Conversion statistics for --stats and trace events for --trace
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#endif
+
+#include "cryxmlb.h"
+
+static const char* const stats_phase_names[STATS_PHASE_COUNT] = {
+	"read", "parse", "encode", "serialize", "write"
+};
+
+// Seconds on a monotonic clock, for timing phases
+double stats_now() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds the time since start to a phase and records it in the trace.
+// Returns the end time so the next phase can start from it.
+double stats_phase_end(conversion_stats_t* stats, stats_phase_t phase, double start) {
+	double end = stats_now();
+	stats->seconds[phase] += end - start;
+	trace_event("phase", stats_phase_names[phase], stats->filename, start, end);
+	return end;
+}
+
+// Peak resident memory of the process in bytes, or 0 if unknown
+uint64_t peak_memory_bytes() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#if defined(__APPLE__)
+	return (uint64_t)usage.ru_maxrss;
+#else
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+thread_local alloc_tracker_t* alloc_tracker = 0;
+
+static const char* const alloc_kind_names[ALLOC_KIND_COUNT] = {
+	"element_pool", "attribute_pool", "text_pool", "comment_pool", "dynarray", "tables", "output"
+};
+
+void alloc_count_slow(alloc_tracker_t* tracker, alloc_kind_t kind, size_t old_bytes, size_t new_bytes) {
+	if (new_bytes) {
+		tracker->allocations[kind]++;
+		tracker->bytes[kind] += new_bytes;
+	}
+	int64_t current = tracker->current[kind] += (int64_t)new_bytes - (int64_t)old_bytes;
+	int64_t peak = tracker->peak[kind];
+	while (current > peak && !tracker->peak[kind].compare_exchange_weak(peak, current)) {
+	}
+}
+
+static void alloc_count_dynarray(size_t old_bytes, size_t new_bytes) {
+	alloc_count(ALLOC_DYNARRAY, old_bytes, new_bytes);
+}
+
+// Routes tinyxml2's DynArray growth to the trackers
+void alloc_tracking_start() {
+	tinyxml2::DynArrayResizeHook = alloc_count_dynarray;
+}
+
+static void alloc_count_pool(alloc_tracker_t* tracker, alloc_kind_t kind, const tinyxml2::MemPool& pool) {
+	tracker->allocations[kind] += pool.TotalAllocs();
+	tracker->bytes[kind] += (uint64_t)pool.BlockCount() * pool.BlockSize();
+	tracker->peak[kind] += (int64_t)pool.MaxAllocs() * pool.ItemSize();
+}
+
+// Adds what a document's node pools used. Pools only grow until the
+// document is destroyed, so call this once per document, before that.
+void alloc_count_document(const tinyxml2::XMLDocument* doc) {
+	alloc_tracker_t* tracker = alloc_tracker;
+	if (!tracker) {
+		return;
+	}
+	alloc_count_pool(tracker, ALLOC_ELEMENT_POOL, doc->ElementPool());
+	alloc_count_pool(tracker, ALLOC_ATTRIBUTE_POOL, doc->AttributePool());
+	alloc_count_pool(tracker, ALLOC_TEXT_POOL, doc->TextPool());
+	alloc_count_pool(tracker, ALLOC_COMMENT_POOL, doc->CommentPool());
+}
+
+void alloc_report(const alloc_tracker_t* tracker, conversion_stats_t* stats) {
+	stats->allocations_tracked = true;
+	for (int k = 0; k < ALLOC_KIND_COUNT; k++) {
+		stats->allocations[k].allocations = tracker->allocations[k];
+		stats->allocations[k].bytes = tracker->bytes[k];
+		stats->allocations[k].peak_bytes = (uint64_t)tracker->peak[k].load();
+	}
+}
+
+static uint64_t string_size_at(const char* data_table, uint64_t data_table_size, int32_t offset) {
+	if (offset < 0 || (uint64_t)offset >= data_table_size) {
+		return 0;
+	}
+	const char* str = data_table + offset;
+	const char* end = (const char*)memchr(str, 0, data_table_size - offset);
+	return end ? end - str + 1 : data_table_size - offset;
+}
+
+// Adds up the strings every name, content and attribute refers to. Compared
+// with the data table size this shows how much sharing of strings saves.
+uint64_t count_string_bytes(const cry_xml_node_t* node_table, uint64_t node_count,
+	const cry_xml_ref_t* attr_table, uint64_t attr_count, const char* data_table, uint64_t data_table_size) {
+	uint64_t total = 0;
+	for (uint64_t i = 0; i < node_count; i++) {
+		total += string_size_at(data_table, data_table_size, node_table[i].name_offset);
+		total += string_size_at(data_table, data_table_size, node_table[i].content_offset);
+	}
+	for (uint64_t i = 0; i < attr_count; i++) {
+		total += string_size_at(data_table, data_table_size, attr_table[i].name_offset);
+		total += string_size_at(data_table, data_table_size, attr_table[i].value_offset);
+	}
+	return total;
+}
+
+static double dedup_ratio(const conversion_stats_t* stats) {
+	return stats->data_table_size ? (double)stats->string_bytes / stats->data_table_size : 1.0;
+}
+
+static void print_stats_line(FILE* out, const char* label, const conversion_stats_t* stats) {
+	double total = 0;
+	for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+		total += stats->seconds[p];
+	}
+	fprintf(out, "%s: %llu -> %llu bytes in %.3f ms (", label,
+		(unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out, total * 1000);
+	for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+		fprintf(out, "%s%s %.3f", p ? ", " : "", stats_phase_names[p], stats->seconds[p] * 1000);
+	}
+	fprintf(out, ")\n");
+	fprintf(out, "  %llu nodes, %llu attributes, %llu children, data table %llu bytes, dedup ratio %.2f, peak memory %.1f MB\n",
+		(unsigned long long)stats->nodes, (unsigned long long)stats->attributes, (unsigned long long)stats->children,
+		(unsigned long long)stats->data_table_size, dedup_ratio(stats), stats->peak_memory / (1024.0 * 1024));
+	if (stats->allocations_tracked) {
+		for (int k = 0; k < ALLOC_KIND_COUNT; k++) {
+			const alloc_usage_t& usage = stats->allocations[k];
+			fprintf(out, "  %-14s %10llu allocations, %10.1f KB allocated, %10.1f KB peak\n", alloc_kind_names[k],
+				(unsigned long long)usage.allocations, usage.bytes / 1024.0, usage.peak_bytes / 1024.0);
+		}
+	}
+}
+
+static conversion_stats_t sum_stats(const conversion_stats_t* stats, size_t count) {
+	conversion_stats_t total = {};
+	for (size_t i = 0; i < count; i++) {
+		if (!stats[i].converted) {
+			continue;
+		}
+		total.bytes_in += stats[i].bytes_in;
+		total.bytes_out += stats[i].bytes_out;
+		for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+			total.seconds[p] += stats[i].seconds[p];
+		}
+		total.nodes += stats[i].nodes;
+		total.attributes += stats[i].attributes;
+		total.children += stats[i].children;
+		total.data_table_size += stats[i].data_table_size;
+		total.string_bytes += stats[i].string_bytes;
+		if (stats[i].peak_memory > total.peak_memory) {
+			total.peak_memory = stats[i].peak_memory;
+		}
+		total.allocations_tracked |= stats[i].allocations_tracked;
+		for (int k = 0; k < ALLOC_KIND_COUNT; k++) {
+			total.allocations[k].allocations += stats[i].allocations[k].allocations;
+			total.allocations[k].bytes += stats[i].allocations[k].bytes;
+			if (stats[i].allocations[k].peak_bytes > total.allocations[k].peak_bytes) {
+				total.allocations[k].peak_bytes = stats[i].allocations[k].peak_bytes;
+			}
+		}
+	}
+	return total;
+}
+
+void print_stats(FILE* out, const conversion_stats_t* stats) {
+	if (stats->converted) {
+		print_stats_line(out, stats->filename, stats);
+	}
+}
+
+void print_stats_summary(FILE* out, const conversion_stats_t* stats, size_t count) {
+	size_t converted = 0;
+	for (size_t i = 0; i < count; i++) {
+		converted += stats[i].converted;
+	}
+	char label[64];
+	sprintf(label, "Total (%u of %u files)", (unsigned)converted, (unsigned)count);
+	conversion_stats_t total = sum_stats(stats, count);
+	print_stats_line(out, label, &total);
+}
+
+static void print_json_string(FILE* out, const char* str) {
+	fputc('"', out);
+	for (; *str; str++) {
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		}
+		else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		}
+		else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void print_json_fields(FILE* out, const conversion_stats_t* stats) {
+	fprintf(out, "\"bytes_in\": %llu, \"bytes_out\": %llu, \"seconds\": {",
+		(unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out);
+	for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+		fprintf(out, "%s\"%s\": %.6f", p ? ", " : "", stats_phase_names[p], stats->seconds[p]);
+	}
+	fprintf(out, "}, \"nodes\": %llu, \"attributes\": %llu, \"children\": %llu, \"data_table_size\": %llu, "
+		"\"string_bytes\": %llu, \"dedup_ratio\": %.4f, \"peak_memory\": %llu",
+		(unsigned long long)stats->nodes, (unsigned long long)stats->attributes, (unsigned long long)stats->children,
+		(unsigned long long)stats->data_table_size, (unsigned long long)stats->string_bytes, dedup_ratio(stats),
+		(unsigned long long)stats->peak_memory);
+	if (stats->allocations_tracked) {
+		fprintf(out, ", \"allocations\": {");
+		for (int k = 0; k < ALLOC_KIND_COUNT; k++) {
+			const alloc_usage_t& usage = stats->allocations[k];
+			fprintf(out, "%s\"%s\": {\"allocations\": %llu, \"bytes\": %llu, \"peak_bytes\": %llu}", k ? ", " : "",
+				alloc_kind_names[k], (unsigned long long)usage.allocations, (unsigned long long)usage.bytes,
+				(unsigned long long)usage.peak_bytes);
+		}
+		fputc('}', out);
+	}
+}
+
+void print_stats_json(FILE* out, const conversion_stats_t* stats, size_t count) {
+	fprintf(out, "{\n  \"files\": [\n");
+	for (size_t i = 0; i < count; i++) {
+		fprintf(out, "    {\"file\": ");
+		print_json_string(out, stats[i].filename);
+		fprintf(out, ", \"direction\": \"%s\", \"converted\": %s, ",
+			stats[i].to_cryxmlb ? "to_cryxmlb" : "to_xml", stats[i].converted ? "true" : "false");
+		print_json_fields(out, stats + i);
+		fprintf(out, "}%s\n", i + 1 < count ? "," : "");
+	}
+	conversion_stats_t total = sum_stats(stats, count);
+	fprintf(out, "  ],\n  \"total\": {\"files\": %u, ", (unsigned)count);
+	print_json_fields(out, &total);
+	fprintf(out, "}\n}\n");
+}
+
+// Trace events are kept in memory until the end of the run. Names and file
+// names must outlive the trace; they are string literals and argv entries.
+struct trace_event_t {
+	const char* category;
+	const char* name;
+	const char* file;
+	unsigned thread_id;
+	double start;
+	double end;
+};
+
+static bool trace_on = false;
+static double trace_epoch = 0;
+static std::mutex trace_mutex;
+static std::vector<trace_event_t> trace_events;
+static unsigned trace_thread_count = 0;
+
+// Threads are numbered in the order they record their first event
+static unsigned trace_thread_id() {
+	static thread_local unsigned thread_id = 0;
+	if (!thread_id) {
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		thread_id = ++trace_thread_count;
+	}
+	return thread_id;
+}
+
+// Called on the main thread, which becomes thread 1
+void trace_start() {
+	trace_on = true;
+	trace_epoch = stats_now();
+	trace_thread_id();
+}
+
+bool trace_enabled() {
+	return trace_on;
+}
+
+// Records a span on the calling thread; file may be null
+void trace_event(const char* category, const char* name, const char* file, double start, double end) {
+	if (!trace_on) {
+		return;
+	}
+	trace_event_t event = { category, name, file, trace_thread_id(), start, end };
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	trace_events.push_back(event);
+}
+
+// Writes the events in Chrome trace-event format, which Perfetto and
+// chrome://tracing open directly
+bool trace_write(const char* filename) {
+	FILE* out = fopen(filename, "w");
+	if (!out) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (unsigned t = 1; t <= trace_thread_count; t++) {
+		char name[32];
+		if (t == 1) {
+			strcpy(name, "main");
+		}
+		else {
+			sprintf(name, "thread %u", t);
+		}
+		fprintf(out, "  {\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}},\n",
+			t, name);
+	}
+	for (size_t i = 0; i < trace_events.size(); i++) {
+		const trace_event_t& event = trace_events[i];
+		fprintf(out, "  {\"ph\": \"X\", \"cat\": \"%s\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+			event.category, event.name, event.thread_id, (event.start - trace_epoch) * 1e6, (event.end - event.start) * 1e6);
+		if (event.file) {
+			fprintf(out, ", \"args\": {\"file\": ");
+			print_json_string(out, event.file);
+			fputc('}', out);
+		}
+		fprintf(out, "}%s\n", i + 1 < trace_events.size() ? "," : "");
+	}
+	fprintf(out, "]}\n");
+	fclose(out);
+	return true;
+}
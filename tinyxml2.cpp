@@ -32,6 +32,14 @@ distribution.
 #   include <cstdarg>
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#   include <emmintrin.h>
+#   define TIXML_SSE2
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#   endif
+#endif
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1400 ) && (!defined WINCE)
 	// Microsoft Visual Studio, version 2005 and higher. Not WinCE.
 	/*int _snprintf_s(
@@ -119,6 +127,8 @@ static const unsigned char TIXML_UTF_LEAD_2 = 0xbfU;
 namespace tinyxml2
 {
 
+void (*DynArrayResizeHook)( size_t oldBytes, size_t newBytes ) = 0;
+
 struct Entity {
     const char* pattern;
     int length;
@@ -134,6 +144,101 @@ static const Entity entities[NUM_ENTITIES] = {
     { "gt",	2,		'>'	 }
 };
 
+// Complete escaped form ("&amp;" etc.) of every byte the printer replaces,
+// indexed directly by the byte value. Unused slots are empty.
+struct EntityReplacement {
+    const char* text;
+    int length;
+};
+
+static const int ENTITY_REPLACEMENT_RANGE = 64;
+static const EntityReplacement entityReplacements[ENTITY_REPLACEMENT_RANGE] = {
+    { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 },	// 0x00
+    { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 },	// 0x08
+    { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 },	// 0x10
+    { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 },	// 0x18
+    { 0, 0 }, { 0, 0 }, { "&quot;", 6 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { "&amp;", 5 }, { "&apos;", 6 },	// 0x20
+    { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 },	// 0x28
+    { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 },	// 0x30
+    { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, { "&lt;", 4 }, { 0, 0 }, { "&gt;", 4 }, { 0, 0 }	// 0x38
+};
+
+#ifdef TIXML_SSE2
+static inline int TrailingZeros( unsigned mask )
+{
+    TIXMLASSERT( mask != 0 );
+#   if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward( &index, mask );
+    return static_cast<int>( index );
+#   else
+    return __builtin_ctz( mask );
+#   endif
+}
+#endif
+
+// Returns the first occurrence of 'a' or 'b' in [p, end), or 'end' if
+// neither occurs. Pass the same byte twice to look for a single one.
+static const char* FindEitherChar( const char* p, const char* end, char a, char b )
+{
+#ifdef TIXML_SSE2
+    const __m128i va = _mm_set1_epi8( a );
+    const __m128i vb = _mm_set1_epi8( b );
+    while ( end - p >= 16 ) {
+        const __m128i block = _mm_loadu_si128( reinterpret_cast<const __m128i*>( p ) );
+        const __m128i hits = _mm_or_si128( _mm_cmpeq_epi8( block, va ), _mm_cmpeq_epi8( block, vb ) );
+        const unsigned mask = static_cast<unsigned>( _mm_movemask_epi8( hits ) );
+        if ( mask ) {
+            return p + TrailingZeros( mask );
+        }
+        p += 16;
+    }
+#endif
+    for( ; p < end; ++p ) {
+        if ( *p == a || *p == b ) {
+            break;
+        }
+    }
+    return p;
+}
+
+// Returns the first byte in [p, end) that the printer must replace with an
+// entity, or 'end' if there is none. Scans 16 bytes per step where SSE2 is
+// available; 'flag' (indexed by byte, ENTITY_REPLACEMENT_RANGE entries)
+// handles the tail and the scalar build.
+static const char* FindEntityChar( const char* p, const char* end, const bool* flag, bool restricted )
+{
+#ifdef TIXML_SSE2
+    const __m128i amp = _mm_set1_epi8( '&' );
+    const __m128i lt = _mm_set1_epi8( '<' );
+    const __m128i gt = _mm_set1_epi8( '>' );
+    const __m128i quot = _mm_set1_epi8( DOUBLE_QUOTE );
+    const __m128i apos = _mm_set1_epi8( SINGLE_QUOTE );
+    while ( end - p >= 16 ) {
+        const __m128i block = _mm_loadu_si128( reinterpret_cast<const __m128i*>( p ) );
+        __m128i hits = _mm_or_si128( _mm_cmpeq_epi8( block, amp ),
+                                     _mm_or_si128( _mm_cmpeq_epi8( block, lt ), _mm_cmpeq_epi8( block, gt ) ) );
+        if ( !restricted ) {
+            hits = _mm_or_si128( hits, _mm_or_si128( _mm_cmpeq_epi8( block, quot ), _mm_cmpeq_epi8( block, apos ) ) );
+        }
+        const unsigned mask = static_cast<unsigned>( _mm_movemask_epi8( hits ) );
+        if ( mask ) {
+            return p + TrailingZeros( mask );
+        }
+        p += 16;
+    }
+#else
+    (void)restricted;
+#endif
+    for( ; p < end; ++p ) {
+        // Remember, char is sometimes signed. (How many times has that bitten me?)
+        if ( *p > 0 && *p < ENTITY_REPLACEMENT_RANGE && flag[static_cast<unsigned char>(*p)] ) {
+            break;
+        }
+    }
+    return p;
+}
+
 
 StrPair::~StrPair()
 {
@@ -272,35 +377,49 @@ const char* StrPair::GetStr()
         *_end = 0;
         _flags ^= NEEDS_FLUSH;
 
-        if ( _flags ) {
+        if ( _flags & ( NEEDS_ENTITY_PROCESSING | NEEDS_NEWLINE_NORMALIZATION ) ) {
+            // Only CR and '&' can start a rewrite (an LF only matters when
+            // a CR follows it), so scan for those and move the plain runs
+            // between them in blocks. A string without either is left
+            // exactly where it is.
+            const char special0 = ( _flags & NEEDS_NEWLINE_NORMALIZATION ) ? CR : '&';
+            const char special1 = ( _flags & NEEDS_ENTITY_PROCESSING ) ? '&' : CR;
             const char* p = _start;	// the read pointer
             char* q = _start;	// the write pointer
 
             while( p < _end ) {
-                if ( (_flags & NEEDS_NEWLINE_NORMALIZATION) && *p == CR ) {
+                const char* special = FindEitherChar( p, _end, special0, special1 );
+                const size_t run = special - p;
+                if ( q != p ) {
+                    memmove( q, p, run );
+                }
+                q += run;
+                const bool afterLF = run > 0 && *(special-1) == LF;
+                p = special;
+                if ( p == _end ) {
+                    break;
+                }
+
+                if ( *p == CR ) {
                     // CR-LF pair becomes LF
                     // CR alone becomes LF
-                    // LF-CR becomes LF
-                    if ( *(p+1) == LF ) {
-                        p += 2;
-                    }
-                    else {
+                    // LF-CR becomes LF (the LF has been written already)
+                    if ( afterLF ) {
                         ++p;
                     }
-                    *q = LF;
-                    ++q;
-                }
-                else if ( (_flags & NEEDS_NEWLINE_NORMALIZATION) && *p == LF ) {
-                    if ( *(p+1) == CR ) {
-                        p += 2;
-                    }
                     else {
-                        ++p;
+                        if ( *(p+1) == LF ) {
+                            p += 2;
+                        }
+                        else {
+                            ++p;
+                        }
+                        *q = LF;
+                        ++q;
                     }
-                    *q = LF;
-                    ++q;
                 }
-                else if ( (_flags & NEEDS_ENTITY_PROCESSING) && *p == '&' ) {
+                else {
+                    TIXMLASSERT( *p == '&' );
                     // Entities handled by tinyXML2:
                     // - special entities in the entity table [in/out]
                     // - numeric character reference [in]
@@ -340,16 +459,12 @@ const char* StrPair::GetStr()
                         }
                         if ( !entityFound ) {
                             // fixme: treat as error?
+                            *q = *p;
                             ++p;
                             ++q;
                         }
                     }
                 }
-                else {
-                    *q = *p;
-                    ++p;
-                    ++q;
-                }
             }
             *q = 0;
         }
@@ -369,6 +484,28 @@ const char* StrPair::GetStr()
 
 // --------- XMLUtil ----------- //
 
+// Character classes of every byte, as the XML lexer sees them. Matches the
+// "C" locale: only ASCII letters are alphabetic, and bytes >= 0x80 are
+// accepted in names (see IsNameStartChar) but never count as whitespace.
+const unsigned char XMLUtil::charClass[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,	// 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x10
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 4, 0,	// 0x20
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 6, 0, 0, 0, 0, 0,	// 0x30
+    0, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x40
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 0, 0, 0, 6,	// 0x50
+    0, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x60
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 0, 0, 0, 0,	// 0x70
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x80
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0x90
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xa0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xb0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xc0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xd0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,	// 0xe0
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6	// 0xf0
+};
+
 const char* XMLUtil::writeBoolTrue  = "true";
 const char* XMLUtil::writeBoolFalse = "false";
 
@@ -2496,6 +2633,7 @@ XMLPrinter::XMLPrinter( FILE* file, bool compact, int depth ) :
         const char entityValue = entities[i].value;
         const unsigned char flagIndex = static_cast<unsigned char>(entityValue);
         TIXMLASSERT( flagIndex < ENTITY_RANGE );
+        TIXMLASSERT( entityReplacements[flagIndex].text );
         _entityFlag[flagIndex] = true;
     }
     _restrictedEntityFlag[static_cast<unsigned char>('&')] = true;
@@ -2563,51 +2701,26 @@ void XMLPrinter::PrintSpace( int depth )
 
 void XMLPrinter::PrintString( const char* p, bool restricted )
 {
-    // Look for runs of bytes between entities to print.
-    const char* q = p;
-
     if ( _processEntities ) {
         const bool* flag = restricted ? _restrictedEntityFlag : _entityFlag;
-        while ( *q ) {
-            TIXMLASSERT( p <= q );
-            // Remember, char is sometimes signed. (How many times has that bitten me?)
-            if ( *q > 0 && *q < ENTITY_RANGE ) {
-                // Check for entities. If one is found, flush
-                // the stream up until the entity, write the
-                // entity, and keep looking.
-                if ( flag[static_cast<unsigned char>(*q)] ) {
-                    while ( p < q ) {
-                        const size_t delta = q - p;
-                        const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
-                        Write( p, toPrint );
-                        p += toPrint;
-                    }
-                    bool entityPatternPrinted = false;
-                    for( int i=0; i<NUM_ENTITIES; ++i ) {
-                        if ( entities[i].value == *q ) {
-                            Putc( '&' );
-                            Write( entities[i].pattern, entities[i].length );
-                            Putc( ';' );
-                            entityPatternPrinted = true;
-                            break;
-                        }
-                    }
-                    if ( !entityPatternPrinted ) {
-                        // TIXMLASSERT( entityPatternPrinted ) causes gcc -Wunused-but-set-variable in release
-                        TIXMLASSERT( false );
-                    }
-                    ++p;
-                }
+        const char* const end = p + strlen( p );
+        // Look for runs of bytes between entities to print, and print
+        // each run with a single write.
+        for( ;; ) {
+            const char* q = FindEntityChar( p, end, flag, restricted );
+            while ( p < q ) {
+                const size_t delta = q - p;
+                const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
+                Write( p, toPrint );
+                p += toPrint;
             }
-            ++q;
-            TIXMLASSERT( p <= q );
-        }
-        // Flush the remaining string. This will be the entire
-        // string if an entity wasn't found.
-        if ( p < q ) {
-            const size_t delta = q - p;
-            const int toPrint = ( INT_MAX < delta ) ? INT_MAX : static_cast<int>(delta);
-            Write( p, toPrint );
+            if ( q == end ) {
+                break;
+            }
+            const EntityReplacement& entity = entityReplacements[static_cast<unsigned char>(*q)];
+            TIXMLASSERT( entity.text );
+            Write( entity.text, entity.length );
+            p = q + 1;
         }
     }
     else {
@@ -196,6 +196,13 @@ private:
 };
 
 
+/*
+	Called, when set, each time a DynArray moves to a new heap allocation
+	or frees one. Sizes are in bytes; memory in the initial pool counts as 0.
+	Used for allocation statistics.
+*/
+extern TINYXML2_LIB void (*DynArrayResizeHook)( size_t oldBytes, size_t newBytes );
+
 /*
 	A dynamic array of Plain Old Data. Doesn't support constructors, etc.
 	Has a small initial memory pool, so that low or no usage will not
@@ -214,6 +221,9 @@ public:
 
     ~DynArray() {
         if ( _mem != _pool ) {
+            if ( DynArrayResizeHook ) {
+                DynArrayResizeHook( sizeof(T)*_allocated, 0 );
+            }
             delete [] _mem;
         }
     }
@@ -307,6 +317,9 @@ private:
             T* newMem = new T[newAllocated];
             TIXMLASSERT( newAllocated >= _size );
             memcpy( newMem, _mem, sizeof(T)*_size );	// warning: not using constructors, only works for PODs
+            if ( DynArrayResizeHook ) {
+                DynArrayResizeHook( _mem != _pool ? sizeof(T)*_allocated : 0, sizeof(T)*newAllocated );
+            }
             if ( _mem != _pool ) {
                 delete [] _mem;
             }
@@ -336,6 +349,12 @@ public:
     virtual void* Alloc() = 0;
     virtual void Free( void* ) = 0;
     virtual void SetTracked() = 0;
+
+    virtual int CurrentAllocs() const = 0;
+    virtual int MaxAllocs() const = 0;
+    virtual int TotalAllocs() const = 0;
+    virtual int BlockCount() const = 0;
+    virtual int BlockSize() const = 0;
 };
 
 
@@ -367,9 +386,21 @@ public:
     virtual int ItemSize() const	{
         return ITEM_SIZE;
     }
-    int CurrentAllocs() const		{
+    virtual int CurrentAllocs() const		{
         return _currentAllocs;
     }
+    virtual int MaxAllocs() const			{
+        return _maxAllocs;
+    }
+    virtual int TotalAllocs() const			{
+        return _nAllocs;
+    }
+    virtual int BlockCount() const			{
+        return _blockPtrs.Size();
+    }
+    virtual int BlockSize() const			{
+        return sizeof( Block );
+    }
 
     virtual void* Alloc() {
         if ( !_root ) {
@@ -569,25 +600,17 @@ public:
     // Anything in the high order range of UTF-8 is assumed to not be whitespace. This isn't
     // correct, but simple, and usually works.
     static bool IsWhiteSpace( char p )					{
-        return !IsUTF8Continuation(p) && isspace( static_cast<unsigned char>(p) );
+        return ( charClass[static_cast<unsigned char>(p)] & CHAR_CLASS_WHITESPACE ) != 0;
     }
 
+    // Anything in the high order range is accepted. This is a heuristic guess in
+    // attempt to not implement Unicode-aware isalpha()
     inline static bool IsNameStartChar( unsigned char ch ) {
-        if ( ch >= 128 ) {
-            // This is a heuristic guess in attempt to not implement Unicode-aware isalpha()
-            return true;
-        }
-        if ( isalpha( ch ) ) {
-            return true;
-        }
-        return ch == ':' || ch == '_';
+        return ( charClass[ch] & CHAR_CLASS_NAME_START ) != 0;
     }
 
     inline static bool IsNameChar( unsigned char ch ) {
-        return IsNameStartChar( ch )
-               || isdigit( ch )
-               || ch == '.'
-               || ch == '-';
+        return ( charClass[ch] & CHAR_CLASS_NAME ) != 0;
     }
 
     inline static bool StringEqual( const char* p, const char* q, int nChar=INT_MAX )  {
@@ -635,6 +658,15 @@ public:
 	static void SetBoolSerialization(const char* writeTrue, const char* writeFalse);
 
 private:
+    // Bits of charClass. The lexer tests them instead of the locale-dependent
+    // isspace()/isalpha()/isdigit(), so each byte costs one load and mask.
+    enum {
+        CHAR_CLASS_WHITESPACE   = 0x01,
+        CHAR_CLASS_NAME_START   = 0x02,
+        CHAR_CLASS_NAME         = 0x04
+    };
+    static const unsigned char charClass[256];
+
 	static const char* writeBoolTrue;
 	static const char* writeBoolFalse;
 };
@@ -1896,6 +1928,12 @@ public:
 	// internal
 	void MarkInUse(XMLNode*);
 
+	/// Usage of the node memory pools, for allocation statistics.
+	const MemPool& ElementPool() const		{ return _elementPool; }
+	const MemPool& AttributePool() const	{ return _attributePool; }
+	const MemPool& TextPool() const			{ return _textPool; }
+	const MemPool& CommentPool() const		{ return _commentPool; }
+
     virtual XMLNode* ShallowClone( XMLDocument* /*document*/ ) const	{
         return 0;
     }
@@ -0,0 +1,262 @@
+/*
+Structural round-trip verification for --verify
+Copyright (c) 2023 Mohammed Hussin (MasterHunterr)
+MIT License
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "cryxmlb.h"
+
+// Where the comparison stopped: the element that differs and why
+struct verify_mismatch_t {
+	const tinyxml2::XMLElement* element;
+	char message[256];
+};
+
+struct verify_context_t {
+	const cryxmlb_file_t* file;
+	uint64_t data_size; // Bytes readable from data_table; may be less than data_table_size in a damaged file
+	uint32_t visited;
+	verify_mismatch_t* mismatch;
+};
+
+static bool verify_fail(verify_context_t* ctx, const tinyxml2::XMLElement* element, const char* format, const char* a = "", const char* b = "") {
+	ctx->mismatch->element = element;
+	snprintf(ctx->mismatch->message, sizeof(ctx->mismatch->message), format, a, b);
+	return false;
+}
+
+// String at a data table offset, or null if it is out of bounds or unterminated
+static const char* verify_string(const verify_context_t* ctx, int32_t offset) {
+	if (offset < 0 || (uint64_t)offset >= ctx->data_size) {
+		return 0;
+	}
+	const char* str = ctx->file->data_table + offset;
+	return memchr(str, 0, ctx->data_size - offset) ? str : 0;
+}
+
+// Compares an element and its subtree with the node at index, the way the
+// engine reads it: attributes from first_attr_idx, children through the
+// child table.
+static bool verify_node(verify_context_t* ctx, const tinyxml2::XMLElement* element, uint32_t index, int32_t parent_id) {
+	const cryxmlb_file_t* file = ctx->file;
+	if (index >= file->node_table_count) {
+		return verify_fail(ctx, element, "node index out of range");
+	}
+	const cry_xml_node_t* node = file->node_table + index;
+	ctx->visited++;
+	if (node->parent_id != parent_id) {
+		return verify_fail(ctx, element, "wrong parent_id");
+	}
+
+	const char* name = verify_string(ctx, node->name_offset);
+	if (!name) {
+		return verify_fail(ctx, element, "name offset out of range");
+	}
+	if (strcmp(name, element->Name()) != 0) {
+		return verify_fail(ctx, element, "name is \"%s\" instead of \"%s\"", name, element->Name());
+	}
+
+	// Only text that comes before any child is stored
+	const char* content = verify_string(ctx, node->content_offset);
+	const char* text = element->GetText();
+	if (!content) {
+		return verify_fail(ctx, element, "content offset out of range");
+	}
+	if (strcmp(content, text ? text : "") != 0) {
+		return verify_fail(ctx, element, "text is \"%s\" instead of \"%s\"", content, text ? text : "");
+	}
+
+	// Attributes, in order
+	int attribute_count = 0;
+	for (const tinyxml2::XMLAttribute* attr = element->FirstAttribute(); attr; attr = attr->Next()) {
+		if (attribute_count >= node->attribute_count) {
+			return verify_fail(ctx, element, "attribute \"%s\" is missing", attr->Name());
+		}
+		int64_t attr_idx = (int64_t)node->first_attr_idx + attribute_count;
+		if (node->first_attr_idx < 0 || attr_idx >= file->attr_table_count) {
+			return verify_fail(ctx, element, "attribute index out of range");
+		}
+		const char* attr_name = verify_string(ctx, file->attr_table[attr_idx].name_offset);
+		const char* attr_value = verify_string(ctx, file->attr_table[attr_idx].value_offset);
+		if (!attr_name || !attr_value) {
+			return verify_fail(ctx, element, "attribute offset out of range");
+		}
+		if (strcmp(attr_name, attr->Name()) != 0) {
+			return verify_fail(ctx, element, "attribute \"%s\" instead of \"%s\"", attr_name, attr->Name());
+		}
+		if (strcmp(attr_value, attr->Value()) != 0) {
+			return verify_fail(ctx, element, "attribute value \"%s\" instead of \"%s\"", attr_value, attr->Value());
+		}
+		attribute_count++;
+	}
+	if (attribute_count != node->attribute_count) {
+		return verify_fail(ctx, element, "extra attributes");
+	}
+
+	// Child elements, in order. Text anywhere but first is lost.
+	int child_count = 0;
+	for (const tinyxml2::XMLNode* child = element->FirstChild(); child; child = child->NextSibling()) {
+		if (child->ToText() && child != element->FirstChild()) {
+			return verify_fail(ctx, element, "text that is not the first child is not stored: \"%s\"", child->Value());
+		}
+		const tinyxml2::XMLElement* child_element = child->ToElement();
+		if (!child_element) {
+			continue;
+		}
+		if (child_count >= node->child_count) {
+			return verify_fail(ctx, child_element, "element is missing");
+		}
+		int64_t child_idx = (int64_t)node->first_child_idx + child_count;
+		if (node->first_child_idx < 0 || child_idx >= file->child_table_count) {
+			return verify_fail(ctx, element, "child index out of range");
+		}
+		if (!verify_node(ctx, child_element, file->child_table[child_idx], (int32_t)index)) {
+			return false;
+		}
+		child_count++;
+	}
+	if (child_count != node->child_count) {
+		return verify_fail(ctx, element, "extra child elements");
+	}
+	return true;
+}
+
+// Path of an element such as /Root/Entity[3]/Prop, with the position among
+// siblings of the same name when there is more than one
+static std::string verify_path(const tinyxml2::XMLElement* element) {
+	std::string path;
+	for (; element; element = element->Parent() ? element->Parent()->ToElement() : 0) {
+		int position = 1;
+		for (const tinyxml2::XMLElement* e = element->PreviousSiblingElement(element->Name()); e; e = e->PreviousSiblingElement(element->Name())) {
+			position++;
+		}
+		std::string segment = std::string("/") + element->Name();
+		if (position > 1 || element->NextSiblingElement(element->Name())) {
+			segment += "[" + std::to_string(position) + "]";
+		}
+		path = segment + path;
+	}
+	return path.empty() ? "/" : path;
+}
+
+// Compares a document with decoded CryXmlB tables
+static bool verify_tables(const char* filename, const tinyxml2::XMLDocument* doc, const cryxmlb_file_t* file, uint64_t data_size) {
+	verify_mismatch_t mismatch = {};
+	verify_context_t ctx = { file, data_size, 0, &mismatch };
+	const tinyxml2::XMLElement* root = doc->RootElement();
+	bool ok = false;
+	if (!root || file->node_table_count == 0) {
+		verify_fail(&ctx, 0, root ? "no nodes" : "no root element");
+	}
+	else if (root->NextSiblingElement()) {
+		verify_fail(&ctx, root->NextSiblingElement(), "more than one root element");
+	}
+	else if (verify_node(&ctx, root, 0, -1)) {
+		ok = ctx.visited == file->node_table_count;
+		if (!ok) {
+			verify_fail(&ctx, 0, "nodes not reachable from the root");
+		}
+	}
+	if (ok) {
+		fprintf(stdout, "Verified %s: %u nodes, %u attributes\n", filename, file->node_table_count, file->attr_table_count);
+	}
+	else {
+		fprintf(stderr, "Mismatch in %s at %s: %s\n", filename,
+			mismatch.element ? verify_path(mismatch.element).c_str() : "/", mismatch.message);
+	}
+	return ok;
+}
+
+// Checks that a file survives conversion without writing anything. XML is
+// encoded and serialized in memory, decoded again and compared with its
+// DOM. CryXmlB is rebuilt into a DOM the way --to-xml does and compared
+// with its tables. Returns false on a mismatch or error.
+bool verify_file(const char* filename) {
+	double start = stats_now();
+	read_file_result_t input = read_file(filename);
+	trace_event("phase", "read", filename, start, stats_now());
+	if (!input.data || input.size == 0) {
+		free(input.data);
+		return false;
+	}
+
+	bool ok = false;
+	start = stats_now();
+	if (input.data[0] == '<') {
+		tinyxml2::XMLDocument doc;
+		if (doc.Parse((const char*)input.data, input.size) != tinyxml2::XML_SUCCESS || !doc.RootElement()) {
+			fprintf(stderr, "Error parsing XML file %s: %s\n", filename, doc.ErrorStr());
+			free(input.data);
+			return false;
+		}
+		free(input.data);
+		cryxmlb_tables_t tables;
+		output_buffer_t output_buffer;
+		const char* error = 0;
+		if (encode_xml_tables(doc.RootElement(), tables, &error)) {
+			serialize_cryxmlb(tables, output_buffer);
+		}
+		else {
+			fprintf(stderr, "Error encoding XML file %s: %s\n", filename, error);
+		}
+
+		cryxmlb_file_t file;
+		if (output_buffer.size() > 0 && decode_cryxmlb(filename, output_buffer.data(), output_buffer.size(), &file)) {
+			uint64_t data_size = output_buffer.size() - (file.data_table - (char*)output_buffer.data());
+			ok = verify_tables(filename, &doc, &file, data_size);
+			free_cryxmlb(&file);
+		}
+	}
+	else if (input.data[0] == 'C') {
+		cryxmlb_file_t file;
+		if (decode_cryxmlb(filename, input.data, input.size, &file)) {
+			uint64_t data_offset = file.data_table - (char*)input.data;
+			uint64_t data_size = data_offset < input.size ? input.size - data_offset : 0;
+			if (data_size > file.data_table_size) {
+				data_size = file.data_table_size;
+			}
+			tinyxml2::XMLDocument doc;
+			char message[128];
+			if (!check_cryxmlb_references(&file, data_size, message, sizeof(message))) {
+				fprintf(stderr, "Mismatch in %s: %s\n", filename, message);
+			}
+			else if (build_xml_document(&file, &doc)) {
+				ok = verify_tables(filename, &doc, &file, data_size);
+			}
+			free_cryxmlb(&file);
+		}
+		free(input.data);
+	}
+	else {
+		fprintf(stderr, "File %s has unknown file format\n", filename);
+		free(input.data);
+	}
+	trace_event("phase", "verify", filename, start, stats_now());
+	return ok;
+}
@@ -30,38 +30,15 @@ SOFTWARE.
 #include <string.h>
 #include <vector>
 #include <string>
-#include <map>
-
-#include "tinyxml2.h"
-
-// Define the same structs as in main.cpp
-struct cry_xml_node_t {
-	int32_t name_offset;
-	int32_t content_offset;
-	int16_t attribute_count;
-	int16_t child_count;
-	int32_t parent_id;
-	int32_t first_attr_idx;
-	int32_t first_child_idx;
-	int32_t reserved;
-};
-
-struct cry_xml_ref_t {
-	int32_t name_offset;
-	int32_t value_offset;
-};
+#include <thread>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 
-struct read_file_result_t {
-	unsigned char* data;
-	uint64_t size;
-};
-
-// Declare these functions as external since they're defined in main.cpp
-extern read_file_result_t read_file(const char* filename);
-extern bool write_file(const char* filename, const unsigned char* data, size_t size);
+#include "cryxmlb.h"
 
 // Helper function to write a 32-bit integer in little-endian format
-void write_int32(std::vector<unsigned char>& buffer, int32_t value) {
+void write_int32(output_buffer_t& buffer, int32_t value) {
 	buffer.push_back(value & 0xFF);
 	buffer.push_back((value >> 8) & 0xFF);
 	buffer.push_back((value >> 16) & 0xFF);
@@ -69,201 +46,714 @@ void write_int32(std::vector<unsigned char>& buffer, int32_t value) {
 }
 
 // Helper function to write a 16-bit integer in little-endian format
-void write_int16(std::vector<unsigned char>& buffer, int16_t value) {
+void write_int16(output_buffer_t& buffer, int16_t value) {
 	buffer.push_back(value & 0xFF);
 	buffer.push_back((value >> 8) & 0xFF);
 }
 
-// Helper function to add a null-terminated string to the data table
-int32_t add_string_to_data_table(std::vector<char>& data_table, const char* str) {
-	if (!str) {
-		str = ""; // Use empty string for null pointers
+static void count_xml_node(const tinyxml2::XMLElement* element, cryxmlb_table_sizes_t* sizes) {
+	const char* text = element->GetText();
+	sizes->nodes++;
+	sizes->data_bytes += strlen(element->Name()) + 1 + (text ? strlen(text) : 0) + 1;
+	for (const tinyxml2::XMLAttribute* attr = element->FirstAttribute(); attr; attr = attr->Next()) {
+		sizes->attributes++;
+		sizes->data_bytes += strlen(attr->Name()) + 1 + strlen(attr->Value()) + 1;
+	}
+	for (const tinyxml2::XMLElement* child = element->FirstChildElement(); child; child = child->NextSiblingElement()) {
+		sizes->children++;
+		count_xml_node(child, sizes);
 	}
+}
+
+// Adds what encode_xml_tables will append for the tree under element
+void count_xml_tables(const tinyxml2::XMLElement* element, cryxmlb_table_sizes_t* sizes) {
+	count_xml_node(element, sizes);
+}
 
-	int32_t offset = static_cast<int32_t>(data_table.size());
-	// Add the string including the null terminator
-	while (*str) {
-		data_table.push_back(*str++);
+template <class T>
+static void reserve_more(table_vector_t<T>& table, size_t count) {
+	size_t needed = table.size() + count;
+	if (needed > table.capacity()) {
+		// Keep growth geometric when this is called once per chunk
+		table.reserve(needed > table.capacity() * 2 ? needed : table.capacity() * 2);
 	}
-	data_table.push_back('\0'); // Add null terminator
+}
 
-	return offset;
+// Makes room for sizes more entries in every table, so encoding does not
+// reallocate
+void reserve_tables(cryxmlb_tables_t& tables, const cryxmlb_table_sizes_t& sizes) {
+	reserve_more(tables.node_table, sizes.nodes);
+	reserve_more(tables.attr_table, sizes.attributes);
+	reserve_more(tables.child_table, sizes.children);
+	reserve_more(tables.data_table, sizes.data_bytes);
 }
 
-// Recursive function to process XML nodes
-void process_xml_node(tinyxml2::XMLElement* element, int32_t parent_id,
-	std::vector<cry_xml_node_t>& node_table,
-	std::vector<cry_xml_ref_t>& attr_table,
-	std::vector<uint32_t>& child_table,
-	std::vector<char>& data_table,
-	std::map<tinyxml2::XMLElement*, int32_t>& node_indices) {
+static void write_xml_element(cryxmlb_writer_t* writer, const tinyxml2::XMLElement* element) {
+	writer->begin_element(element->Name());
+	writer->text(element->GetText());
+	for (const tinyxml2::XMLAttribute* attr = element->FirstAttribute(); attr; attr = attr->Next()) {
+		writer->attribute(attr->Name(), attr->Value());
+	}
+	for (const tinyxml2::XMLElement* child = element->FirstChildElement(); child; child = child->NextSiblingElement()) {
+		write_xml_element(writer, child);
+	}
+	writer->end_element();
+}
 
-	// Create a new node
-	cry_xml_node_t node = {};
+// Encodes the tree under root into the tables, appending to what is there.
+// The tables are sized from a count of the tree first, so they grow once.
+// Returns false, with the writer's message in *error if it is given, when
+// the tables cannot be finished; they are then not a valid file.
+bool encode_xml_tables(tinyxml2::XMLElement* root, cryxmlb_tables_t& tables, const char** error) {
+	cryxmlb_table_sizes_t sizes = {};
+	count_xml_tables(root, &sizes);
+	reserve_tables(tables, sizes);
+	cryxmlb_writer_t writer(&tables, false);
+	write_xml_element(&writer, root);
+	if (!writer.finish()) {
+		if (error) {
+			*error = writer.error();
+		}
+		return false;
+	}
+	return true;
+}
 
-	// Store the current node index
-	int32_t node_idx = static_cast<int32_t>(node_table.size());
-	node_indices[element] = node_idx;
+// Byte range of one child element of the root in the source text
+struct xml_span_t {
+	size_t begin;
+	size_t end;
+};
 
-	// Set parent ID
-	node.parent_id = parent_id;
+// What scan_root_children found out about the root element
+struct xml_root_scan_t {
+	size_t name_begin;
+	size_t name_length;
+	size_t content_end; // Start of the first child element
+	std::vector<xml_span_t> children;
+};
 
-	// Add node name to data table
-	node.name_offset = add_string_to_data_table(data_table, element->Name());
+// Files smaller than this are always parsed on one thread
+static const uint64_t PARALLEL_PARSE_MIN_SIZE = 4 * 1024 * 1024;
 
-	// Add node content to data table
-	node.content_offset = add_string_to_data_table(data_table, element->GetText());
+static const char* find_text(const char* p, const char* end, const char* text) {
+	size_t len = strlen(text);
+	while (p && (size_t)(end - p) >= len) {
+		p = (const char*)memchr(p, text[0], end - p - len + 1);
+		if (!p || memcmp(p, text, len) == 0) {
+			return p;
+		}
+		p++;
+	}
+	return 0;
+}
 
-	// Process attributes
-	node.first_attr_idx = static_cast<int32_t>(attr_table.size());
-	node.attribute_count = 0;
+// Finds the end of the tag starting at p (the byte after its '>'), skipping
+// over quoted attribute values. Returns 0 if the tag is not terminated.
+static const char* find_tag_end(const char* p, const char* end) {
+	for (; p < end; p++) {
+		if (*p == '"' || *p == '\'') {
+			p = (const char*)memchr(p + 1, *p, end - p - 1);
+			if (!p) {
+				return 0;
+			}
+		}
+		else if (*p == '>') {
+			return p + 1;
+		}
+	}
+	return 0;
+}
 
-	const tinyxml2::XMLAttribute* attr = element->FirstAttribute();
-	while (attr) {
-		cry_xml_ref_t attr_ref = {};
-		attr_ref.name_offset = add_string_to_data_table(data_table, attr->Name());
-		attr_ref.value_offset = add_string_to_data_table(data_table, attr->Value());
-		attr_table.push_back(attr_ref);
-		node.attribute_count++;
-		attr = attr->Next();
+static size_t tag_name_length(const char* p, const char* end) {
+	const char* q = p;
+	while (q < end && tinyxml2::XMLUtil::IsNameChar(*q)) {
+		q++;
 	}
+	return q - p;
+}
 
-	// Process child elements
-	node.first_child_idx = static_cast<int32_t>(child_table.size());
-	node.child_count = 0;
+// Quick structural scan that finds the root element's child elements without
+// building a DOM. Only markup is looked at (comments, CDATA, processing
+// instructions and quoted attribute values are skipped); the chunks are
+// validated when they are parsed. Returns false for anything the scan is not
+// sure about, so the caller can fall back to parsing the whole document.
+static bool scan_root_children(const char* xml, size_t size, xml_root_scan_t* scan) {
+	const char* const end = xml + size;
+	const char* p = xml;
+	const char* root_name = 0;
+	size_t root_name_length = 0;
+	std::vector<xml_span_t>& spans = scan->children;
+	int depth = 0;
+	size_t child_begin = 0;
+	bool root_closed = false;
 
-	tinyxml2::XMLElement* child = element->FirstChildElement();
-	while (child) {
-		// Add child index placeholder (will be filled later)
-		child_table.push_back(0); // Placeholder
-		node.child_count++;
-		child = child->NextSiblingElement();
+	while (p < end) {
+		p = (const char*)memchr(p, '<', end - p);
+		if (!p) {
+			break;
+		}
+		if (root_closed) {
+			// Only whitespace and comments may follow the root element
+			if (end - p < 4 || memcmp(p, "<!--", 4) != 0) {
+				return false;
+			}
+		}
+		const char* tag = p;
+		if (end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+			p = find_text(p + 4, end, "-->");
+			if (!p) {
+				return false;
+			}
+			p += 3;
+		}
+		else if (end - p >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+			p = find_text(p + 9, end, "]]>");
+			if (!p) {
+				return false;
+			}
+			p += 3;
+		}
+		else if (end - p >= 2 && p[1] == '?') {
+			p = find_text(p + 2, end, "?>");
+			if (!p) {
+				return false;
+			}
+			p += 2;
+		}
+		else if (end - p >= 2 && p[1] == '!') {
+			// DOCTYPE and friends; an internal subset could declare entities
+			const char* tag_end = (const char*)memchr(p, '>', end - p);
+			if (!tag_end || memchr(p, '[', tag_end - p)) {
+				return false;
+			}
+			p = tag_end + 1;
+		}
+		else if (end - p >= 2 && p[1] == '/') {
+			p = (const char*)memchr(p, '>', end - p);
+			if (!p) {
+				return false;
+			}
+			p++;
+			depth--;
+			if (depth == 1) {
+				xml_span_t span = { child_begin, (size_t)(p - xml) };
+				spans.push_back(span);
+			}
+			else if (depth == 0) {
+				if (tag_name_length(tag + 2, end) != root_name_length || memcmp(tag + 2, root_name, root_name_length) != 0) {
+					return false;
+				}
+				root_closed = true;
+			}
+			else if (depth < 0) {
+				return false;
+			}
+		}
+		else {
+			p = find_tag_end(p + 1, end);
+			if (!p) {
+				return false;
+			}
+			bool empty = p[-2] == '/';
+			if (depth == 0) {
+				if (root_name) {
+					return false;
+				}
+				root_name = tag + 1;
+				root_name_length = tag_name_length(root_name, end);
+				if (empty || root_name_length == 0) {
+					return false;
+				}
+			}
+			else if (depth == 1) {
+				if (spans.empty()) {
+					scan->content_end = tag - xml;
+				}
+				child_begin = tag - xml;
+				if (empty) {
+					xml_span_t span = { child_begin, (size_t)(p - xml) };
+					spans.push_back(span);
+				}
+			}
+			if (!empty) {
+				depth++;
+				// The chunks are parsed one level shallower than in the whole
+				// document, so leave the depth limit to the serial parser.
+				if (depth >= TINYXML2_MAX_ELEMENT_DEPTH - 1) {
+					return false;
+				}
+			}
+		}
 	}
+	scan->name_begin = root_name ? root_name - xml : 0;
+	scan->name_length = root_name_length;
+	return root_closed && !spans.empty();
+}
 
-	// Add the node to the node table
-	node_table.push_back(node);
+// Size of a CryXmlB file with tables of the given sizes
+static uint64_t cryxmlb_file_size(const cryxmlb_table_sizes_t& sizes) {
+	return strlen("CryXmlB") + 1 + 9 * sizeof(int32_t) + sizes.nodes * sizeof(cry_xml_node_t)
+		+ sizes.attributes * sizeof(cry_xml_ref_t) + sizes.children * sizeof(uint32_t) + sizes.data_bytes;
+}
 
-	// Process children recursively
-	child = element->FirstChildElement();
-	int child_index = 0;
-	while (child) {
-		// Process the child node
-		process_xml_node(child, node_idx, node_table, attr_table, child_table, data_table, node_indices);
+// Offsets and indices are signed 32-bit, the file size unsigned
+static bool cryxmlb_fits(const cryxmlb_table_sizes_t& sizes) {
+	return sizes.nodes <= INT32_MAX && sizes.attributes <= INT32_MAX && sizes.children <= INT32_MAX
+		&& sizes.data_bytes <= INT32_MAX && cryxmlb_file_size(sizes) <= UINT32_MAX;
+}
 
-		// Update the child table with the actual index of the child node
-		child_table[node.first_child_idx + child_index] = node_indices[child];
-		child_index++;
-		child = child->NextSiblingElement();
-	}
+static cryxmlb_table_sizes_t table_sizes(const cryxmlb_tables_t& tables) {
+	cryxmlb_table_sizes_t sizes = { tables.node_table.size(), tables.attr_table.size(), tables.child_table.size(), tables.data_table.size() };
+	return sizes;
 }
 
-void convert_xml_to_cryxmlb(const char* filename) {
-	// Read the XML file
-	read_file_result_t xml_file = read_file(filename);
-	if (!xml_file.data || xml_file.size == 0) {
-		return;
+// Encodes the root on its own: everything up to its first child, closed
+// right there, gives the same name, attributes and text. Its child count is
+// taken from the scan; the child table entries are left to the caller.
+static bool encode_root_element(const char* xml, const xml_root_scan_t& scan, cryxmlb_tables_t& tables) {
+	std::string root_text(xml, scan.content_end);
+	root_text += "</";
+	root_text.append(xml + scan.name_begin, scan.name_length);
+	root_text += ">";
+	tinyxml2::XMLDocument root_doc;
+	if (root_doc.Parse(root_text.c_str(), root_text.size()) != tinyxml2::XML_SUCCESS || !root_doc.RootElement()) {
+		return false;
 	}
+	if (!encode_xml_tables(root_doc.RootElement(), tables, 0)) {
+		return false;
+	}
+	tables.node_table[0].child_count = static_cast<int16_t>(scan.children.size());
+	return true;
+}
 
-	// Check if the file is already in CryXmlB format
-	if (xml_file.size > 0 && xml_file.data[0] == 'C') {
-		fprintf(stdout, "File %s is already in CryXmlB format\n", filename);
-		free(xml_file.data);
-		return;
+// Appends tables encoded on their own, moving their indices and offsets by
+// base. Their roots become children of node 0.
+static void append_rebased(cryxmlb_tables_t& tables, const cryxmlb_tables_t& local, const cryxmlb_table_sizes_t& base) {
+	int32_t node_base = static_cast<int32_t>(base.nodes);
+	int32_t attr_base = static_cast<int32_t>(base.attributes);
+	int32_t child_base = static_cast<int32_t>(base.children);
+	int32_t data_base = static_cast<int32_t>(base.data_bytes);
+
+	for (cry_xml_node_t node : local.node_table) {
+		node.name_offset += data_base;
+		node.content_offset += data_base;
+		node.parent_id = (node.parent_id == -1) ? 0 : node.parent_id + node_base;
+		node.first_attr_idx += attr_base;
+		node.first_child_idx += child_base;
+		tables.node_table.push_back(node);
 	}
+	for (cry_xml_ref_t attr : local.attr_table) {
+		attr.name_offset += data_base;
+		attr.value_offset += data_base;
+		tables.attr_table.push_back(attr);
+	}
+	for (uint32_t child : local.child_table) {
+		tables.child_table.push_back(child + node_base);
+	}
+	tables.data_table.insert(tables.data_table.end(), local.data_table.begin(), local.data_table.end());
+}
 
-	// Parse the XML
+// Encodes a run of the root's children into tables of their own. Node
+// indices, offsets and child references are local to the run; the index of
+// each child's node is appended to roots.
+static bool encode_root_children(const char* xml, const xml_span_t* spans, size_t span_count,
+	cryxmlb_tables_t* tables, std::vector<int32_t>* roots) {
 	tinyxml2::XMLDocument doc;
-	tinyxml2::XMLError error = doc.Parse((const char*)xml_file.data, xml_file.size);
-	if (error != tinyxml2::XML_SUCCESS) {
-		fprintf(stderr, "Error parsing XML file %s: %s\n", filename, doc.ErrorStr());
-		free(xml_file.data);
-		return;
+	for (size_t i = 0; i < span_count; i++) {
+		if (doc.Parse(xml + spans[i].begin, spans[i].end - spans[i].begin) != tinyxml2::XML_SUCCESS || !doc.RootElement()) {
+			return false;
+		}
+		roots->push_back(static_cast<int32_t>(tables->node_table.size()));
+		if (!encode_xml_tables(doc.RootElement(), *tables, 0)) {
+			return false;
+		}
 	}
+	alloc_count_document(&doc);
+	return true;
+}
 
-	// Free the original file data as we no longer need it
-	free(xml_file.data);
+// Parses and encodes a large document on several threads. The root's
+// children are split into runs of similar byte size, each run is encoded by
+// its own thread, and the per-run tables are rebased and concatenated in
+// document order. The result is identical to the serial encoder's. Returns
+// false if the document could not be split, a chunk failed to parse or the
+// whole is too large, in which case the caller should run the serial path
+// (which also reports the error).
+bool encode_xml_parallel(const char* xml, size_t size, unsigned thread_count, cryxmlb_tables_t& tables) {
+	xml_root_scan_t scan = {};
+	if (thread_count < 2 || !scan_root_children(xml, size, &scan) || scan.children.size() < 2) {
+		return false;
+	}
+	const std::vector<xml_span_t>& spans = scan.children;
+	if (!encode_root_element(xml, scan, tables)) {
+		return false;
+	}
+	tables.child_table.resize(spans.size());
 
-	// Get the root element
-	tinyxml2::XMLElement* root = doc.RootElement();
-	if (!root) {
-		fprintf(stderr, "No root element found in XML file %s\n", filename);
-		return;
+	// Split the children into runs of roughly equal size
+	if (thread_count > spans.size()) {
+		thread_count = static_cast<unsigned>(spans.size());
+	}
+	std::vector<size_t> run_begin(thread_count + 1, spans.size());
+	size_t total = spans.back().end - spans.front().begin;
+	size_t run = 0;
+	run_begin[0] = 0;
+	for (size_t i = 0; i < spans.size() && run + 1 < thread_count; i++) {
+		if (spans[i].begin - spans.front().begin >= total / thread_count * (run + 1)) {
+			run_begin[++run] = i;
+		}
 	}
 
-	// Create tables for CryXmlB format
-	std::vector<cry_xml_node_t> node_table;
-	std::vector<cry_xml_ref_t> attr_table;
-	std::vector<uint32_t> child_table;
-	std::vector<char> data_table;
-	std::map<tinyxml2::XMLElement*, int32_t> node_indices;
+	std::vector<cryxmlb_tables_t> run_tables(thread_count);
+	std::vector<std::vector<int32_t> > run_roots(thread_count);
+	std::vector<char> run_ok(thread_count, 0);
+	std::vector<std::thread> workers;
+	alloc_tracker_t* tracker = alloc_tracker;
+	for (unsigned t = 0; t < thread_count; t++) {
+		workers.push_back(std::thread([&, t]() {
+			alloc_scope_t tracking(tracker);
+			double start = stats_now();
+			run_ok[t] = encode_root_children(xml, spans.data() + run_begin[t], run_begin[t + 1] - run_begin[t], &run_tables[t], &run_roots[t]);
+			trace_event("worker", "encode_run", 0, start, stats_now());
+		}));
+	}
+	double wait_start = stats_now();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	trace_event("wait", "join_workers", 0, wait_start, stats_now());
 
-	// Process the XML tree
-	process_xml_node(root, -1, node_table, attr_table, child_table, data_table, node_indices);
+	cryxmlb_table_sizes_t sizes = {};
+	for (unsigned t = 0; t < thread_count; t++) {
+		sizes.nodes += run_tables[t].node_table.size();
+		sizes.attributes += run_tables[t].attr_table.size();
+		sizes.children += run_tables[t].child_table.size();
+		sizes.data_bytes += run_tables[t].data_table.size();
+	}
+	reserve_tables(tables, sizes);
 
-	// Create the output buffer
-	std::vector<unsigned char> output_buffer;
+	// Rebase every run onto the tables built so far
+	size_t child_slot = 0;
+	for (unsigned t = 0; t < thread_count; t++) {
+		if (!run_ok[t]) {
+			return false;
+		}
+		int32_t node_base = static_cast<int32_t>(tables.node_table.size());
+		append_rebased(tables, run_tables[t], table_sizes(tables));
+		for (int32_t root : run_roots[t]) {
+			tables.child_table[child_slot++] = root + node_base;
+		}
+	}
+	// Each run was checked on its own; the serial path reports a file that
+	// is too large as a whole
+	return cryxmlb_fits(table_sizes(tables));
+}
 
-	// Write the header
+// Reorders the nodes breadth first, so the children of every node sit next
+// to each other in the node table and its child table entries count up by
+// one. Attributes are moved to follow the new node order; strings stay
+// where they are. Returns false, leaving the tables alone, if some node
+// cannot be reached from a root exactly once, such as under a child_count
+// that wrapped around.
+bool layout_cryxmlb_bfs(cryxmlb_tables_t& tables) {
+	const table_vector_t<cry_xml_node_t>& node_table = tables.node_table;
+	size_t node_count = node_table.size();
+	table_vector_t<uint32_t> order;
+	table_vector_t<int32_t> new_index(node_count, -1);
+	order.reserve(node_count);
+	for (size_t i = 0; i < node_count; i++) {
+		if (node_table[i].parent_id == -1) {
+			new_index[i] = static_cast<int32_t>(order.size());
+			order.push_back(static_cast<uint32_t>(i));
+		}
+	}
+	for (size_t head = 0; head < order.size(); head++) {
+		const cry_xml_node_t& node = node_table[order[head]];
+		for (int32_t k = 0; k < node.child_count; k++) {
+			uint32_t child = tables.child_table[node.first_child_idx + k];
+			if (child >= node_count || new_index[child] != -1) {
+				return false;
+			}
+			new_index[child] = static_cast<int32_t>(order.size());
+			order.push_back(child);
+		}
+	}
+	if (order.size() != node_count) {
+		return false;
+	}
+
+	cryxmlb_tables_t layout;
+	layout.node_table.reserve(node_count);
+	layout.attr_table.reserve(tables.attr_table.size());
+	layout.child_table.reserve(tables.child_table.size());
+	for (size_t i = 0; i < node_count; i++) {
+		cry_xml_node_t node = node_table[order[i]];
+		const cry_xml_ref_t* attrs = tables.attr_table.data() + node.first_attr_idx;
+		const uint32_t* children = tables.child_table.data() + node.first_child_idx;
+		if (node.parent_id != -1) {
+			node.parent_id = new_index[node.parent_id];
+		}
+		node.first_attr_idx = static_cast<int32_t>(layout.attr_table.size());
+		layout.attr_table.insert(layout.attr_table.end(), attrs, attrs + node.attribute_count);
+		node.first_child_idx = static_cast<int32_t>(layout.child_table.size());
+		for (int32_t k = 0; k < node.child_count; k++) {
+			layout.child_table.push_back(new_index[children[k]]);
+		}
+		layout.node_table.push_back(node);
+	}
+	tables.node_table.swap(layout.node_table);
+	tables.attr_table.swap(layout.attr_table);
+	tables.child_table.swap(layout.child_table);
+	return true;
+}
+
+// Entries in the little-endian layout of the file
+static void write_entry(output_buffer_t& buffer, const cry_xml_node_t& node) {
+	write_int32(buffer, node.name_offset);
+	write_int32(buffer, node.content_offset);
+	write_int16(buffer, node.attribute_count);
+	write_int16(buffer, node.child_count);
+	write_int32(buffer, node.parent_id);
+	write_int32(buffer, node.first_attr_idx);
+	write_int32(buffer, node.first_child_idx);
+	write_int32(buffer, node.reserved);
+}
+
+static void write_entry(output_buffer_t& buffer, const cry_xml_ref_t& attr) {
+	write_int32(buffer, attr.name_offset);
+	write_int32(buffer, attr.value_offset);
+}
+
+static void write_entry(output_buffer_t& buffer, uint32_t child) {
+	write_int32(buffer, child);
+}
+
+// Writes the signature, file size and table offsets for tables of the given
+// sizes
+static void write_cryxmlb_header(output_buffer_t& output_buffer, const cryxmlb_table_sizes_t& sizes) {
 	const char* header = "CryXmlB";
-	output_buffer.insert(output_buffer.end(), header, header + strlen(header) + 1); // Include null terminator
+	size_t header_length = strlen(header) + 1; // Include null terminator
 
 	// Calculate offsets
-	uint32_t header_size = static_cast<uint32_t>(output_buffer.size() + 8 * sizeof(int32_t)); // Header + 8 int32 values
+	uint32_t header_size = static_cast<uint32_t>(header_length + 9 * sizeof(int32_t)); // Header + file size + 8 int32 values
 	uint32_t node_table_offset = header_size;
-	uint32_t node_table_size = static_cast<uint32_t>(node_table.size() * sizeof(cry_xml_node_t));
+	uint32_t node_table_size = static_cast<uint32_t>(sizes.nodes * sizeof(cry_xml_node_t));
 	uint32_t attr_table_offset = node_table_offset + node_table_size;
-	uint32_t attr_table_size = static_cast<uint32_t>(attr_table.size() * sizeof(cry_xml_ref_t));
+	uint32_t attr_table_size = static_cast<uint32_t>(sizes.attributes * sizeof(cry_xml_ref_t));
 	uint32_t child_table_offset = attr_table_offset + attr_table_size;
-	uint32_t child_table_size = static_cast<uint32_t>(child_table.size() * sizeof(uint32_t));
+	uint32_t child_table_size = static_cast<uint32_t>(sizes.children * sizeof(uint32_t));
 	uint32_t data_table_offset = child_table_offset + child_table_size;
-	uint32_t data_table_size = static_cast<uint32_t>(data_table.size());
+	uint32_t data_table_size = static_cast<uint32_t>(sizes.data_bytes);
 	uint32_t total_size = data_table_offset + data_table_size;
 
+	// Write the header
+	output_buffer.insert(output_buffer.end(), header, header + header_length);
+
 	// Write file size
 	write_int32(output_buffer, total_size);
 
 	// Write table offsets and sizes
 	write_int32(output_buffer, node_table_offset);
-	write_int32(output_buffer, static_cast<int32_t>(node_table.size()));
+	write_int32(output_buffer, static_cast<int32_t>(sizes.nodes));
 	write_int32(output_buffer, attr_table_offset);
-	write_int32(output_buffer, static_cast<int32_t>(attr_table.size()));
+	write_int32(output_buffer, static_cast<int32_t>(sizes.attributes));
 	write_int32(output_buffer, child_table_offset);
-	write_int32(output_buffer, static_cast<int32_t>(child_table.size()));
+	write_int32(output_buffer, static_cast<int32_t>(sizes.children));
 	write_int32(output_buffer, data_table_offset);
 	write_int32(output_buffer, data_table_size);
+}
+
+// Lays out the tables as a CryXmlB file
+void serialize_cryxmlb(const cryxmlb_tables_t& tables, output_buffer_t& output_buffer) {
+	cryxmlb_table_sizes_t sizes = table_sizes(tables);
+	output_buffer.reserve(output_buffer.size() + cryxmlb_file_size(sizes));
+	write_cryxmlb_header(output_buffer, sizes);
 
 	// Write node table
-	for (const auto& node : node_table) {
-		write_int32(output_buffer, node.name_offset);
-		write_int32(output_buffer, node.content_offset);
-		write_int16(output_buffer, node.attribute_count);
-		write_int16(output_buffer, node.child_count);
-		write_int32(output_buffer, node.parent_id);
-		write_int32(output_buffer, node.first_attr_idx);
-		write_int32(output_buffer, node.first_child_idx);
-		write_int32(output_buffer, node.reserved);
+	for (const auto& node : tables.node_table) {
+		write_entry(output_buffer, node);
 	}
 
 	// Write attribute table
-	for (const auto& attr : attr_table) {
-		write_int32(output_buffer, attr.name_offset);
-		write_int32(output_buffer, attr.value_offset);
+	for (const auto& attr : tables.attr_table) {
+		write_entry(output_buffer, attr);
 	}
 
 	// Write child table
-	for (const auto& child : child_table) {
-		write_int32(output_buffer, child);
+	for (const auto& child : tables.child_table) {
+		write_entry(output_buffer, child);
 	}
 
 	// Write data table
-	output_buffer.insert(output_buffer.end(), data_table.begin(), data_table.end());
+	output_buffer.insert(output_buffer.end(), tables.data_table.begin(), tables.data_table.end());
+}
 
-	// Create backup of the original file
+// Entries encoded per write when tables go to a file
+static const size_t SPILL_BATCH_ENTRIES = 64 * 1024;
+static const size_t SPILL_COPY_BYTES = 1024 * 1024;
+
+// Opens an unnamed temporary file next to output, so the final copy stays
+// on one file system. It is removed when closed, or when the process dies.
+static FILE* open_spill_file(const char* output) {
+#if !defined(_WIN32)
+	std::string path(output);
+	size_t slash = path.find_last_of('/');
+	path.resize(slash == std::string::npos ? 0 : slash + 1);
+	path += ".cryxmlb-spill-XXXXXX";
+	int fd = mkstemp(&path[0]);
+	if (fd >= 0) {
+		unlink(path.c_str());
+		FILE* file = fdopen(fd, "w+b");
+		if (file) {
+			return file;
+		}
+		close(fd);
+	}
+#endif
+	return tmpfile();
+}
+
+int seek_file(FILE* file, uint64_t offset) {
+#if defined(_WIN32)
+	return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+template <class T>
+static bool write_entries(FILE* file, const T* entries, size_t count, output_buffer_t& staging) {
+	for (size_t i = 0; i < count;) {
+		size_t batch_end = count - i > SPILL_BATCH_ENTRIES ? i + SPILL_BATCH_ENTRIES : count;
+		staging.clear();
+		for (; i < batch_end; i++) {
+			write_entry(staging, entries[i]);
+		}
+		if (fwrite(staging.data(), 1, staging.size(), file) != staging.size()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool write_entries(FILE* file, const char* data, size_t size, output_buffer_t&) {
+	return fwrite(data, 1, size, file) == size;
+}
+
+// Appends the first size bytes of from to to. On Linux the kernel copies
+// them with copy_file_range, which can share blocks instead of copying on
+// file systems that support it; the rest is read and written.
+static bool copy_spill_file(FILE* from, uint64_t size, FILE* to, output_buffer_t& staging) {
+	if (size == 0) {
+		return true;
+	}
+	if (fflush(from) != 0 || fflush(to) != 0) {
+		return false;
+	}
+	uint64_t copied = 0;
+#if defined(__linux__)
+	loff_t offset = 0;
+	while (copied < size) {
+		ssize_t n = copy_file_range(fileno(from), &offset, fileno(to), 0, (size_t)(size - copied), 0);
+		if (n <= 0) {
+			break;
+		}
+		copied += n;
+	}
+	// Move the stream to where the kernel left the file
+	if (fseek(to, 0, SEEK_END) != 0) {
+		return false;
+	}
+#endif
+	if (copied < size && seek_file(from, copied) != 0) {
+		return false;
+	}
+	staging.resize(SPILL_COPY_BYTES);
+	while (copied < size) {
+		size_t n = size - copied < SPILL_COPY_BYTES ? (size_t)(size - copied) : SPILL_COPY_BYTES;
+		if (fread(staging.data(), 1, n, from) != n || fwrite(staging.data(), 1, n, to) != n) {
+			return false;
+		}
+		copied += n;
+	}
+	return true;
+}
+
+// Tables written to temporary files by the out-of-core encoder, in the
+// order of cryxmlb_tables_t
+struct spill_tables_t {
+	FILE* files[4];
+	cryxmlb_table_sizes_t sizes; // Entries in the files
+
+	spill_tables_t() : files(), sizes() {
+	}
+	~spill_tables_t() {
+		for (FILE* file : files) {
+			if (file) {
+				fclose(file);
+			}
+		}
+	}
+};
+
+// Moves the tables to the end of the spill files, leaving them empty with
+// their memory kept for the next root children
+static bool spill_tables(spill_tables_t* spill, cryxmlb_tables_t& tables, const char* output, output_buffer_t& staging) {
+	for (FILE*& file : spill->files) {
+		if (!file && !(file = open_spill_file(output))) {
+			return false;
+		}
+	}
+	if (!write_entries(spill->files[0], tables.node_table.data(), tables.node_table.size(), staging)
+		|| !write_entries(spill->files[1], tables.attr_table.data(), tables.attr_table.size(), staging)
+		|| !write_entries(spill->files[2], tables.child_table.data(), tables.child_table.size(), staging)
+		|| !write_entries(spill->files[3], tables.data_table.data(), tables.data_table.size(), staging)) {
+		return false;
+	}
+	spill->sizes.nodes += tables.node_table.size();
+	spill->sizes.attributes += tables.attr_table.size();
+	spill->sizes.children += tables.child_table.size();
+	spill->sizes.data_bytes += tables.data_table.size();
+	tables.node_table.clear();
+	tables.attr_table.clear();
+	tables.child_table.clear();
+	tables.data_table.clear();
+	return true;
+}
+
+static uint64_t table_bytes(const cryxmlb_tables_t& tables) {
+	return tables.node_table.size() * sizeof(cry_xml_node_t) + tables.attr_table.size() * sizeof(cry_xml_ref_t)
+		+ tables.child_table.size() * sizeof(uint32_t) + tables.data_table.size();
+}
+
+// Writes the file from the spilled tables followed by what is still in
+// memory. The root's entries lead the child table.
+static bool write_cryxmlb_spilled(FILE* file, spill_tables_t* spill, const cryxmlb_tables_t& pending,
+	const table_vector_t<uint32_t>& root_children, const cryxmlb_table_sizes_t& sizes, output_buffer_t& staging) {
+	staging.clear();
+	write_cryxmlb_header(staging, sizes);
+	if (fwrite(staging.data(), 1, staging.size(), file) != staging.size()) {
+		return false;
+	}
+	return copy_spill_file(spill->files[0], spill->sizes.nodes * sizeof(cry_xml_node_t), file, staging)
+		&& write_entries(file, pending.node_table.data(), pending.node_table.size(), staging)
+		&& copy_spill_file(spill->files[1], spill->sizes.attributes * sizeof(cry_xml_ref_t), file, staging)
+		&& write_entries(file, pending.attr_table.data(), pending.attr_table.size(), staging)
+		&& write_entries(file, root_children.data(), root_children.size(), staging)
+		&& copy_spill_file(spill->files[2], spill->sizes.children * sizeof(uint32_t), file, staging)
+		&& write_entries(file, pending.child_table.data(), pending.child_table.size(), staging)
+		&& copy_spill_file(spill->files[3], spill->sizes.data_bytes, file, staging)
+		&& write_entries(file, pending.data_table.data(), pending.data_table.size(), staging);
+}
+
+// Renames filename to filename.xml.bak before it is overwritten
+static bool backup_source(const char* filename) {
 	const char* ext_str = "xml.bak";
 	char* backup_name = (char*)malloc(strlen(filename) + strlen(ext_str) + 2); // +2 for the dot and null terminator
 	if (!backup_name) {
 		fprintf(stderr, "Memory allocation failed\n");
-		return;
+		return false;
 	}
 	sprintf(backup_name, "%s.%s", filename, ext_str);
 
@@ -271,15 +761,272 @@ void convert_xml_to_cryxmlb(const char* filename) {
 	if (rename(filename, backup_name) != 0) {
 		fprintf(stderr, "Error creating backup file %s\n", backup_name);
 		free(backup_name);
-		return;
+		return false;
 	}
 	free(backup_name);
+	return true;
+}
+
+// Converts a file one child of the root at a time. The source is mapped
+// rather than read, each child is parsed and encoded on its own, and the
+// tables are moved to temporary files whenever they outgrow half of the
+// budget; the other half is left for the child being encoded. The output is
+// the same as the in-memory encoder's. Returns false without writing
+// anything if the document cannot be split at the root's children, so the
+// caller can convert it in memory (and report any parse error).
+static bool convert_xml_out_of_core(const char* filename, const convert_options_t* options, conversion_stats_t* stats, bool collect_stats) {
+	double start = stats_now();
+	mapped_file_t source = map_file(filename, true);
+	stats_phase_end(stats, STATS_READ, start);
+	if (!source.data || source.size == 0) {
+		unmap_file(&source);
+		return true;
+	}
+	stats->bytes_in = source.size;
+	if (source.data[0] == 'C') {
+		fprintf(options->messages, "File %s is already in CryXmlB format\n", filename);
+		unmap_file(&source);
+		return true;
+	}
+
+	start = stats_now();
+	const char* xml = (const char*)source.data;
+	xml_root_scan_t scan = {};
+	cryxmlb_tables_t pending; // Encoded but not spilled yet
+	if (!scan_root_children(xml, source.size, &scan) || !encode_root_element(xml, scan, pending)) {
+		unmap_file(&source);
+		return false;
+	}
+	if (collect_stats) {
+		stats->string_bytes = count_string_bytes(pending.node_table.data(), pending.node_table.size(),
+			pending.attr_table.data(), pending.attr_table.size(), pending.data_table.data(), pending.data_table.size());
+	}
+
+	// The root's entries are written ahead of the child table, so every
+	// other entry is shifted by their count
+	table_vector_t<uint32_t> root_children;
+	root_children.reserve(scan.children.size());
+	spill_tables_t spill;
+	cryxmlb_tables_t local;
+	output_buffer_t staging;
+	tinyxml2::XMLDocument doc;
+	uint64_t spill_threshold = options->memory_budget / 2;
+	cryxmlb_table_sizes_t sizes = table_sizes(pending);
+	sizes.children = scan.children.size();
+	for (const xml_span_t& span : scan.children) {
+		if (doc.Parse(xml + span.begin, span.end - span.begin) != tinyxml2::XML_SUCCESS || !doc.RootElement()) {
+			unmap_file(&source);
+			return false;
+		}
+		local.node_table.clear();
+		local.attr_table.clear();
+		local.child_table.clear();
+		local.data_table.clear();
+		const char* error = 0;
+		if (!encode_xml_tables(doc.RootElement(), local, &error)) {
+			fprintf(stderr, "Error encoding XML file %s: %s\n", filename, error);
+			unmap_file(&source);
+			return true;
+		}
+		if (collect_stats) {
+			stats->string_bytes += count_string_bytes(local.node_table.data(), local.node_table.size(),
+				local.attr_table.data(), local.attr_table.size(), local.data_table.data(), local.data_table.size());
+		}
+
+		cryxmlb_table_sizes_t base = sizes;
+		sizes.nodes += local.node_table.size();
+		sizes.attributes += local.attr_table.size();
+		sizes.children += local.child_table.size();
+		sizes.data_bytes += local.data_table.size();
+		if (!cryxmlb_fits(sizes)) {
+			fprintf(stderr, "File %s is too large for CryXmlB format\n", filename);
+			unmap_file(&source);
+			return true;
+		}
+
+		if (table_bytes(pending) > 0 && table_bytes(pending) + table_bytes(local) > spill_threshold) {
+			double spill_start = stats_now();
+			bool spilled = spill_tables(&spill, pending, filename, staging);
+			trace_event("phase", "spill", filename, spill_start, stats_now());
+			if (!spilled) {
+				fprintf(stderr, "Error writing temporary file for %s\n", filename);
+				unmap_file(&source);
+				return true;
+			}
+		}
+		root_children.push_back(static_cast<uint32_t>(base.nodes));
+		append_rebased(pending, local, base);
+	}
+	alloc_count_document(&doc);
+	unmap_file(&source);
+	stats_phase_end(stats, STATS_ENCODE, start);
+
+	stats->nodes = sizes.nodes;
+	stats->attributes = sizes.attributes;
+	stats->children = sizes.children;
+	stats->data_table_size = sizes.data_bytes;
+
+	start = stats_now();
+	if (!backup_source(filename)) {
+		return true;
+	}
+	FILE* file = fopen(filename, "wb");
+	if (!file) {
+		fprintf(stderr, "Error opening file %s\n", filename);
+		return true;
+	}
+	bool written = write_cryxmlb_spilled(file, &spill, pending, root_children, sizes, staging);
+	written = fclose(file) == 0 && written;
+	if (!written) {
+		fprintf(stderr, "Error writing CryXmlB file %s\n", filename);
+		return true;
+	}
+	stats_phase_end(stats, STATS_WRITE, start);
+	stats->bytes_out = cryxmlb_file_size(sizes);
+	stats->converted = true;
+	fprintf(options->messages, "Successfully converted %s to CryXmlB format\n", filename);
+	return true;
+}
+
+void convert_xml_to_cryxmlb(const char* filename, const convert_options_t* options, conversion_stats_t* stats) {
+	// Timings are always taken; they are only reported with --stats
+	conversion_stats_t unused_stats = {};
+	bool collect_stats = stats != 0;
+	if (!stats) {
+		stats = &unused_stats;
+	}
+	stats->filename = filename;
+	stats->to_cryxmlb = true;
+
+	// Allocations are only counted with --alloc-stats
+	alloc_tracker_t tracker = {};
+	alloc_scope_t tracking(options->track_allocations ? &tracker : 0);
+
+	// With a memory budget the file is encoded a child of the root at a
+	// time. Its tables bypass the arena, which would keep every buffer they
+	// outgrow until the next file.
+	if (options->memory_budget && options->layout != LAYOUT_BFS) {
+		arena_t* arena = thread_arena;
+		thread_arena = 0;
+		bool handled = convert_xml_out_of_core(filename, options, stats, collect_stats);
+		thread_arena = arena;
+		if (handled) {
+			stats->peak_memory = peak_memory_bytes();
+			if (options->track_allocations) {
+				alloc_report(&tracker, stats);
+			}
+			return;
+		}
+	}
+
+	// Read the XML file
+	double start = stats_now();
+	read_file_result_t xml_file = read_file(filename);
+	stats_phase_end(stats, STATS_READ, start);
+	if (!xml_file.data || xml_file.size == 0) {
+		return;
+	}
+	stats->bytes_in = xml_file.size;
+
+	// Check if the file is already in CryXmlB format
+	if (xml_file.size > 0 && xml_file.data[0] == 'C') {
+		fprintf(options->messages, "File %s is already in CryXmlB format\n", filename);
+		free(xml_file.data);
+		return;
+	}
+
+	// Create tables for CryXmlB format
+	cryxmlb_tables_t tables;
+
+	// Large documents are split at the root's children and encoded in
+	// parallel; parsing is then counted as part of encoding.
+	bool encoded = false;
+	if (options->threads > 1 && xml_file.size >= PARALLEL_PARSE_MIN_SIZE) {
+		start = stats_now();
+		encoded = encode_xml_parallel((const char*)xml_file.data, xml_file.size, options->threads, tables);
+		if (encoded) {
+			stats_phase_end(stats, STATS_ENCODE, start);
+			free(xml_file.data);
+		}
+		else {
+			tables = cryxmlb_tables_t();
+		}
+	}
+
+	if (!encoded) {
+		// Parse the XML
+		start = stats_now();
+		tinyxml2::XMLDocument doc;
+		tinyxml2::XMLError error = doc.Parse((const char*)xml_file.data, xml_file.size);
+		stats_phase_end(stats, STATS_PARSE, start);
+		if (error != tinyxml2::XML_SUCCESS) {
+			fprintf(stderr, "Error parsing XML file %s: %s\n", filename, doc.ErrorStr());
+			free(xml_file.data);
+			return;
+		}
+
+		// Free the original file data as we no longer need it
+		free(xml_file.data);
+
+		// Get the root element
+		tinyxml2::XMLElement* root = doc.RootElement();
+		if (!root) {
+			fprintf(stderr, "No root element found in XML file %s\n", filename);
+			return;
+		}
+
+		// Process the XML tree
+		start = stats_now();
+		const char* encode_error = 0;
+		if (!encode_xml_tables(root, tables, &encode_error)) {
+			fprintf(stderr, "Error encoding XML file %s: %s\n", filename, encode_error);
+			return;
+		}
+		stats_phase_end(stats, STATS_ENCODE, start);
+		alloc_count_document(&doc);
+	}
+
+	if (options->layout == LAYOUT_BFS) {
+		start = stats_now();
+		if (!layout_cryxmlb_bfs(tables)) {
+			fprintf(stderr, "Warning: %s cannot be laid out breadth first; writing it in document order\n", filename);
+		}
+		stats_phase_end(stats, STATS_ENCODE, start);
+	}
+
+	// Create the output buffer
+	start = stats_now();
+	output_buffer_t output_buffer;
+	serialize_cryxmlb(tables, output_buffer);
+	stats_phase_end(stats, STATS_SERIALIZE, start);
+
+	stats->nodes = tables.node_table.size();
+	stats->attributes = tables.attr_table.size();
+	stats->children = tables.child_table.size();
+	stats->data_table_size = tables.data_table.size();
+	if (collect_stats) {
+		stats->string_bytes = count_string_bytes(tables.node_table.data(), tables.node_table.size(),
+			tables.attr_table.data(), tables.attr_table.size(), tables.data_table.data(), tables.data_table.size());
+	}
+
+	// Create backup of the original file
+	start = stats_now();
+	if (!backup_source(filename)) {
+		return;
+	}
 
 	// Write the CryXmlB file
 	if (!write_file(filename, output_buffer.data(), output_buffer.size())) {
 		fprintf(stderr, "Error writing CryXmlB file %s\n", filename);
 	}
 	else {
-		fprintf(stdout, "Successfully converted %s to CryXmlB format\n", filename);
+		stats_phase_end(stats, STATS_WRITE, start);
+		stats->bytes_out = output_buffer.size();
+		stats->converted = true;
+		fprintf(options->messages, "Successfully converted %s to CryXmlB format\n", filename);
 	}
-}
\ No newline at end of file
+	stats->peak_memory = peak_memory_bytes();
+	if (options->track_allocations) {
+		alloc_report(&tracker, stats);
+	}
+}